@@ -0,0 +1,358 @@
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#include "disk.h"
+#include "fs.h"
+#include "trace.h"
+
+/*
+ * Micro benchmarks of the fs.h operations. Every operation runs in a loop on
+ * a scratch image, for each file size, directory depth and fill level asked
+ * for, and one JSON object per loop is printed: operations per second,
+ * latency percentiles and block I/Os per operation.
+ */
+
+/* Swallows the messages the operations print */
+class null_buf : public streambuf {
+protected:
+    int overflow(int c) { return c; }
+};
+
+/* Options of the run */
+struct bench_opts {
+    const char *image;
+    const char *trace; // Chrome trace of the run, NULL for none
+    size_t numBlocks;
+    size_t blockSize;
+    size_t cacheBlocks; // 0 for the default
+    int flags;
+    int ops; // operations per loop
+    vector<size_t> sizes; // file sizes in bytes
+    vector<int> depths; // directories above the files
+    vector<int> fills; // percent of the image taken before the loops
+};
+
+/* A loop to measure */
+struct bench_loop {
+    const char *op;
+    size_t size;
+    int depth;
+    int fill;
+};
+
+static null_buf devnull;
+static bool first_result = true;
+
+/**
+ * quiet - silence or restore the messages of the operations
+ * @on: silence them if set
+*/
+static void quiet(bool on)
+{
+    static streambuf *out, *err;
+
+    if (on) {
+        out = cout.rdbuf(&devnull);
+        err = cerr.rdbuf(&devnull);
+    } else {
+        cout.rdbuf(out);
+        cerr.rdbuf(err);
+    }
+}
+
+/**
+ * percentile - get a latency percentile
+ * @sorted: the latencies of a loop, in increasing order
+ * @p: the percentile, between 0 and 1
+*/
+static double percentile(const vector<double> &sorted, double p)
+{
+    size_t i = (size_t)(p * sorted.size());
+
+    return sorted[min(i, sorted.size() - 1)];
+}
+
+/**
+ * run_loop - time an operation and print its results
+ * @loop: what is measured, for the report
+ * @n: the number of operations
+ * @op: runs the i-th operation, returns -1 on error
+ *
+ * Return: the number of operations that failed
+*/
+static int run_loop(const bench_loop &loop, int n, const function<int(int)> &op)
+{
+    typedef chrono::steady_clock clock;
+    vector<double> lat;
+    struct block_stats before, after;
+    int errors = 0;
+
+    lat.reserve(n);
+    block_get_stats(&before);
+    clock::time_point start = clock::now();
+    for (int i = 0; i < n; i++) {
+        clock::time_point t = clock::now();
+        if (op(i) != 0)
+            errors++;
+        lat.push_back(chrono::duration<double, micro>(clock::now() - t).count());
+    }
+    double total = chrono::duration<double>(clock::now() - start).count();
+    block_get_stats(&after);
+    sort(lat.begin(), lat.end());
+
+    size_t ios = after.reads + after.writes - before.reads - before.writes;
+    size_t blocks = after.blocks_read + after.blocks_written
+                    - before.blocks_read - before.blocks_written;
+    printf("%s    {\"op\": \"%s\", \"size\": %zu, \"depth\": %d, \"fill\": %d, "
+           "\"ops\": %d, \"errors\": %d, \"ops_per_sec\": %.1f, "
+           "\"p50_us\": %.2f, \"p99_us\": %.2f, \"p999_us\": %.2f, "
+           "\"io_per_op\": %.3f, \"blocks_per_op\": %.3f, \"syncs_per_op\": %.3f}",
+           first_result ? "" : ",\n", loop.op, loop.size, loop.depth, loop.fill,
+           n, errors, total > 0 ? n / total : 0.0,
+           percentile(lat, 0.5), percentile(lat, 0.99), percentile(lat, 0.999),
+           (double)ios / n, (double)blocks / n,
+           (double)(after.syncs - before.syncs) / n);
+    first_result = false;
+
+    return errors;
+}
+
+/**
+ * name_of - get the i-th name of a loop
+ * @i: the index
+ *
+ * Names hold FS_FILENAME_LEN characters at most.
+*/
+static string name_of(int i)
+{
+    static const char digits[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+    string name;
+
+    for (int k = 0; k < 3; k++, i /= 36)
+        name += digits[i % 36];
+
+    return name;
+}
+
+/**
+ * fill_image - take a share of the image with one file
+ * @percent: the share of the blocks to take
+ *
+ * Return: -1 if the file can't be written, 0 otherwise
+*/
+static int fill_image(const bench_opts &o, int percent)
+{
+    size_t bytes = o.numBlocks * o.blockSize / 100 * percent;
+    string chunk(64 * o.blockSize, 'f');
+
+    if (percent == 0)
+        return 0;
+    // name_of() never makes this name
+    if (create_file("/_f_.f", 0) != 0)
+        return -1;
+    int fd = open_file("/_f_.f", 1);
+    if (fd < 0)
+        return -1;
+    for (size_t done = 0; done < bytes; done += chunk.size()) {
+        size_t n = min(chunk.size(), bytes - done);
+        if (fs_pwrite(fd, chunk.data(), n, done) != (ssize_t)n) {
+            fs_close(fd);
+            return -1;
+        }
+    }
+
+    return fs_close(fd);
+}
+
+/**
+ * bench_files - run the file loops in one directory
+ * @dir: the directory, "" for the root
+ *
+ * Return: the number of operations that failed
+*/
+static int bench_files(const bench_opts &o, const string &dir, int depth, int fill)
+{
+    int errors = 0;
+
+    for (size_t size : o.sizes) {
+        string data(size, 'x');
+        auto path = [&](int i) { return dir + "/" + name_of(i) + ".t"; };
+        auto loop = [&](const char *op) { return bench_loop{op, size, depth, fill}; };
+
+        errors += run_loop(loop("create_file"), o.ops, [&](int i) {
+            return create_file(path(i), 0);
+        });
+        // the file is open and closed by the call, the close writes out the
+        // appends
+        errors += run_loop(loop("write_file"), o.ops, [&](int i) {
+            return write_file(path(i), data, size);
+        });
+        errors += run_loop(loop("open_file"), o.ops, [&](int i) {
+            int fd = open_file(path(i), 0);
+            return fd < 0 ? -1 : fs_close(fd);
+        });
+        errors += run_loop(loop("read_file"), o.ops, [&](int i) {
+            return read_file(path(i), size);
+        });
+        errors += run_loop(loop("typefile"), o.ops, [&](int i) {
+            return typefile(path(i));
+        });
+        errors += run_loop(loop("delete_file"), o.ops, [&](int i) {
+            return delete_file(path(i));
+        });
+    }
+
+    bench_loop dirs = {"md", 0, depth, fill};
+    errors += run_loop(dirs, o.ops, [&](int i) {
+        return md(dir + "/" + name_of(i));
+    });
+    dirs.op = "dir";
+    errors += run_loop(dirs, o.ops, [&](int i) {
+        return ::dir(dir + "/" + name_of(i));
+    });
+    dirs.op = "rd";
+    errors += run_loop(dirs, o.ops, [&](int i) {
+        return rd(dir + "/" + name_of(i));
+    });
+
+    return errors;
+}
+
+/**
+ * bench_image - run every loop on a fresh image taken up to a fill level
+ *
+ * Return: the number of operations that failed, -1 if the image is unusable
+*/
+static int bench_image(const bench_opts &o, int fill)
+{
+    int errors = 0;
+
+    quiet(true);
+    if (fs_format(o.image, o.numBlocks, o.blockSize) != 0
+        || fs_mount_cache(o.image, o.flags, o.cacheBlocks) != 0) {
+        quiet(false);
+        return -1;
+    }
+    if (fill_image(o, fill) != 0) {
+        fs_umount(o.image);
+        quiet(false);
+        return -1;
+    }
+
+    for (int depth : o.depths) {
+        string dir;
+        for (int d = 0; d < depth; d++) {
+            dir += "/d" + to_string(d);
+            md(dir);
+        }
+        errors += bench_files(o, dir, depth, fill);
+        for (int d = depth; d > 0; d--) {
+            rd(dir);
+            dir.erase(dir.rfind('/'));
+        }
+    }
+
+    fs_umount(o.image);
+    quiet(false);
+
+    return errors;
+}
+
+/**
+ * parse_list - parse a comma separated list of numbers
+ * @arg: the list
+ * @list: filled with the numbers
+*/
+template <typename T>
+static void parse_list(const char *arg, vector<T> *list)
+{
+    char *end;
+
+    list->clear();
+    for (;;) {
+        list->push_back((T)strtoull(arg, &end, 0));
+        if (*end != ',')
+            break;
+        arg = end + 1;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    bench_opts o = {"bench.img", NULL, 65536, 1024, 0, 0, 200, {128, 4096, 16384}, {0, 4}, {0, 50, 90}};
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:t:n:b:c:mo:s:d:p:")) != -1) {
+        switch (opt) {
+        case 'i': // scratch image, overwritten
+            o.image = optarg;
+            break;
+        case 't':
+            o.trace = optarg;
+            break;
+        case 'n':
+            o.numBlocks = strtoull(optarg, NULL, 0);
+            break;
+        case 'b':
+            o.blockSize = strtoull(optarg, NULL, 0);
+            break;
+        case 'c':
+            o.cacheBlocks = strtoull(optarg, NULL, 0);
+            break;
+        case 'm':
+            o.flags |= FS_MOUNT_MMAP;
+            break;
+        case 'o': // operations per loop
+            o.ops = atoi(optarg);
+            break;
+        case 's':
+            parse_list(optarg, &o.sizes);
+            break;
+        case 'd':
+            parse_list(optarg, &o.depths);
+            break;
+        case 'p':
+            parse_list(optarg, &o.fills);
+            break;
+        default:
+            cerr << "Use: " << argv[0] << " [-i image] [-t trace] [-n blocks] [-b block_size] [-c cache_blocks] [-m]"
+                 << " [-o ops] [-s sizes] [-d depths] [-p fill_percents]" << endl;
+            return 1;
+        }
+    }
+    if (o.ops <= 0 || o.ops > 36 * 36 * 36) {
+        cerr << "the number of operations must be within 1 and " << 36 * 36 * 36 << endl;
+        return 1;
+    }
+
+    int errors = 0;
+    if (o.trace)
+        trace_start();
+    printf("{\n  \"block_size\": %zu, \"blocks\": %zu, \"mapped\": %s,\n  \"results\": [\n",
+           o.blockSize, o.numBlocks, o.flags & FS_MOUNT_MMAP ? "true" : "false");
+    for (int fill : o.fills) {
+        int ret = bench_image(o, fill);
+        if (ret < 0) {
+            cerr << "can't prepare " << o.image << " filled at " << fill << "%" << endl;
+            return 1;
+        }
+        errors += ret;
+    }
+    printf("\n  ],\n  \"errors\": %d\n}\n", errors);
+    unlink(o.image);
+    if (o.trace) {
+        trace_stop();
+        if (trace_dump(o.trace) != 0)
+            return 1;
+    }
+
+    return errors ? 1 : 0;
+}
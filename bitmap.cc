@@ -0,0 +1,139 @@
+#include "bitmap.h"
+
+/** Bits in a bitmap word */
+#define WORD_BITS 64
+
+void bitmap_init(struct bitmap *bm, size_t nbits)
+{
+    bm->words.assign((nbits + WORD_BITS - 1) / WORD_BITS, 0);
+    bm->nbits = nbits;
+    bm->cursor = 0;
+    bm->nfree = 0;
+    bm->allocs = 0;
+    bm->scanned = 0;
+}
+
+void bitmap_set_free(struct bitmap *bm, size_t bit)
+{
+    uint64_t mask = 1ULL << (bit % WORD_BITS);
+    uint64_t &word = bm->words[bit / WORD_BITS];
+
+    if (!(word & mask)) {
+        word |= mask;
+        bm->nfree++;
+    }
+}
+
+void bitmap_set_used(struct bitmap *bm, size_t bit)
+{
+    uint64_t mask = 1ULL << (bit % WORD_BITS);
+    uint64_t &word = bm->words[bit / WORD_BITS];
+
+    if (word & mask) {
+        word &= ~mask;
+        bm->nfree--;
+    }
+}
+
+bool bitmap_is_free(const struct bitmap *bm, size_t bit)
+{
+    return bm->words[bit / WORD_BITS] & (1ULL << (bit % WORD_BITS));
+}
+
+long bitmap_alloc(struct bitmap *bm)
+{
+    size_t nwords = bm->words.size();
+
+    if (bm->nfree == 0)
+        return -1;
+
+    bm->allocs++;
+    for (size_t n = 0; n < nwords; n++) {
+        size_t w = (bm->cursor + n) % nwords;
+        bm->scanned++;
+        if (bm->words[w]) {
+            size_t bit = w * WORD_BITS + __builtin_ctzll(bm->words[w]);
+            bm->words[w] &= bm->words[w] - 1; // clear the lowest set bit
+            bm->nfree--;
+            bm->cursor = w;
+            return bit;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * run_length - Count the free blocks starting at a block
+ * @bm: Bitmap
+ * @bit: First block, free
+ * @max: Stop counting at this many blocks
+ */
+static size_t run_length(const struct bitmap *bm, size_t bit, size_t max)
+{
+    size_t len = 0;
+
+    while (len < max && bit < bm->nbits) {
+        size_t off = bit % WORD_BITS;
+        uint64_t rest = ~(bm->words[bit / WORD_BITS] >> off);
+        size_t n = rest ? __builtin_ctzll(rest) : WORD_BITS;
+        if (n > WORD_BITS - off)
+            n = WORD_BITS - off;
+        len += n;
+        bit += n;
+        if (off + n < WORD_BITS)
+            break; // hit a used block inside this word
+    }
+
+    return len < max ? len : max;
+}
+
+long bitmap_alloc_run(struct bitmap *bm, size_t want, size_t *len)
+{
+    size_t nwords = bm->words.size();
+    long best = -1;
+    size_t best_len = 0;
+
+    *len = 0;
+    if (bm->nfree == 0 || want == 0)
+        return -1;
+
+    bm->allocs++;
+    for (size_t n = 0; n < nwords && best_len < want; n++) {
+        size_t w = (bm->cursor + n) % nwords;
+        uint64_t word = bm->words[w];
+        bm->scanned++;
+        while (word) {
+            size_t bit = __builtin_ctzll(word);
+            size_t run = run_length(bm, w * WORD_BITS + bit, want);
+            if (run > best_len) {
+                best = w * WORD_BITS + bit;
+                best_len = run;
+                if (best_len >= want)
+                    break;
+            }
+            // skip the rest of this run inside the word
+            if (bit + run >= WORD_BITS)
+                break;
+            word &= ~0ULL << (bit + run);
+        }
+    }
+
+    for (size_t i = 0; i < best_len; i++)
+        bitmap_set_used(bm, best + i);
+    bm->cursor = ((best + best_len) / WORD_BITS) % nwords;
+    *len = best_len;
+
+    return best;
+}
+
+size_t bitmap_recount(struct bitmap *bm)
+{
+    size_t count = 0;
+
+    for (uint64_t word : bm->words)
+        count += __builtin_popcountll(word);
+    bm->nfree = count;
+
+    return count;
+}
@@ -0,0 +1,92 @@
+#ifndef _BITMAP_H
+#define _BITMAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Free-space bitmap: one bit per block, set when the block is free. Free
+ * blocks are found a 64-bit word at a time with ctz, starting from a next-fit
+ * cursor, and the number of free blocks is kept up to date on every change.
+ */
+struct bitmap {
+    std::vector<uint64_t> words;
+    /* Number of blocks described */
+    size_t nbits;
+    /* Word where the next search starts */
+    size_t cursor;
+    /* Number of bits set */
+    size_t nfree;
+    /* Allocations and the words they scanned, reset by bitmap_init() */
+    size_t allocs;
+    size_t scanned;
+};
+
+/**
+ * bitmap_init - Set up a bitmap
+ * @bm: Bitmap to set up
+ * @nbits: Number of blocks to describe
+ *
+ * Every block starts as used.
+ */
+void bitmap_init(struct bitmap *bm, size_t nbits);
+
+/**
+ * bitmap_set_free - Mark a block free
+ * @bm: Bitmap
+ * @bit: Index of the block
+ */
+void bitmap_set_free(struct bitmap *bm, size_t bit);
+
+/**
+ * bitmap_set_used - Mark a block used
+ * @bm: Bitmap
+ * @bit: Index of the block
+ */
+void bitmap_set_used(struct bitmap *bm, size_t bit);
+
+/**
+ * bitmap_is_free - Test a block
+ * @bm: Bitmap
+ * @bit: Index of the block
+ *
+ * Return: true if block @bit is free.
+ */
+bool bitmap_is_free(const struct bitmap *bm, size_t bit);
+
+/**
+ * bitmap_alloc - Allocate a free block
+ * @bm: Bitmap
+ *
+ * Find the first free block at or after the cursor (wrapping around), mark it
+ * used and move the cursor to its word.
+ *
+ * Return: -1 if no block is free. Index of the allocated block otherwise.
+ */
+long bitmap_alloc(struct bitmap *bm);
+
+/**
+ * bitmap_alloc_run - Allocate contiguous free blocks
+ * @bm: Bitmap
+ * @want: Number of blocks wanted
+ * @len: Filled with the number of blocks allocated
+ *
+ * Find the first run of @want free blocks at or after the cursor (wrapping
+ * around) and mark it used. If no run is long enough, the longest one found
+ * is used instead, so *@len may be smaller than @want.
+ *
+ * Return: -1 if no block is free. Index of the first allocated block
+ * otherwise.
+ */
+long bitmap_alloc_run(struct bitmap *bm, size_t want, size_t *len);
+
+/**
+ * bitmap_recount - Recompute the free count
+ * @bm: Bitmap
+ *
+ * Return: the number of free blocks, counted with popcount.
+ */
+size_t bitmap_recount(struct bitmap *bm);
+
+#endif
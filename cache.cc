@@ -0,0 +1,704 @@
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "cache.h"
+
+using namespace std;
+
+/** Null link of the LRU list */
+#define NIL -1
+
+/** One cached block */
+struct buffer {
+    /* Block held by this buffer */
+    size_t block;
+    /* Set once the buffer holds a block */
+    bool valid;
+    /* Set when the buffer differs from the disk */
+    bool dirty;
+    /* Number of cache_get() without a matching cache_put() */
+    int pins;
+    /* LRU list links (most recent at the head) */
+    int prev;
+    int next;
+    /* Block content, inside the pool */
+    char *data;
+};
+
+/** State of a read ahead buffer */
+enum prefetch_state {
+    PREFETCH_FREE,
+    /* The read is queued or about to be */
+    PREFETCH_LOADING,
+    /* The blocks are in @data */
+    PREFETCH_READY,
+};
+
+/** A run of blocks read ahead of their use, see cache_prefetch() */
+struct prefetch {
+    enum prefetch_state state;
+    /* First block and number of blocks of the run */
+    size_t block;
+    size_t count;
+    /* The read was handed to block_read_async(), @aio can be waited for */
+    bool submitted;
+    /* A block of the run was written meanwhile, the read is dropped */
+    bool stale;
+    /* Order of the reads, the oldest ready run is recycled first */
+    size_t seq;
+    vector<char> data;
+    struct block_aio aio;
+};
+
+/** Buffer cache instance description */
+struct cache {
+    vector<buffer> bufs;
+    /* Backing memory of every buffer */
+    vector<char> pool;
+    /* Block size of the disk */
+    size_t bsize;
+    /* Block index to buffer index */
+    unordered_map<size_t, int> map;
+    int head;
+    int tail;
+    /* The disk is mapped: blocks are used in place, no buffer is needed */
+    bool mapped;
+    /* Runs read ahead, outside of the buffers so they don't evict them */
+    vector<struct prefetch> prefetch;
+    size_t prefetch_seq;
+    struct cache_stats stats;
+    /* Guards every field, block contents are guarded by the pins */
+    mutex lock;
+};
+
+/* Cache of the threads that did not pick one */
+static struct cache cache0 = {
+    {}, {}, 0, {}, NIL, NIL, false, {}, 0, {0, 0, 0, 0, 0, 0}
+};
+
+/* Cache of the calling thread, see cache_use() */
+static thread_local struct cache *cache = &cache0;
+
+static void lru_unlink(int i)
+{
+    buffer &b = cache->bufs[i];
+
+    if (b.prev != NIL)
+        cache->bufs[b.prev].next = b.next;
+    else
+        cache->head = b.next;
+    if (b.next != NIL)
+        cache->bufs[b.next].prev = b.prev;
+    else
+        cache->tail = b.prev;
+    b.prev = b.next = NIL;
+}
+
+static void lru_push_front(int i)
+{
+    buffer &b = cache->bufs[i];
+
+    b.prev = NIL;
+    b.next = cache->head;
+    if (cache->head != NIL)
+        cache->bufs[cache->head].prev = i;
+    cache->head = i;
+    if (cache->tail == NIL)
+        cache->tail = i;
+}
+
+static int writeback(buffer &b)
+{
+    if (!b.valid || !b.dirty)
+        return 0;
+
+    if (block_write(b.block, b.data) < 0)
+        return -1;
+    b.dirty = false;
+    cache->stats.writebacks++;
+
+    return 0;
+}
+
+/**
+ * overlay_dirty - Copy the dirty cached blocks of a run over its disk content
+ * @block: Index of the first block
+ * @count: Number of blocks
+ * @buf: The blocks as read from the disk
+ */
+static void overlay_dirty(size_t block, size_t count, void *buf)
+{
+    // cached copies may be newer than the disk
+    for (size_t i = 0; i < count; i++) {
+        auto it = cache->map.find(block + i);
+        if (it != cache->map.end() && cache->bufs[it->second].dirty)
+            memcpy((char *)buf + i * cache->bsize, cache->bufs[it->second].data,
+                   cache->bsize);
+    }
+}
+
+/**
+ * find_prefetch - Find the run read ahead that holds a block
+ * @block: Index of the block
+ *
+ * Return: NULL if @block is not read ahead. The run otherwise.
+ */
+static struct prefetch *find_prefetch(size_t block)
+{
+    for (auto &p : cache->prefetch) {
+        if (p.state != PREFETCH_FREE && block >= p.block
+            && block < p.block + p.count)
+            return &p;
+    }
+
+    return NULL;
+}
+
+/**
+ * wait_prefetch - Wait for the read ahead of a block
+ * @lock: The cache lock, held, released while waiting
+ * @block: Index of the block
+ *
+ * Return: false if @block is not being read ahead, or its read is not queued
+ * yet: the block is then read from the disk rather than waited for. true once
+ * the read completed, and anything looked up before may have changed.
+ */
+static bool wait_prefetch(unique_lock<mutex> &lock, size_t block)
+{
+    struct prefetch *p = find_prefetch(block);
+
+    if (!p || p->state != PREFETCH_LOADING || !p->submitted)
+        return false;
+
+    lock.unlock();
+    block_aio_wait(&p->aio);
+    lock.lock();
+
+    return true;
+}
+
+/**
+ * refresh_prefetched - Update the read ahead of blocks that are written
+ * @block: Index of the first block
+ * @count: Number of blocks
+ * @buf: The new content of the blocks
+ *
+ * The copies read ahead are overwritten, a read ahead still in flight may
+ * return the old content and is dropped.
+ */
+static void refresh_prefetched(size_t block, size_t count, const void *buf)
+{
+    for (auto &p : cache->prefetch) {
+        if (p.state == PREFETCH_FREE || block >= p.block + p.count
+            || p.block >= block + count)
+            continue;
+        if (p.state == PREFETCH_LOADING) {
+            p.stale = true;
+            continue;
+        }
+        size_t first = max(block, p.block);
+        size_t end = min(block + count, p.block + p.count);
+        memcpy(&p.data[(first - p.block) * cache->bsize],
+               (const char *)buf + (first - block) * cache->bsize,
+               (end - first) * cache->bsize);
+    }
+}
+
+/**
+ * read_prefetched - Copy a run of blocks from the runs read ahead
+ * @lock: The cache lock, held, released while waiting for a read ahead
+ * @block: Index of the first block
+ * @count: Number of blocks
+ * @buf: Data buffer to be filled with content of the blocks
+ *
+ * A run read ahead is released once its last block is copied: a sequential
+ * reader doesn't come back to it.
+ *
+ * Return: false if a block was not read ahead, the run must then be read from
+ * the disk. true once @buf holds the blocks, with the dirty cached blocks
+ * copied over them.
+ */
+static bool read_prefetched(unique_lock<mutex> &lock, size_t block,
+                            size_t count, void *buf)
+{
+    for (size_t i = 0; i < count; ) {
+        struct prefetch *p = find_prefetch(block + i);
+        if (!p)
+            return false;
+        if (p->state == PREFETCH_LOADING) {
+            if (!wait_prefetch(lock, block + i))
+                return false;
+            i = 0;
+            continue;
+        }
+        i = p->block + p->count - block;
+    }
+
+    for (size_t i = 0; i < count; ) {
+        struct prefetch *p = find_prefetch(block + i);
+        size_t n = min(count - i, p->block + p->count - (block + i));
+        memcpy((char *)buf + i * cache->bsize,
+               &p->data[(block + i - p->block) * cache->bsize], n * cache->bsize);
+        if (block + i + n == p->block + p->count)
+            p->state = PREFETCH_FREE;
+        i += n;
+    }
+    overlay_dirty(block, count, buf);
+    cache->stats.readahead_hits += count;
+
+    return true;
+}
+
+/**
+ * lookup - Find or load the buffer of a block
+ * @lock: The cache lock, held, released while waiting for a read ahead
+ * @block: Index of the block
+ * @fill: Read the block from the disk on a miss
+ *
+ * Return: -1 if no buffer can be freed or the read fails. Index of the buffer
+ * holding @block otherwise, moved to the head of the LRU list.
+ */
+static int lookup(unique_lock<mutex> &lock, size_t block, bool fill)
+{
+    // a read ahead in flight is closer to completion than a new read
+    while (fill && !cache->map.count(block) && wait_prefetch(lock, block))
+        ;
+
+    auto it = cache->map.find(block);
+    if (it != cache->map.end()) {
+        cache->stats.hits++;
+        lru_unlink(it->second);
+        lru_push_front(it->second);
+        return it->second;
+    }
+    cache->stats.misses++;
+
+    // recycle the least recently used buffer that is not pinned
+    int victim = cache->tail;
+    while (victim != NIL && cache->bufs[victim].pins > 0)
+        victim = cache->bufs[victim].prev;
+    if (victim == NIL) {
+        cout << "every cache buffer is pinned" << endl;
+        return -1;
+    }
+
+    buffer &b = cache->bufs[victim];
+    if (b.valid) {
+        if (writeback(b) < 0)
+            return -1;
+        cache->map.erase(b.block);
+        cache->stats.evictions++;
+        b.valid = false;
+    }
+
+    struct prefetch *p = fill ? find_prefetch(block) : NULL;
+    if (p && p->state == PREFETCH_READY) {
+        memcpy(b.data, &p->data[(block - p->block) * cache->bsize],
+               cache->bsize);
+        cache->stats.readahead_hits++;
+    } else if (fill && block_read(block, b.data) < 0) {
+        return -1;
+    }
+
+    b.block = block;
+    b.valid = true;
+    b.dirty = false;
+    cache->map[block] = victim;
+    lru_unlink(victim);
+    lru_push_front(victim);
+
+    return victim;
+}
+
+struct cache *cache_new(void)
+{
+    struct cache *c = new struct cache();
+
+    c->head = c->tail = NIL;
+
+    return c;
+}
+
+int cache_delete(struct cache *c)
+{
+    if (!c || c == &cache0 || c == cache || !c->bufs.empty()) {
+        cout << "cache in use" << endl;
+        return -1;
+    }
+
+    delete c;
+
+    return 0;
+}
+
+struct cache *cache_use(struct cache *c)
+{
+    struct cache *prev = cache;
+
+    cache = c ? c : &cache0;
+
+    return prev == &cache0 ? NULL : prev;
+}
+
+int cache_init(size_t capacity)
+{
+    if (capacity == 0) {
+        cout << "cache capacity must be positive" << endl;
+        return -1;
+    }
+
+    lock_guard<mutex> guard(cache->lock);
+
+    memset(&cache->stats, 0, sizeof(cache->stats));
+    cache->mapped = block_map(0) != NULL;
+    if (cache->mapped) {
+        cache->bufs.clear();
+        cache->map.clear();
+        cache->head = cache->tail = NIL;
+        return 0;
+    }
+
+    cache->bsize = block_disk_block_size();
+    cache->pool.assign(capacity * cache->bsize, 0);
+    cache->bufs.assign(capacity, buffer());
+    cache->map.clear();
+    cache->map.reserve(capacity);
+    cache->head = cache->tail = NIL;
+    for (size_t i = 0; i < capacity; i++) {
+        cache->bufs[i].valid = false;
+        cache->bufs[i].dirty = false;
+        cache->bufs[i].pins = 0;
+        cache->bufs[i].prev = cache->bufs[i].next = NIL;
+        cache->bufs[i].data = &cache->pool[i * cache->bsize];
+        lru_push_front(i);
+    }
+    cache->prefetch.assign(CACHE_PREFETCH_RUNS, prefetch());
+    for (auto &p : cache->prefetch)
+        p.aio.completed = true;
+
+    return 0;
+}
+
+static int flush(void);
+
+int cache_destroy(void)
+{
+    // the runs being read ahead land in memory that goes away
+    for (auto &p : cache->prefetch)
+        block_aio_wait(&p.aio);
+
+    lock_guard<mutex> guard(cache->lock);
+    int ret = flush();
+
+    cache->bufs.clear();
+    cache->pool.clear();
+    cache->map.clear();
+    cache->prefetch.clear();
+    cache->head = cache->tail = NIL;
+
+    return ret;
+}
+
+int cache_read(size_t block, void *buf)
+{
+    if (cache->mapped)
+        return block_read(block, buf);
+
+    unique_lock<mutex> lock(cache->lock);
+    int i = lookup(lock, block, true);
+    if (i < 0)
+        return -1;
+
+    memcpy(buf, cache->bufs[i].data, cache->bsize);
+
+    return 0;
+}
+
+int cache_write(size_t block, const void *buf)
+{
+    if (cache->mapped)
+        return block_write(block, buf);
+
+    unique_lock<mutex> lock(cache->lock);
+    // the whole block is overwritten, no need to read it first
+    int i = lookup(lock, block, false);
+    if (i < 0)
+        return -1;
+
+    memcpy(cache->bufs[i].data, buf, cache->bsize);
+    cache->bufs[i].dirty = true;
+    refresh_prefetched(block, 1, buf);
+
+    return 0;
+}
+
+void *cache_get(size_t block)
+{
+    if (cache->mapped)
+        return block_map(block);
+
+    unique_lock<mutex> lock(cache->lock);
+    int i = lookup(lock, block, true);
+    if (i < 0)
+        return NULL;
+
+    cache->bufs[i].pins++;
+
+    return cache->bufs[i].data;
+}
+
+int cache_put(size_t block, int dirty)
+{
+    if (cache->mapped)
+        return 0;
+
+    lock_guard<mutex> guard(cache->lock);
+    auto it = cache->map.find(block);
+    if (it == cache->map.end() || cache->bufs[it->second].pins == 0) {
+        cout << "block " << block << " is not pinned" << endl;
+        return -1;
+    }
+
+    buffer &b = cache->bufs[it->second];
+    b.pins--;
+    if (dirty) {
+        b.dirty = true;
+        refresh_prefetched(block, 1, b.data);
+    }
+
+    return 0;
+}
+
+int cache_read_run(size_t block, size_t count, void *buf)
+{
+    if (cache->mapped)
+        return block_read_run(block, count, buf);
+
+    unique_lock<mutex> lock(cache->lock);
+    if (read_prefetched(lock, block, count, buf))
+        return 0;
+    lock.unlock();
+
+    if (block_read_run(block, count, buf) < 0)
+        return -1;
+    lock.lock();
+    overlay_dirty(block, count, buf);
+
+    return 0;
+}
+
+int cache_write_run(size_t block, size_t count, const void *buf)
+{
+    if (cache->mapped)
+        return block_write_run(block, count, buf);
+
+    if (block_write_run(block, count, buf) < 0)
+        return -1;
+
+    lock_guard<mutex> guard(cache->lock);
+    refresh_prefetched(block, count, buf);
+    // cached copies now match the disk
+    for (size_t i = 0; i < count; i++) {
+        auto it = cache->map.find(block + i);
+        if (it != cache->map.end()) {
+            memcpy(cache->bufs[it->second].data, (const char *)buf + i * cache->bsize,
+                   cache->bsize);
+            cache->bufs[it->second].dirty = false;
+        }
+    }
+
+    return 0;
+}
+
+static void read_run_done(struct block_aio *aio)
+{
+    if (aio->ret != 0)
+        return;
+
+    lock_guard<mutex> guard(cache->lock);
+    overlay_dirty(aio->block, aio->count, aio->buf);
+}
+
+int cache_read_run_async(size_t block, size_t count, void *buf,
+                         struct block_aio *aio)
+{
+    aio->done = cache->mapped ? NULL : read_run_done;
+    aio->arg = NULL;
+
+    unique_lock<mutex> lock(cache->lock);
+    if (!cache->mapped && read_prefetched(lock, block, count, buf)) {
+        // nothing to queue, the request is complete already
+        aio->ret = 0;
+        aio->completed = true;
+        return 0;
+    }
+    lock.unlock();
+
+    return block_read_async(block, count, buf, aio);
+}
+
+static void write_run_done(struct block_aio *aio)
+{
+    if (aio->ret < 0)
+        return;
+
+    lock_guard<mutex> guard(cache->lock);
+    // a read ahead queued meanwhile may have seen the old content
+    refresh_prefetched(aio->block, aio->count, aio->buf);
+    // unless they changed since, the cached copies now match the disk
+    for (size_t i = 0; i < aio->count; i++) {
+        auto it = cache->map.find(aio->block + i);
+        if (it != cache->map.end()
+            && !memcmp(cache->bufs[it->second].data,
+                       (const char *)aio->buf + i * cache->bsize, cache->bsize))
+            cache->bufs[it->second].dirty = false;
+    }
+}
+
+int cache_write_run_async(size_t block, size_t count, const void *buf,
+                          struct block_aio *aio)
+{
+    aio->done = cache->mapped ? NULL : write_run_done;
+    aio->arg = NULL;
+
+    // not held over the submission: it may reap, and call write_run_done()
+    unique_lock<mutex> guard(cache->lock);
+    refresh_prefetched(block, count, buf);
+    for (size_t i = 0; !cache->mapped && i < count; i++) {
+        auto it = cache->map.find(block + i);
+        if (it != cache->map.end()) {
+            memcpy(cache->bufs[it->second].data, (const char *)buf + i * cache->bsize,
+                   cache->bsize);
+            cache->bufs[it->second].dirty = true;
+        }
+    }
+    guard.unlock();
+
+    return block_write_async(block, count, buf, aio);
+}
+
+static void prefetch_done(struct block_aio *aio)
+{
+    struct prefetch *p = (struct prefetch *)aio->arg;
+
+    lock_guard<mutex> guard(cache->lock);
+    p->state = aio->ret == 0 && !p->stale ? PREFETCH_READY : PREFETCH_FREE;
+}
+
+int cache_prefetch(size_t block, size_t count)
+{
+    if (cache->mapped)
+        return 0;
+
+    unique_lock<mutex> lock(cache->lock);
+    // only the blocks that are neither cached nor read ahead already: a dirty
+    // cached block would be read back older than it is
+    while (count > 0 && (cache->map.count(block) || find_prefetch(block))) {
+        block++;
+        count--;
+    }
+    size_t n = 0;
+    while (n < count && !cache->map.count(block + n) && !find_prefetch(block + n))
+        n++;
+    if (n == 0)
+        return 0;
+
+    // a free run, or else the oldest one that was read ahead
+    struct prefetch *p = NULL;
+    for (auto &it : cache->prefetch) {
+        if (it.state == PREFETCH_FREE) {
+            p = &it;
+            break;
+        }
+        if (it.state == PREFETCH_READY && (!p || it.seq < p->seq))
+            p = &it;
+    }
+    if (!p)
+        return 0;
+
+    size_t seq = cache->prefetch_seq++;
+    p->state = PREFETCH_LOADING;
+    p->block = block;
+    p->count = n;
+    p->submitted = false;
+    p->stale = false;
+    p->seq = seq;
+    cache->stats.readahead += n;
+    lock.unlock();
+
+    // the previous read of the run may still be completing in another thread
+    block_aio_wait(&p->aio);
+    p->data.resize(n * cache->bsize);
+    p->aio.done = prefetch_done;
+    p->aio.arg = p;
+    int ret = block_read_async(block, n, p->data.data(), &p->aio);
+
+    lock.lock();
+    if (p->seq == seq && p->state == PREFETCH_LOADING) {
+        if (ret < 0)
+            p->state = PREFETCH_FREE;
+        else
+            p->submitted = true;
+    }
+
+    return ret;
+}
+
+int cache_flush(void)
+{
+    lock_guard<mutex> guard(cache->lock);
+
+    return flush();
+}
+
+static int flush(void)
+{
+    vector<int> dirty;
+    vector<char> run;
+    int ret = 0;
+
+    for (size_t i = 0; i < cache->bufs.size(); i++) {
+        if (cache->bufs[i].valid && cache->bufs[i].dirty)
+            dirty.push_back(i);
+    }
+    sort(dirty.begin(), dirty.end(), [](int a, int b) {
+        return cache->bufs[a].block < cache->bufs[b].block;
+    });
+
+    // write adjacent dirty blocks with one block_write_run() each
+    for (size_t i = 0, j; i < dirty.size(); i = j) {
+        size_t first = cache->bufs[dirty[i]].block;
+        for (j = i + 1; j < dirty.size()
+             && cache->bufs[dirty[j]].block == first + (j - i); j++)
+            ;
+        if (j - i == 1) {
+            if (writeback(cache->bufs[dirty[i]]) < 0)
+                ret = -1;
+            continue;
+        }
+
+        run.resize((j - i) * cache->bsize);
+        for (size_t k = i; k < j; k++)
+            memcpy(&run[(k - i) * cache->bsize], cache->bufs[dirty[k]].data,
+                   cache->bsize);
+        if (block_write_run(first, j - i, run.data()) < 0) {
+            ret = -1;
+            continue;
+        }
+        for (size_t k = i; k < j; k++)
+            cache->bufs[dirty[k]].dirty = false;
+        cache->stats.writebacks += j - i;
+    }
+
+    return ret;
+}
+
+void cache_get_stats(struct cache_stats *stats)
+{
+    lock_guard<mutex> guard(cache->lock);
+    *stats = cache->stats;
+}
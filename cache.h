@@ -0,0 +1,235 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <cstddef>
+
+#include "disk.h"
+
+/** Fewest blocks kept in the buffer cache of a mounted file system */
+#define CACHE_DEFAULT_BLOCKS 32
+
+/** Most runs of blocks read ahead by cache_prefetch() and kept at once */
+#define CACHE_PREFETCH_RUNS 8
+
+/** Buffer cache counters, used to size the cache */
+struct cache_stats {
+    /* Lookups served from memory */
+    size_t hits;
+    /* Lookups that had to call block_read() */
+    size_t misses;
+    /* Buffers recycled to make room for another block */
+    size_t evictions;
+    /* Dirty buffers written back with block_write() */
+    size_t writebacks;
+    /* Blocks read ahead by cache_prefetch() */
+    size_t readahead;
+    /* Blocks served from the read ahead instead of the disk */
+    size_t readahead_hits;
+};
+
+/** A buffer cache instance, see cache_new() */
+struct cache;
+
+/**
+ * cache_new - Create a buffer cache instance
+ *
+ * Every other cache_*() function acts on the cache of the calling thread,
+ * picked with cache_use(), in front of the disk of that thread. Threads that
+ * did not pick one share a default cache.
+ *
+ * Return: A new cache, to be set up with cache_init().
+ */
+struct cache *cache_new(void);
+
+/**
+ * cache_delete - Release a buffer cache instance
+ * @c: Cache created by cache_new()
+ *
+ * Return: -1 if @c is the default cache, is used by the calling thread or
+ * was not released with cache_destroy(). 0 otherwise.
+ */
+int cache_delete(struct cache *c);
+
+/**
+ * cache_use - Pick the cache of the calling thread
+ * @c: Cache created by cache_new(), NULL for the default cache
+ *
+ * Return: The cache used until then, NULL if it was the default cache.
+ */
+struct cache *cache_use(struct cache *c);
+
+/**
+ * cache_init - Set up the block buffer cache
+ * @capacity: Number of block buffers the cache may hold
+ *
+ * Allocate @capacity buffers in front of the currently open virtual disk,
+ * each of the disk's current block size. Any
+ * previous cache content is dropped without being written back, so
+ * cache_flush() must have been called before re-initialising.
+ *
+ * If the disk was opened with block_disk_open_mapped(), no buffer is
+ * allocated: every function below works on the mapping in place and
+ * cache_get() returns block_map().
+ *
+ * Every function below may be called from any thread. The content of a block
+ * pinned by cache_get() is not guarded: the callers serialise the changes of
+ * one block between themselves.
+ *
+ * Return: -1 if @capacity is 0. 0 otherwise.
+ */
+int cache_init(size_t capacity);
+
+/**
+ * cache_destroy - Release the block buffer cache
+ *
+ * Write back every dirty buffer and free the cache.
+ *
+ * Return: -1 if a dirty buffer could not be written back. 0 otherwise.
+ */
+int cache_destroy(void);
+
+/**
+ * cache_read - Read a block through the cache
+ * @block: Index of the block to read from
+ * @buf: Data buffer to be filled with content of block
+ *
+ * Copy block @block (one block size of bytes) into @buf, calling block_read()
+ * only if the block is not cached yet.
+ *
+ * Return: -1 if the block cannot be read or no buffer can be freed for it.
+ * 0 otherwise.
+ */
+int cache_read(size_t block, void *buf);
+
+/**
+ * cache_write - Write a block through the cache
+ * @block: Index of the block to write to
+ * @buf: Data buffer to write in the block
+ *
+ * Copy @buf (one block size of bytes) into the cached copy of block @block and
+ * mark it dirty. The block reaches the disk when it is evicted or flushed.
+ *
+ * Return: -1 if no buffer can be freed for the block. 0 otherwise.
+ */
+int cache_write(size_t block, const void *buf);
+
+/**
+ * cache_get - Pin a block in the cache
+ * @block: Index of the block
+ *
+ * Load block @block if needed and pin its buffer so that it cannot be evicted
+ * until the matching cache_put(). The returned pointer stays valid while the
+ * block is pinned.
+ *
+ * Return: NULL if the block cannot be read or every buffer is pinned. A
+ * pointer to the bytes of the cached block otherwise.
+ */
+void *cache_get(size_t block);
+
+/**
+ * cache_put - Unpin a block
+ * @block: Index of a block previously pinned with cache_get()
+ * @dirty: Non-zero if the pinned buffer was modified
+ *
+ * Return: -1 if @block is not pinned. 0 otherwise.
+ */
+int cache_put(size_t block, int dirty);
+
+/**
+ * cache_read_run - Read consecutive blocks in one I/O
+ * @block: Index of the first block
+ * @count: Number of blocks
+ * @buf: Data buffer to be filled with content of the blocks
+ *
+ * Read the blocks with a single block_read_run(), then copy over it the
+ * cached blocks that were not written back yet. The blocks are not added to
+ * the cache. A run whose blocks were all read ahead by cache_prefetch() is
+ * copied from there instead, once the read ahead completed.
+ *
+ * Return: -1 if the blocks cannot be read. 0 otherwise.
+ */
+int cache_read_run(size_t block, size_t count, void *buf);
+
+/**
+ * cache_write_run - Write consecutive blocks in one I/O
+ * @block: Index of the first block
+ * @count: Number of blocks
+ * @buf: Data buffer to write in the blocks
+ *
+ * Write the blocks with a single block_write_run() and refresh the cached
+ * copies of any of them.
+ *
+ * Return: -1 if the blocks cannot be written. 0 otherwise.
+ */
+int cache_write_run(size_t block, size_t count, const void *buf);
+
+/**
+ * cache_read_run_async - Start reading consecutive blocks in one I/O
+ * @block: Index of the first block
+ * @count: Number of blocks
+ * @buf: Data buffer to be filled with content of the blocks
+ * @aio: Request for the I/O, its @done and @arg are set by the cache
+ *
+ * Same as cache_read_run() with block_read_async(): the cached blocks that
+ * were not written back yet are copied over @buf when the I/O is reaped. A
+ * run that was read ahead is copied at once and @aio is complete on return.
+ *
+ * Return: -1 if the read can't be queued. 0 otherwise, and block_aio_wait()
+ * on @aio returns the result.
+ */
+int cache_read_run_async(size_t block, size_t count, void *buf,
+                         struct block_aio *aio);
+
+/**
+ * cache_write_run_async - Start writing consecutive blocks in one I/O
+ * @block: Index of the first block
+ * @count: Number of blocks
+ * @buf: Data buffer to write in the blocks
+ * @aio: Request for the I/O, its @done and @arg are set by the cache
+ *
+ * Same as cache_write_run() with block_write_async(). The cached copies of
+ * the blocks are refreshed at once and stay dirty until the write is reaped,
+ * so that evicting them meanwhile can't bring back the old content.
+ *
+ * Return: -1 if the write can't be queued. 0 otherwise, and block_aio_wait()
+ * on @aio returns the result.
+ */
+int cache_write_run_async(size_t block, size_t count, const void *buf,
+                          struct block_aio *aio);
+
+/**
+ * cache_prefetch - Read consecutive blocks ahead of their use
+ * @block: Index of the first block
+ * @count: Number of blocks
+ *
+ * Start reading the blocks with block_read_async(), from the first one that
+ * is neither cached nor read ahead yet up to the next one that is. The run is
+ * kept apart from the buffers, so that streaming a file doesn't evict the
+ * metadata: cache_read_run() and a miss of cache_read() or cache_get() take
+ * the blocks from there, waiting for the read if it is still in flight.
+ * Writes to the blocks update the copies read ahead, or drop a read still in
+ * flight. Up to %CACHE_PREFETCH_RUNS runs are kept, the oldest one is
+ * recycled first; when all of them are being read, nothing is read ahead. A
+ * mapped disk needs no read ahead.
+ *
+ * Return: -1 if the read can't be queued. 0 otherwise.
+ */
+int cache_prefetch(size_t block, size_t count);
+
+/**
+ * cache_flush - Write back every dirty block
+ *
+ * Dirty blocks are written in block order, adjacent ones with a single
+ * block_write_run(). Pinned blocks are written too, see journal_flush().
+ *
+ * Return: -1 if a block could not be written back. 0 otherwise.
+ */
+int cache_flush(void);
+
+/**
+ * cache_get_stats - Get the cache counters
+ * @stats: Filled with the counters accumulated since cache_init()
+ */
+void cache_get_stats(struct cache_stats *stats);
+
+#endif
@@ -0,0 +1,56 @@
+#!/bin/sh
+# Crash the file system with SIGKILL, then remount the image and check that
+# the journal left the FAT and the directories consistent: no entry or
+# directory index points to a free block, no block is owned twice. Leaked
+# blocks are allowed, an operation split by the journal may leave some.
+#
+# First the root directory is split by its fifth file and the process killed
+# once that is committed; then the workload is killed at several points of a
+# run.
+#
+# Use: ./crash_check.sh [image [delay...]]
+# The delays are in seconds, after the start of each run.
+
+image=${1:-crash.img}
+[ $# -gt 0 ] && shift
+delays=${*:-0.15 0.3 0.6 1.0}
+blocks=65536
+failed=0
+
+# check - remount the image and check it
+# @1: what happened before, for the report
+check() {
+    result=$(echo check | ./fs_test -q "$image" 2>&1)
+    echo "$1: $result" | sed '2,$s/^/    /'
+    echo "$result" | grep -q ", 0 errors$" || failed=1
+}
+
+./fs_test -q -f -n $blocks "$image" /dev/null || exit 1
+
+# the next operation commits the split once the commit window is over, and
+# the input stays open until the kill
+(for f in a b c d e; do echo "touch /$f.tx"; done; sleep 0.2; echo "rm /z.tx"
+ sleep 2) | ./fs_test -q "$image" >/dev/null 2>&1 &
+pid=$!
+sleep 1
+kill -9 $pid 2>/dev/null
+wait
+check "killed after a split"
+
+seed=1
+for delay in $delays; do
+    # the runs share the image, each one starts from the last recovery
+    ./fs_workload -k -i "$image" -P mixed -s $seed -o 20000 -M 65536 >/dev/null 2>&1 &
+    pid=$!
+    sleep "$delay"
+    kill -9 $pid 2>/dev/null
+    wait $pid 2>/dev/null
+
+    check "killed at ${delay}s"
+    seed=$((seed + 1))
+done
+
+rm -f "$image"
+[ $failed -eq 0 ] && echo "crash check passed" || echo "crash check FAILED"
+
+exit $failed
@@ -1,15 +1,66 @@
+#include <linux/io_uring.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <fcntl.h>
 #include <unistd.h> 
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
 
+// <linux/fs.h>, pulled in by <linux/io_uring.h>, has its own BLOCK_SIZE
+#undef BLOCK_SIZE
 #include "disk.h"
+#include "trace.h"
 
 using namespace std;
 
 /** Invalid file descriptor */
 #define INVALID_FD -1
 
+/** Asynchronous I/O engine of a disk */
+struct aio_engine {
+    /* Set once the first asynchronous I/O started the engine */
+    bool started;
+    /* I/Os submitted and not reaped yet */
+    size_t inflight;
+    /* io_uring instance, INVALID_FD when the worker threads serve the I/Os */
+    int ring;
+    /* Rings shared with the kernel */
+    void *sq_map;
+    size_t sq_len;
+    void *cq_map;
+    size_t cq_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    /* Guards the engine, the requests in flight and the rings */
+    mutex lock;
+    /* A thread is reaping completions, the other waiters sleep on @reaped */
+    bool reaping;
+    condition_variable reaped;
+    /* Worker thread fallback, also completes the I/Os of a mapped disk */
+    condition_variable submitted;
+    condition_variable completed;
+    deque<struct block_aio *> sq;
+    deque<struct block_aio *> cq;
+    vector<thread> workers;
+    bool stop;
+};
+
 /** Disk instance description */
 struct disk
 {
@@ -17,15 +68,138 @@ struct disk
     int fd;
     /* Block count*/
     size_t bcount;
+    /* Block size in bytes */
+    size_t bsize;
+    /* Shared mapping of the whole image (NULL unless mapped) */
+    char *map;
+    struct aio_engine aio;
+    /* Counters, bumped by any thread without a lock */
+    atomic<size_t> reads;
+    atomic<size_t> writes;
+    atomic<size_t> blocks_read;
+    atomic<size_t> blocks_written;
+    atomic<size_t> syncs;
 };
 
 // c++20 feature
-/* Currently open virtual disk (invalid by default) */
-static struct disk disk = {
+/* Disk of the threads that did not pick one (invalid by default) */
+static struct disk disk0 = {
     .fd = INVALID_FD,
-    .bcount = 0
+    .bcount = 0,
+    .bsize = BLOCK_SIZE,
+    .map = NULL
 };
 
+/* Disk of the calling thread, see block_disk_use() */
+static thread_local struct disk *disk = &disk0;
+
+static void aio_stop();
+
+/**
+ * count_io - Count an I/O of the disk of the calling thread
+ * @write: The I/O writes
+ * @count: Number of blocks it moves
+ */
+static void count_io(bool write, size_t count)
+{
+    if (write) {
+        disk->writes.fetch_add(1, memory_order_relaxed);
+        disk->blocks_written.fetch_add(count, memory_order_relaxed);
+    } else {
+        disk->reads.fetch_add(1, memory_order_relaxed);
+        disk->blocks_read.fetch_add(count, memory_order_relaxed);
+    }
+}
+
+/**
+ * map_disk - Map the first @bcount blocks of the open disk
+ *
+ * Return: -1 if the image cannot be extended or mapped. 0 otherwise.
+ */
+static int map_disk()
+{
+    size_t len = disk->bcount * disk->bsize;
+    struct stat st;
+    void *map;
+
+    // touching a page past the end of the file would raise SIGBUS
+    if (fstat(disk->fd, &st) || ((size_t)st.st_size < len
+                                 && ftruncate(disk->fd, len))) {
+        perror("ftruncate");
+        return -1;
+    }
+
+    map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, disk->fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    // the metadata is walked on every call, bring it in up front
+    madvise(map, len, MADV_WILLNEED);
+
+    disk->map = (char *)map;
+
+    return 0;
+}
+
+struct disk *block_disk_new(void)
+{
+    struct disk *d = new struct disk();
+
+    d->fd = INVALID_FD;
+    d->bsize = BLOCK_SIZE;
+
+    return d;
+}
+
+int block_disk_delete(struct disk *d)
+{
+    if (!d || d == &disk0 || d == disk || d->fd != INVALID_FD) {
+        cout << "disk in use" << endl;
+        return -1;
+    }
+
+    delete d;
+
+    return 0;
+}
+
+struct disk *block_disk_use(struct disk *d)
+{
+    struct disk *prev = disk;
+
+    disk = d ? d : &disk0;
+
+    return prev == &disk0 ? NULL : prev;
+}
+
+int block_disk_create(const char *diskname, size_t bcount, size_t bsize)
+{
+    int fd;
+
+    if (!diskname || bcount == 0 || bsize == 0) {
+        cout << "invalid disk geometry" << endl;
+        return -1;
+    }
+
+    if ((fd = open(diskname, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+        perror("open");
+        return -1;
+    }
+
+    // sparse: blocks are only allocated by the host once written
+    if (ftruncate(fd, (off_t)bcount * bsize)) {
+        perror("ftruncate");
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+
+    return 0;
+}
+
 int block_disk_open(const char *diskname)
 {
     int fd;
@@ -39,7 +213,7 @@ int block_disk_open(const char *diskname)
         return -1;
     }
 
-    if (disk.fd != INVALID_FD) {
+    if (disk->fd != INVALID_FD) {
         cout << "disk already open" << endl;
         return -1;
     }
@@ -50,93 +224,636 @@ int block_disk_open(const char *diskname)
     }
 
     if (fstat(fd, &st)) {
+        perror("fstat");
+        close(fd);
+        return -1;
+    }
+
+    if (st.st_size < BLOCK_SIZE) {
+        cout << "size " << st.st_size << " is smaller than one block" << endl;
+        close(fd);
+        return -1;
+    }
+
+    disk->fd = fd;
+    disk->bsize = BLOCK_SIZE;
+    disk->bcount = st.st_size / BLOCK_SIZE;
+    disk->reads = 0;
+    disk->writes = 0;
+    disk->blocks_read = 0;
+    disk->blocks_written = 0;
+    disk->syncs = 0;
+
+    return 0;
+}
+
+int block_disk_open_mapped(const char *diskname)
+{
+    if (block_disk_open(diskname) != 0) {
+        return -1;
+    }
+
+    if (map_disk() != 0) {
+        block_disk_close();
+        return -1;
+    }
+
+    return 0;
+}
+
+int block_disk_set_block_size(size_t bsize)
+{
+    struct stat st;
+
+    if (disk->fd == INVALID_FD) {
+        cout << "No disk opened." << endl;
+        return -1;
+    }
+
+    if (bsize < BLOCK_SIZE || (bsize & (bsize - 1))) {
+        cout << "block size " << bsize << " is not a power of two >= "
+            << BLOCK_SIZE << endl;
+        return -1;
+    }
+
+    if (fstat(disk->fd, &st)) {
         perror("fstat");
         return -1;
     }
 
-    // if (st.st_size % BLOCK_SIZE != 0) {
-    //     cout << "size " << st.st_size << "is not multiple of"
-    //         << BLOCK_SIZE << endl;
-    //     return -1;
-    // }
+    // queued I/Os count their blocks in the old size
+    block_aio_drain();
+
+    if (disk->map) {
+        munmap(disk->map, disk->bcount * disk->bsize);
+        disk->map = NULL;
+        disk->bsize = bsize;
+        disk->bcount = st.st_size / bsize;
+        return map_disk();
+    }
 
-    disk.fd = fd;
-    disk.bcount = 128;
+    disk->bsize = bsize;
+    disk->bcount = st.st_size / bsize;
+
+    return 0;
+}
+
+int block_disk_block_size()
+{
+    if (disk->fd == INVALID_FD) {
+        cout << "No disk opened." << endl;
+        return -1;
+    }
+
+    return disk->bsize;
+}
+
+int block_disk_sync()
+{
+    if (disk->fd == INVALID_FD) {
+        cout << "No disk opened." << endl;
+        return -1;
+    }
+
+    disk->syncs.fetch_add(1, memory_order_relaxed);
+
+    if (disk->map) {
+        if (msync(disk->map, disk->bcount * disk->bsize, MS_SYNC)) {
+            perror("msync");
+            return -1;
+        }
+        return 0;
+    }
+
+    if (fsync(disk->fd)) {
+        perror("fsync");
+        return -1;
+    }
 
     return 0;
 }
 
 int block_disk_close()
 {
-    if (disk.fd == INVALID_FD) {
+    if (disk->fd == INVALID_FD) {
         cout << "No disk opened." << endl;
         return -1;
     }
 
-    close(disk.fd);
+    block_aio_drain();
+    aio_stop();
 
-    disk.fd = INVALID_FD;
+    if (disk->map) {
+        munmap(disk->map, disk->bcount * disk->bsize);
+        disk->map = NULL;
+    }
+
+    close(disk->fd);
+
+    disk->fd = INVALID_FD;
 
     return 0;
 }
 
 int block_disk_count()
 {
-    if (disk.fd == INVALID_FD) {
+    if (disk->fd == INVALID_FD) {
         cout << "No disk opened." << endl;
         return -1;
     }
 
-    return disk.bcount;
+    return disk->bcount;
 }
 
 int block_read(size_t block, void *buf)
 {
-    if (disk.fd == INVALID_FD) {
+    return block_read_run(block, 1, buf);
+}
+
+int block_write(size_t block, const void *buf) 
+{
+    return block_write_run(block, 1, buf);
+}
+
+int block_read_run(size_t block, size_t count, void *buf)
+{
+    trace_scope span("block_read", block, count);
+    size_t len = count * disk->bsize;
+    ssize_t n;
+
+    if (disk->fd == INVALID_FD) {
         cout << "No disk opened." << endl;
+        return -1;
     }
 
-    if (block >= disk.bcount) {
-        cout << "Block index out of bounds (" << block
-            << "/" << disk.bcount << ").";
+    if (block >= disk->bcount || count > disk->bcount - block) {
+        cout << "Block index out of bounds (" << block + count
+            << "/" << disk->bcount << ")." << endl;
         return -1;
     }
 
-    if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-        perror("lseek");
-        return -1;
+    count_io(false, count);
+
+    if (disk->map) {
+        memcpy(buf, disk->map + block * disk->bsize, len);
+        return 0;
     }
 
-    if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-        perror("read");
+    if ((n = pread(disk->fd, buf, len, block * disk->bsize)) < 0) {
+        perror("pread");
         return -1;
     }
 
+    /* blocks past the end of a short image read back as zeros */
+    if ((size_t)n < len) {
+        memset((char *)buf + n, 0, len - n);
+    }
+
     return 0;
 }
 
-int block_write(size_t block, const void *buf) 
+int block_write_run(size_t block, size_t count, const void *buf)
 {
-    if (disk.fd == INVALID_FD) {
+    trace_scope span("block_write", block, count);
+    size_t len = count * disk->bsize;
+
+    if (disk->fd == INVALID_FD) {
         cout << "No disk opened." << endl;
+        return -1;
+    }
+
+    if (block >= disk->bcount || count > disk->bcount - block) {
+        cout << "Block index out of bounds (" << block + count
+            << "/" << disk->bcount << ")." << endl;
+        return -1;
+    }
+
+    count_io(true, count);
+
+    if (disk->map) {
+        memcpy(disk->map + block * disk->bsize, buf, len);
+        return 0;
+    }
+
+    if (pwrite(disk->fd, buf, len, block * disk->bsize) != (ssize_t)len) {
+        perror("pwrite");
+        return -1;
+    }
+
+    return 0;
+}
+
+void *block_map(size_t block)
+{
+    if (disk->fd == INVALID_FD || !disk->map) {
+        return NULL;
     }
 
-    if (block >= disk.bcount) {
+    if (block >= disk->bcount) {
         cout << "Block index out of bounds (" << block
-            << "/" << disk.bcount << ").";
+            << "/" << disk->bcount << ")." << endl;
+        return NULL;
+    }
+
+    return disk->map + block * disk->bsize;
+}
+
+/**
+ * aio_setup_ring - Create the io_uring instance of the engine
+ *
+ * The rings are set up with the raw system calls, so that no library is
+ * needed.
+ *
+ * Return: -1 if the kernel has no io_uring or the rings can't be mapped.
+ * 0 otherwise.
+ */
+static int aio_setup_ring()
+{
+    struct aio_engine &aio = disk->aio;
+    struct io_uring_params p;
+    char *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, BLOCK_AIO_DEPTH, &p);
+    if (fd < 0) {
+        return -1;
+    }
+
+    aio.sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    aio.cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    aio.sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    aio.sq_map = mmap(NULL, aio.sq_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    aio.cq_map = mmap(NULL, aio.cq_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    aio.sqes = (struct io_uring_sqe *)mmap(NULL, aio.sqes_len,
+                                           PROT_READ | PROT_WRITE,
+                                           MAP_SHARED | MAP_POPULATE, fd,
+                                           IORING_OFF_SQES);
+    if (aio.sq_map == MAP_FAILED || aio.cq_map == MAP_FAILED
+        || aio.sqes == MAP_FAILED) {
+        if (aio.sq_map != MAP_FAILED)
+            munmap(aio.sq_map, aio.sq_len);
+        if (aio.cq_map != MAP_FAILED)
+            munmap(aio.cq_map, aio.cq_len);
+        if (aio.sqes != MAP_FAILED)
+            munmap(aio.sqes, aio.sqes_len);
+        close(fd);
         return -1;
     }
 
-    if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-        perror("lseek");
+    sq = (char *)aio.sq_map;
+    cq = (char *)aio.cq_map;
+    aio.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    aio.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    aio.sq_array = (unsigned *)(sq + p.sq_off.array);
+    aio.cq_head = (unsigned *)(cq + p.cq_off.head);
+    aio.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    aio.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    aio.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    aio.ring = fd;
+
+    return 0;
+}
+
+/**
+ * aio_worker - Serve the submission queue of the worker thread fallback
+ * @d: The disk of the engine, which the worker thread uses from then on
+ */
+static void aio_worker(struct disk *d)
+{
+    struct aio_engine &aio = d->aio;
+
+    // block_read_run() and block_write_run() use the disk of the thread
+    disk = d;
+    unique_lock<mutex> lock(aio.lock);
+
+    for (;;) {
+        aio.submitted.wait(lock, [&] { return aio.stop || !aio.sq.empty(); });
+        if (aio.sq.empty()) {
+            return;
+        }
+
+        struct block_aio *io = aio.sq.front();
+        aio.sq.pop_front();
+        lock.unlock();
+
+        if (io->write) {
+            io->ret = block_write_run(io->block, io->count, io->buf);
+        } else {
+            io->ret = block_read_run(io->block, io->count, io->buf);
+        }
+
+        lock.lock();
+        aio.cq.push_back(io);
+        aio.completed.notify_one();
+    }
+}
+
+static void aio_start()
+{
+    struct aio_engine &aio = disk->aio;
+
+    aio.started = true;
+    aio.stop = false;
+    aio.ring = INVALID_FD;
+
+    if (aio_setup_ring() == 0) {
+        return;
+    }
+
+    for (int i = 0; i < BLOCK_AIO_WORKERS; i++) {
+        aio.workers.push_back(thread(aio_worker, disk));
+    }
+}
+
+/**
+ * aio_stop - Tear down the engine, once every I/O was reaped
+ */
+static void aio_stop()
+{
+    struct aio_engine &aio = disk->aio;
+
+    if (!aio.started) {
+        return;
+    }
+
+    if (aio.ring != INVALID_FD) {
+        munmap(aio.sq_map, aio.sq_len);
+        munmap(aio.cq_map, aio.cq_len);
+        munmap(aio.sqes, aio.sqes_len);
+        close(aio.ring);
+        aio.ring = INVALID_FD;
+    }
+
+    {
+        lock_guard<mutex> lock(aio.lock);
+        aio.stop = true;
+    }
+    aio.submitted.notify_all();
+    for (auto &worker : aio.workers) {
+        worker.join();
+    }
+    aio.workers.clear();
+    aio.started = false;
+}
+
+/**
+ * aio_ring_submit - Queue an I/O on the io_uring instance
+ *
+ * Return: -1 if the kernel refuses the submission. 0 otherwise.
+ */
+static int aio_ring_submit(struct block_aio *io)
+{
+    struct aio_engine &aio = disk->aio;
+    unsigned tail = *aio.sq_tail;
+    unsigned i = tail & *aio.sq_mask;
+    struct io_uring_sqe *sqe = &aio.sqes[i];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = io->write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = disk->fd;
+    sqe->addr = (uintptr_t)io->buf;
+    sqe->len = io->count * disk->bsize;
+    sqe->off = io->block * disk->bsize;
+    sqe->user_data = (uintptr_t)io;
+    aio.sq_array[i] = i;
+    __atomic_store_n(aio.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    while (syscall(__NR_io_uring_enter, aio.ring, 1, 0, 0, NULL, 0) < 0) {
+        if (errno != EINTR) {
+            perror("io_uring_enter");
+            // the kernel did not take the entry
+            __atomic_store_n(aio.sq_tail, tail, __ATOMIC_RELEASE);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * aio_ring_reap - Wait for a completion of the io_uring instance
+ * @lock: The engine lock, held, released while waiting in the kernel
+ *
+ * Return: NULL if waiting fails. The completed request otherwise.
+ */
+static struct block_aio *aio_ring_reap(unique_lock<mutex> &lock)
+{
+    struct aio_engine &aio = disk->aio;
+
+    for (;;) {
+        unsigned head = *aio.cq_head;
+
+        if (head == __atomic_load_n(aio.cq_tail, __ATOMIC_ACQUIRE)) {
+            lock.unlock();
+            int ret = syscall(__NR_io_uring_enter, aio.ring, 0, 1,
+                              IORING_ENTER_GETEVENTS, NULL, 0);
+            int err = errno;
+            lock.lock();
+            if (ret < 0 && err != EINTR) {
+                errno = err;
+                perror("io_uring_enter");
+                return NULL;
+            }
+            continue;
+        }
+
+        struct io_uring_cqe *cqe = &aio.cqes[head & *aio.cq_mask];
+        struct block_aio *io = (struct block_aio *)(uintptr_t)cqe->user_data;
+        size_t len = io->count * disk->bsize;
+        int res = cqe->res;
+        __atomic_store_n(aio.cq_head, head + 1, __ATOMIC_RELEASE);
+
+        io->ret = 0;
+        if (res < 0) {
+            errno = -res;
+            perror(io->write ? "pwrite" : "pread");
+            io->ret = -1;
+        } else if ((size_t)res < len && io->write) {
+            cout << "short write of block " << io->block << endl;
+            io->ret = -1;
+        } else if ((size_t)res < len) {
+            /* blocks past the end of a short image read back as zeros */
+            memset((char *)io->buf + res, 0, len - res);
+        }
+
+        return io;
+    }
+}
+
+/**
+ * aio_reap - Wait for the next completion
+ * @lock: The engine lock, held
+ *
+ * One thread at a time reaps, for every waiter: the others sleep until it
+ * completed a request.
+ *
+ * Return: -1 if waiting fails. 0 once a request completed, after its @done
+ * function was called, or once another thread reaped.
+ */
+static int aio_reap(unique_lock<mutex> &lock)
+{
+    struct aio_engine &aio = disk->aio;
+
+    if (aio.reaping) {
+        aio.reaped.wait(lock);
+        return 0;
+    }
+    aio.reaping = true;
+
+    struct block_aio *io = NULL;
+    if (!(aio.started && aio.ring != INVALID_FD)) {
+        aio.completed.wait(lock, [&] { return !aio.cq.empty(); });
+    }
+    if (!aio.cq.empty()) {
+        io = aio.cq.front();
+        aio.cq.pop_front();
+    } else {
+        io = aio_ring_reap(lock);
+    }
+
+    if (io) {
+        aio.inflight--;
+        // the buffer is complete only once @done ran, e.g. for the cache
+        if (io->done) {
+            lock.unlock();
+            io->done(io);
+            lock.lock();
+        }
+        io->completed = true;
+    }
+    aio.reaping = false;
+    aio.reaped.notify_all();
+
+    return io ? 0 : -1;
+}
+
+/**
+ * aio_submit - Queue an asynchronous I/O
+ *
+ * Return: -1 if the disk is not open, a block is out of bounds or the I/O
+ * can't be queued. 0 otherwise.
+ */
+static int aio_submit(struct block_aio *io)
+{
+    struct aio_engine &aio = disk->aio;
+
+    if (disk->fd == INVALID_FD) {
+        cout << "No disk opened." << endl;
         return -1;
     }
 
-    if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-        perror("write");
+    if (io->block >= disk->bcount || io->count > disk->bcount - io->block) {
+        cout << "Block index out of bounds (" << io->block + io->count
+            << "/" << disk->bcount << ")." << endl;
         return -1;
     }
 
+    unique_lock<mutex> lock(aio.lock);
+    while (aio.inflight >= BLOCK_AIO_DEPTH) {
+        if (aio_reap(lock) != 0) {
+            return -1;
+        }
+    }
+
+    io->completed = false;
+    io->ret = -1;
+
+    // the mapping is copied without any system call, nothing to overlap
+    if (disk->map) {
+        if (io->write) {
+            io->ret = block_write_run(io->block, io->count, io->buf);
+        } else {
+            io->ret = block_read_run(io->block, io->count, io->buf);
+        }
+        aio.cq.push_back(io);
+        aio.inflight++;
+        return 0;
+    }
+
+    if (!aio.started) {
+        aio_start();
+    }
+
+    if (aio.ring != INVALID_FD) {
+        if (aio_ring_submit(io) != 0) {
+            io->completed = true;
+            return -1;
+        }
+        // the worker threads count theirs in block_read_run()/block_write_run()
+        count_io(io->write, io->count);
+        aio.inflight++;
+        return 0;
+    }
+
+    aio.sq.push_back(io);
+    aio.inflight++;
+    aio.submitted.notify_one();
+
     return 0;
 }
 
+int block_read_async(size_t block, size_t count, void *buf,
+                     struct block_aio *io)
+{
+    trace_scope span("block_read_async", block, count);
+
+    io->block = block;
+    io->count = count;
+    io->buf = buf;
+    io->write = false;
+
+    return aio_submit(io);
+}
+
+int block_write_async(size_t block, size_t count, const void *buf,
+                      struct block_aio *io)
+{
+    trace_scope span("block_write_async", block, count);
+
+    io->block = block;
+    io->count = count;
+    io->buf = (void *)buf;
+    io->write = true;
+
+    return aio_submit(io);
+}
+
+int block_aio_wait(struct block_aio *io)
+{
+    trace_scope span("block_aio_wait", io->block, io->count);
+    struct aio_engine &aio = disk->aio;
+    unique_lock<mutex> lock(aio.lock);
+
+    while (!io->completed) {
+        if (aio_reap(lock) != 0) {
+            return -1;
+        }
+    }
+
+    return io->ret;
+}
+
+int block_aio_drain()
+{
+    struct aio_engine &aio = disk->aio;
+    unique_lock<mutex> lock(aio.lock);
+
+    while (aio.inflight > 0) {
+        if (aio_reap(lock) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void block_get_stats(struct block_stats *stats)
+{
+    stats->reads = disk->reads.load(memory_order_relaxed);
+    stats->writes = disk->writes.load(memory_order_relaxed);
+    stats->blocks_read = disk->blocks_read.load(memory_order_relaxed);
+    stats->blocks_written = disk->blocks_written.load(memory_order_relaxed);
+    stats->syncs = disk->syncs.load(memory_order_relaxed);
+}
@@ -5,8 +5,98 @@
 #include <iostream>
 #include <fstream>
 
-/** Size of a disk block in bytes*/
-#define BLOCK_SIZE 64
+/**
+ * Size of a disk block in bytes when a disk is opened. The file system
+ * superblock fits in this many bytes at offset 0 and may then switch to a
+ * larger block size with block_disk_set_block_size().
+ */
+#define BLOCK_SIZE 128
+
+/** Most asynchronous block I/Os in flight at once */
+#define BLOCK_AIO_DEPTH 32
+
+/** Worker threads serving asynchronous block I/Os without io_uring */
+#define BLOCK_AIO_WORKERS 4
+
+/** Disk counters */
+struct block_stats {
+    /* Read and write I/Os, a run of blocks or a queued request counts once */
+    size_t reads;
+    size_t writes;
+    /* Blocks moved by those I/Os */
+    size_t blocks_read;
+    size_t blocks_written;
+    /* Calls to block_disk_sync() */
+    size_t syncs;
+};
+
+/**
+ * One asynchronous block I/O. The request and its buffer belong to the disk
+ * from block_read_async() or block_write_async() until the I/O is reaped by
+ * block_aio_wait() or block_aio_drain().
+ */
+struct block_aio {
+    /* Called in the reaping thread once the I/O completed, may be NULL */
+    void (*done)(struct block_aio *aio);
+    /* Left to the caller, e.g. for @done */
+    void *arg;
+    /* First block, number of blocks and buffer, set by the submission */
+    size_t block;
+    size_t count;
+    void *buf;
+    bool write;
+    /* Set once the I/O was reaped */
+    bool completed;
+    /* -1 if the I/O failed, 0 otherwise. Valid once @completed is set */
+    int ret;
+};
+
+/** A virtual disk instance, see block_disk_new() */
+struct disk;
+
+/**
+ * block_disk_new - Create a virtual disk instance
+ *
+ * Every other block_*() function acts on the disk of the calling thread,
+ * picked with block_disk_use(). Threads that did not pick one share a default
+ * disk, so a process with a single image needs no instance of its own.
+ *
+ * Return: A new disk, with no virtual disk file open.
+ */
+struct disk *block_disk_new(void);
+
+/**
+ * block_disk_delete - Release a virtual disk instance
+ * @d: Disk created by block_disk_new()
+ *
+ * Return: -1 if @d is the default disk, is used by the calling thread or
+ * still has a virtual disk file open. 0 otherwise.
+ */
+int block_disk_delete(struct disk *d);
+
+/**
+ * block_disk_use - Pick the disk of the calling thread
+ * @d: Disk created by block_disk_new(), NULL for the default disk
+ *
+ * Any number of threads may use the same disk at once.
+ *
+ * Return: The disk used until then, NULL if it was the default disk.
+ */
+struct disk *block_disk_use(struct disk *d);
+
+/**
+ * block_disk_create - Create virtual disk file
+ * @diskname: Name of the virtual disk file
+ * @bcount: Number of blocks
+ * @bsize: Size of a block in bytes
+ *
+ * Create (or truncate) the virtual disk file @diskname with room for @bcount
+ * blocks of @bsize bytes, all zero. The file is sparse.
+ *
+ * Return: -1 if the geometry is invalid or the file cannot be created.
+ * 0 otherwise.
+ */
+int block_disk_create(const char *diskname, size_t bcount, size_t bsize);
 
 /**
  * block_disk_open - Open virtual disk file
@@ -21,6 +111,29 @@
 */
 int block_disk_open(const char *diskname);
 
+/**
+ * block_disk_open_mapped - Open virtual disk file and map it in memory
+ * @diskname: Name of the virtual disk file
+ *
+ * Same as block_disk_open(), but the whole image is also mapped shared in
+ * memory. block_read() and block_write() then copy from and to the mapping
+ * without any system call, and block_map() gives direct access to a block.
+ *
+ * Return: -1 if the virtual disk file cannot be opened or mapped. 0 otherwise.
+ */
+int block_disk_open_mapped(const char *diskname);
+
+/**
+ * block_disk_sync - Flush virtual disk file to stable storage
+ *
+ * msync() the mapping of a disk opened with block_disk_open_mapped(), fsync()
+ * the file otherwise.
+ *
+ * Return: -1 if there was no virtual disk file opened or if the flush fails.
+ * 0 otherwise.
+ */
+int block_disk_sync(void);
+
 /**
  * block_disk_close - Close virtual disk file
  *
@@ -28,6 +141,27 @@ int block_disk_open(const char *diskname);
  */
 int block_disk_close(void);
 
+/**
+ * block_disk_set_block_size - Change the block size of the open disk
+ * @bsize: New size of a block in bytes
+ *
+ * Every later block index is counted in blocks of @bsize bytes, and the block
+ * count becomes the size of the file divided by @bsize. A mapped disk is
+ * mapped again.
+ *
+ * Return: -1 if there was no virtual disk file opened or @bsize is not a power
+ * of two of at least %BLOCK_SIZE. 0 otherwise.
+ */
+int block_disk_set_block_size(size_t bsize);
+
+/**
+ * block_disk_block_size - Get disk's block size
+ *
+ * Return: -1 if there was no virtual disk file opened, otherwise the size in
+ * bytes of the blocks of the currently open disk.
+ */
+int block_disk_block_size(void);
+
 /**
  * block_disk_count - Get disk's block count
  *
@@ -41,8 +175,8 @@ int block_disk_count(void);
  * @block: Index of the block to read from
  * @buf: Data buffer to be filled with content of block
  * 
- * Read the content of virtual disk's block @block (%BLOCK_SIZE bytes) into
- * buffer @buf
+ * Read the content of virtual disk's block @block (one block size of bytes)
+ * into buffer @buf
  * 
  * Return: -1 if @block is out of bounds or inaccessible, or if the reading
  * operation fails. 0 otherwise.
@@ -54,12 +188,114 @@ int block_read(size_t block, void *buf);
  * @block: Index of the block to write to
  * @buf: Data buffer to write in the block
  *
- * Write the content of buffer @buf (%BLOCK_SIZE bytes) in the virtual disk's
- * block @block.
+ * Write the content of buffer @buf (one block size of bytes) in the virtual
+ * disk's block @block.
  *
  * Return: -1 if @block is out of bounds or inaccessible or if the writing
  * operation fails. 0 otherwise.
  */
 int block_write(size_t block, const void *buf);
 
+/**
+ * block_read_run - Read consecutive blocks from disk
+ * @block: Index of the first block to read from
+ * @count: Number of blocks
+ * @buf: Data buffer to be filled with content of the blocks
+ *
+ * Same as @count calls to block_read(), with a single system call.
+ *
+ * Return: -1 if a block is out of bounds or inaccessible, or if the reading
+ * operation fails. 0 otherwise.
+ */
+int block_read_run(size_t block, size_t count, void *buf);
+
+/**
+ * block_write_run - Write consecutive blocks to disk
+ * @block: Index of the first block to write to
+ * @count: Number of blocks
+ * @buf: Data buffer to write in the blocks
+ *
+ * Same as @count calls to block_write(), with a single system call.
+ *
+ * Return: -1 if a block is out of bounds or inaccessible or if the writing
+ * operation fails. 0 otherwise.
+ */
+int block_write_run(size_t block, size_t count, const void *buf);
+
+/**
+ * block_map - Get a block in place
+ * @block: Index of the block
+ *
+ * Return a pointer to the bytes of block @block inside the mapping
+ * of a disk opened with block_disk_open_mapped(). Writes through the pointer
+ * reach the image; the pointer is invalidated by block_disk_close().
+ *
+ * Return: NULL if the disk is not mapped or @block is out of bounds. The
+ * address of the block otherwise.
+ */
+void *block_map(size_t block);
+
+/**
+ * block_read_async - Start reading consecutive blocks from disk
+ * @block: Index of the first block to read from
+ * @count: Number of blocks
+ * @buf: Data buffer to be filled with content of the blocks
+ * @aio: Request describing the I/O, with @done and @arg set by the caller
+ *
+ * Same as block_read_run(), but the read is only queued: it runs through
+ * io_uring when the kernel has it, on %BLOCK_AIO_WORKERS worker threads
+ * otherwise. Up to %BLOCK_AIO_DEPTH I/Os are kept in flight; past that, the
+ * oldest completion is reaped first. A mapped disk completes the I/O at once.
+ *
+ * Return: -1 if a block is out of bounds or the I/O can't be queued. 0
+ * otherwise, and the result is in @aio once it is reaped.
+ */
+int block_read_async(size_t block, size_t count, void *buf,
+                     struct block_aio *aio);
+
+/**
+ * block_write_async - Start writing consecutive blocks to disk
+ * @block: Index of the first block to write to
+ * @count: Number of blocks
+ * @buf: Data buffer to write in the blocks
+ * @aio: Request describing the I/O, with @done and @arg set by the caller
+ *
+ * Same as block_read_async(), for block_write_run().
+ *
+ * Return: -1 if a block is out of bounds or the I/O can't be queued. 0
+ * otherwise, and the result is in @aio once it is reaped.
+ */
+int block_write_async(size_t block, size_t count, const void *buf,
+                      struct block_aio *aio);
+
+/**
+ * block_aio_wait - Wait for an asynchronous I/O
+ * @aio: Request given to block_read_async() or block_write_async()
+ *
+ * Completions are reaped in the order they arrive, and the @done function of
+ * each of them is called, until @aio is complete. Any number of threads may
+ * submit and wait at once: one of them reaps for all the others.
+ *
+ * Return: -1 if the I/O failed. 0 otherwise.
+ */
+int block_aio_wait(struct block_aio *aio);
+
+/**
+ * block_aio_drain - Wait for every asynchronous I/O in flight
+ *
+ * Called by block_disk_set_block_size() and block_disk_close(). The result of
+ * each I/O is left in its request.
+ *
+ * Return: -1 if waiting for the completions fails. 0 otherwise.
+ */
+int block_aio_drain(void);
+
+/**
+ * block_get_stats - Get the disk counters
+ * @stats: Filled with the counters accumulated since the disk was opened
+ *
+ * A mapped disk counts its copies as I/Os too.
+ */
+void block_get_stats(struct block_stats *stats);
+
 #endif
\ No newline at end of file
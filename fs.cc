@@ -1,38 +1,164 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <iostream>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
-#include <fstream>
+#include <deque>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <set>
 #include <vector>
 #include <sstream>
+#include <unordered_map>
+#include <pthread.h>
 
 #include "fs.h"
 #include "disk.h"
+#include "cache.h"
+#include "bitmap.h"
+#include "journal.h"
+#include "trace.h"
 
 /* FAT end-of-chain value */
 #define FAT_EOC -1
 
+/* Signature at the start of the superblock */
+#define FS_SIGNATURE "FATFSIMG"
+
+/* On-disk format version, 2 has 32-byte directory entries with byte sizes */
+#define FS_VERSION 2
+
 using namespace std;
 
+/*
+ * Superblock, stored at the start of block 0. The FAT follows in blocks
+ * 1..numFAT, one 32-bit entry per block of the volume, then the journal
+ * (numJournal blocks, none on older images), the root directory and the
+ * data blocks.
+ */
 typedef struct __attribute__((__packed__)) SuperBlock {
     u_int8_t sig[8]; // 8 bytes
-    u_int16_t numBlocks; // 2 bytes
-    u_int16_t numDataBlocks; // 2 bytes
-    u_int16_t numFAT; // 2 bytes
-    u_int16_t rootIndex; // 2 bytes
-    u_int16_t dataIndex; // 2 bytes
-    u_int8_t padding[46];
+    u_int32_t blockSize; // 4 bytes
+    u_int32_t numBlocks; // 4 bytes
+    u_int32_t numDataBlocks; // 4 bytes
+    u_int32_t numFAT; // 4 bytes
+    u_int32_t rootIndex; // 4 bytes
+    u_int32_t dataIndex; // 4 bytes
+    u_int32_t version; // 4 bytes
+    u_int32_t journalIndex; // 4 bytes
+    u_int32_t numJournal; // 4 bytes
+    u_int8_t padding[20];
 }SuperBlock;
 
+static_assert(sizeof(SuperBlock) <= BLOCK_SIZE,
+              "the superblock must fit in the smallest block");
+
 typedef struct __attribute__((__packed__)) Root {
     char name[4];
     char type[3]; // the type is a suffix name
     //u_int16_t type; // 0 represent read a file, and 1 represent write a file.
     u_int8_t attribute;
-    u_int8_t indexFirstBlock;
-    u_int8_t size; // File size in blocks
+    u_int32_t indexFirstBlock;
+    u_int32_t size; // File size in blocks
+    u_int64_t length; // File size in bytes
 }Root;
 
+/*
+ * On-disk form of a directory entry (version 2). Names are stored without
+ * their NULL terminator; %FS_FILE_MAX_COUNT entries fill the smallest block.
+ * The hash of the name is kept so that the directory index is searched and
+ * split without hashing names again.
+ */
+typedef struct __attribute__((__packed__)) DirEntry {
+    char name[3];
+    char type[2];
+    u_int8_t attribute;
+    u_int8_t reserved[2];
+    u_int32_t indexFirstBlock;
+    u_int32_t size; // File size in blocks
+    u_int64_t length; // File size in bytes
+    u_int32_t hash; // name_hash() of the name
+    u_int8_t padding[4];
+}DirEntry;
+
+static_assert(sizeof(DirEntry) == 32, "a directory entry is 32 bytes");
+
+static_assert(sizeof(DirEntry) * FS_FILE_MAX_COUNT <= BLOCK_SIZE,
+              "the smallest block must hold FS_FILE_MAX_COUNT entries");
+
+/* Signature of a directory index block, can't start a directory entry */
+#define DIR_INDEX_SIGNATURE "\0HTX"
+
+/*
+ * A directory starts as one block of entries. When it is full, its first
+ * block becomes the root of an index: a tree of index blocks sorted by
+ * name hash (see name_hash()) whose leaves are blocks of entries. Every
+ * block of the directory is linked in its chain in the FAT.
+ */
+typedef struct __attribute__((__packed__)) DirIndex {
+    u_int8_t sig[4];
+    u_int32_t count; // index entries following the header
+    u_int8_t padding[8];
+} DirIndex;
+
+/* Index entry: the child block holding the names hashed from @hash up */
+typedef struct __attribute__((__packed__)) DirIndexEntry {
+    u_int32_t hash;
+    u_int32_t block;
+} DirIndexEntry;
+
+/* Place of an entry in a directory */
+typedef struct DirSlot {
+    u_int32_t block; // block of entries holding it
+    int slot; // index of the entry in the block
+} DirSlot;
+
+/* A run of contiguous blocks of a file (an extent) */
+typedef struct Extent {
+    u_int32_t start;
+    u_int32_t length;
+} Extent;
+
+/* Maximum number of blocks moved by one I/O */
+#define FS_RUN_MAX_BLOCKS 64
+
+/*
+ * Blocks read ahead of a sequential reader, at first and at most. The most
+ * fills half of the runs the cache keeps, the reader consumes the other half.
+ */
+#define FS_READAHEAD_MIN 4
+#define FS_READAHEAD_MAX (CACHE_PREFETCH_RUNS / 2 * FS_RUN_MAX_BLOCKS)
+
+/*
+ * Bytes appended to an open file that are kept in memory, in blocks, before
+ * their blocks are allocated and written in one run
+ */
+#define FS_APPEND_MAX_BLOCKS FS_RUN_MAX_BLOCKS
+
+/* Number of dentries kept before the dentry cache is emptied */
+#define FS_DCACHE_MAX 4096
+
+/* Number of data blocks a batch buffers before writing them out */
+#define FS_BATCH_MAX_BLOCKS 4096
+
+/* Number of shards of the call counters, the threads are spread over them */
+#define FS_STATS_SHARDS 16
+
+/*
+ * A name looked up in a directory, cached so that walking a path does not
+ * read and scan every directory on the way. A negative entry (slot -1)
+ * remembers that the name is absent.
+ */
+typedef struct Dentry {
+    u_int32_t block; // block of entries holding the name
+    int slot; // index of the entry in the block, -1 if absent
+    u_int8_t attribute;
+    u_int32_t indexFirstBlock;
+} Dentry;
+
 typedef struct FD {
     int id;
     int offset;
@@ -43,6 +169,7 @@ typedef struct FD {
 typedef struct pointer{
     int dnum; // ̿ţкţ
     int bnum; // ֽ̿λãкţ
+    long offset; // byte offset in the file
 } pointer;
 
 // Ѵļ
@@ -50,164 +177,347 @@ typedef struct OFILE{
     char name[20];  // ļ
     char attribute; // ļ
     int indexOfFirstBlock;     // ļʼ̿
-    int length;     // ļȣֽ
+    long length;    // ļȣֽ
     int flag;       // ļ־/д
     pointer read;   // ָ
     pointer write;  // дָ
+    u_int32_t dir;  // first block of the directory holding the file
+    vector<u_int32_t> blocks; // block map, blocks[n] is the n-th block of the chain
+    u_int64_t ra_next; // offset where a sequential read goes on
+    u_int32_t ra_window; // blocks read ahead, 0 until reads are sequential
+    size_t ra_end; // blocks of the chain read ahead up to this one
+    vector<char> pending; // bytes appended past length, no block allocated yet
 } OFILE;
 
 // ļǼǱ
 typedef struct openfile{
-    OFILE file[FS_OPEN_MAX_COUNT];
+    deque<OFILE> file; // indexed by file descriptor, grows on demand
+    deque<mutex> lock; // one per descriptor, serialises the calls on the file
+    vector<int> free; // descriptors of closed entries, reused first
+    unordered_map<string, int> byname; // open_key() -> file descriptor
     int length; // Ѵļ
 } openfile;
 
-static SuperBlock sblk;
-static vector<int> fat(128, 0);
-static vector<Root> root(8);
+/*
+ * Changes of the operations between fs_batch_begin() and fs_batch_commit().
+ * FAT and directory blocks wait in the running journal transaction, data
+ * blocks wait here, in block order, until the batch is written out.
+ */
+typedef struct writebatch {
+    recursive_mutex lock; // guards the batch, shared by every thread
+    int depth; // nested fs_batch_begin() not committed yet
+    bool buffered; // data blocks are buffered (the disk is not mapped)
+    map<u_int32_t, vector<char>> data; // data block -> its new content
+} writebatch;
+
+/*
+ * Call counters bumped by the threads given this shard, summed by
+ * fs_get_stats(). Relaxed atomics: a thread rarely shares its shard.
+ */
+typedef struct StatShard {
+    atomic<size_t> calls[FS_OP_COUNT];
+    atomic<size_t> usec[FS_OP_COUNT];
+    atomic<size_t> latency[FS_OP_COUNT][FS_STATS_BUCKETS];
+    atomic<size_t> bytes_read;
+    atomic<size_t> bytes_written;
+} StatShard;
+
+/*
+ * A file system instance: the disk, cache and journal below it, and the state
+ * its calls share in memory while it is mounted.
+ */
+typedef struct FileSystem {
+    struct disk *disk; // NULL for the default instance of each layer
+    struct cache *cache;
+    struct journal *journal;
+    SuperBlock sblk;
+    vector<int32_t> fat;
+    vector<bool> fat_dirty; // one flag per FAT block changed since fat_sync()
+    vector<u_int32_t> fat_dirty_list; // the FAT blocks flagged in fat_dirty
+    struct bitmap freemap; // free data blocks, mirrors fat[i] == 0
+    // directory block -> name -> dentry
+    unordered_map<u_int32_t, unordered_map<string, Dentry>> dcache;
+    size_t dcache_count;
+    openfile fd;
+    writebatch batch;
+    StatShard stats[FS_STATS_SHARDS]; // see OpStat
+    bool quiet; // no success messages, see fs_set_quiet()
+    size_t cache_blocks; // buffers of the cache, see fs_mount_cache()
+    /*
+     * Locks, always taken in this order: the lock of an open file, directory
+     * locks from the root down, then at most one of the others, which are
+     * held for short sections without any other lock taken meanwhile.
+     */
+    mutex dir_locks_lock; // guards dir_locks
+    // directory first block -> its reader/writer lock, created on first use
+    unordered_map<u_int32_t, pthread_rwlock_t *> dir_locks;
+    recursive_mutex alloc_lock; // fat, fat_dirty, fat_dirty_list, freemap
+    mutex fat_sync_lock; // fat_sync() writes the FAT blocks in order
+    mutex dcache_lock; // dcache, dcache_count
+    mutex fd_lock; // the open file table, but not the open files
+} FileSystem;
+
+/* File system of the threads that did not pick one */
+static FileSystem fs0;
+
+/* File system of the calling thread, see fs_use() */
+static thread_local FileSystem *fs = &fs0;
+
+/* Shard of the counters of the calling thread, handed out in turn */
+static atomic<unsigned> stat_shards(0);
+static thread_local unsigned stat_shard = stat_shards++ % FS_STATS_SHARDS;
+
+/* Names of the functions counted, in the order of enum fs_op */
+static const char *const fs_op_names[] = {
+    "create_file", "open_file", "fs_read", "fs_write", "fs_close", "fs_pread",
+    "fs_pwrite", "fs_lseek", "read_file", "write_file", "close_file",
+    "delete_file", "typefile", "change", "md", "dir", "rd", "fs_sync",
+    "fs_batch_commit",
+};
+static_assert(sizeof(fs_op_names) / sizeof(fs_op_names[0]) == FS_OP_COUNT,
+              "every counted function has a name");
+
+/*
+ * Counts a call of a function of fs.h, with its latency, in the shard of the
+ * calling thread when it goes out of scope. The call is a span of the trace.
+ */
+typedef struct OpStat {
+    StatShard *shard;
+    enum fs_op op;
+    chrono::steady_clock::time_point start;
+    OpStat(enum fs_op op)
+        : shard(&fs->stats[stat_shard]), op(op), start(chrono::steady_clock::now())
+    {
+        if (trace_on())
+            trace_event(fs_op_names[op], 'B', 0, 0);
+    }
+    ~OpStat();
+} OpStat;
+
+/*
+ * A directory lock held by the caller, released when it goes out of scope.
+ * Readers of a directory share its lock, a change of its entries takes it
+ * alone.
+ */
+typedef struct DirLock {
+    pthread_rwlock_t *rw;
+    DirLock() : rw(NULL) {}
+    ~DirLock() { unlock(); }
+    void lock(u_int32_t dir, bool write);
+    void unlock();
+} DirLock;
+
+void formatRoot(const Root& root, DirEntry *entry);
+void dcache_clear();
+void fd_reset();
+int dir_list(u_int32_t dir, vector<Root> *entries, size_t *nfree);
+void release_block(size_t block);
+int batch_write_data();
+int fd_flush();
+
+OpStat::~OpStat()
+{
+    size_t usec = chrono::duration_cast<chrono::microseconds>(
+        chrono::steady_clock::now() - start).count();
+    // bucket b holds the calls from 2^(b-1) up to 2^b microseconds
+    size_t b = usec ? min<size_t>(64 - __builtin_clzll(usec), FS_STATS_BUCKETS - 1) : 0;
+
+    shard->calls[op].fetch_add(1, memory_order_relaxed);
+    shard->usec[op].fetch_add(usec, memory_order_relaxed);
+    shard->latency[op][b].fetch_add(1, memory_order_relaxed);
+    if (trace_on())
+        trace_event(fs_op_names[op], 'E', 0, 0);
+}
 
-static openfile fd;
-static int numFilesOpen = 0;
+/**
+ * stats_reset - zero the call counters of the file system
+*/
+static void stats_reset()
+{
+    for (StatShard &shard : fs->stats) {
+        for (int op = 0; op < FS_OP_COUNT; op++) {
+            shard.calls[op] = 0;
+            shard.usec[op] = 0;
+            for (atomic<size_t> &bucket : shard.latency[op])
+                bucket = 0;
+        }
+        shard.bytes_read = 0;
+        shard.bytes_written = 0;
+    }
+}
 
 /**
- * sb_init - init a SuperBlock *sblk
- *
- * Extract the file information into internal (global) data struct
- * Also perform error check
+ * DirLock::lock - lock a directory
+ * @dir: the first block of the directory
+ * @write: take the lock alone, to change the entries
+*/
+void DirLock::lock(u_int32_t dir, bool write)
+{
+    pthread_rwlock_t *lock;
+
+    {
+        lock_guard<mutex> guard(fs->dir_locks_lock);
+        pthread_rwlock_t *&slot = fs->dir_locks[dir];
+        if (!slot) {
+            slot = new pthread_rwlock_t;
+            pthread_rwlock_init(slot, NULL);
+        }
+        lock = slot;
+    }
+
+    if (write)
+        pthread_rwlock_wrlock(lock);
+    else
+        pthread_rwlock_rdlock(lock);
+    rw = lock;
+}
+
+void DirLock::unlock()
+{
+    if (rw)
+        pthread_rwlock_unlock(rw);
+    rw = NULL;
+}
+
+/**
+ * dir_locks_reset - forget the lock of every directory
  *
- * Return: -1 if error is found, 0 otherwise
+ * only at mount and umount, when no lock is held
 */
-int sb_init()
+static void dir_locks_reset()
 {
-    sblk.numBlocks = 128;
-    sblk.numDataBlocks = 125;
-    sblk.numFAT = 2;
-    sblk.rootIndex = 2;
-    sblk.dataIndex = 3;
+    lock_guard<mutex> guard(fs->dir_locks_lock);
 
-    return 0;
+    for (auto &it : fs->dir_locks) {
+        pthread_rwlock_destroy(it.second);
+        delete it.second;
+    }
+    fs->dir_locks.clear();
 }
 
 /**
- * fat_init - init a file allocation table
+ * fat_blocks - number of blocks taken by the FAT of a volume
+ * @numBlocks: blocks in the volume
+ * @blockSize: size of a block
+*/
+static u_int32_t fat_blocks(u_int32_t numBlocks, u_int32_t blockSize)
+{
+    return ((u_int64_t)numBlocks * sizeof(int32_t) + blockSize - 1) / blockSize;
+}
+
+/**
+ * sb_init - init a SuperBlock *sblk
  *
- * Extract the file allocation table into internal (global) data FAT
- * loading fat table from file
+ * Extract the file information into internal (global) data struct
+ * Also perform error check, then switch the disk to the block size of
+ * the volume
  *
  * Return: -1 if error is found, 0 otherwise
 */
-int fat_init(const char *diskname)
+int sb_init()
 {
-    ifstream file(diskname);
-    if (!file.is_open()) {
-        cerr << "can't open the file" << endl;
+    char buf[BLOCK_SIZE];
+
+    // the disk is still in %BLOCK_SIZE units, the superblock fits in one
+    if (block_read(0, buf) < 0) {
+        cerr << "can't read the superblock" << endl;
         return -1;
     }
+    memcpy(&fs->sblk, buf, sizeof(fs->sblk));
 
-    string line;
-    int index = 0;
-    while (getline(file, line) && index < 128) {
-        istringstream iss(line);
-        int value;
-        while (iss >> value && index < 128) {
-            fat[index++] = value;
-        }
+    if (memcmp(fs->sblk.sig, FS_SIGNATURE, sizeof(fs->sblk.sig)) != 0) {
+        cerr << "no valid file system on the disk" << endl;
+        return -1;
     }
 
-    file.close();
+    if (fs->sblk.version != FS_VERSION) {
+        cerr << "unsupported file system version " << fs->sblk.version << endl;
+        return -1;
+    }
 
-    return 0;
-}
+    if (fs->sblk.numFAT != fat_blocks(fs->sblk.numBlocks, fs->sblk.blockSize)
+        || (fs->sblk.numJournal && fs->sblk.journalIndex != fs->sblk.numFAT + 1)
+        || fs->sblk.rootIndex != fs->sblk.numFAT + 1 + fs->sblk.numJournal
+        || fs->sblk.dataIndex != fs->sblk.rootIndex + 1
+        || fs->sblk.dataIndex >= fs->sblk.numBlocks
+        || fs->sblk.numDataBlocks != fs->sblk.numBlocks - fs->sblk.dataIndex) {
+        cerr << "the superblock is corrupted" << endl;
+        return -1;
+    }
 
-/**
- * parseDirectoryLine - read the string to the root array
- * @line: a line from the disk(File simulation)
- *
- * a line which point to a the top-level directory, for example
- * if you want to create a directory /a/b/c, we must read the directory b
- * firstly, so the root array store b directory
- *
- * Return: -1 if read success. 0 otherwise.
-*/
-void parseDirectoryLine(const string& line) {
-    istringstream iss(line);
-    string token;
-    int rootIndex = 0;
-
-    while (iss >> token) {
-        if (token == "$") {
-            strcpy(root[rootIndex].name, "$\0\0\0");
-            iss >> token;
-            strcpy(root[rootIndex].type, "$\0\0");
-            int attribute, indexFirstBlock, size;
-            if (iss >> attribute >> indexFirstBlock >> size) {
-                root[rootIndex].attribute = static_cast<uint8_t>(attribute);
-                root[rootIndex].indexFirstBlock = static_cast<uint8_t>(indexFirstBlock);
-                root[rootIndex].size = static_cast<uint8_t>(size);
-                rootIndex++;
-            } else {
-                std::cerr << "Invalid directory entry format in line" << std::endl;
-                break;
-            }
-            continue;
-        }
+    if (block_disk_set_block_size(fs->sblk.blockSize) != 0) {
+        return -1;
+    }
 
-        if (rootIndex < 8) {
-            string name = token.substr(0, 3);
-            // because the pre name's length maybe larger than this
-            // take a example, pre: xy, now: a, if no init
-            // it will be ay
-            fill(begin(root[rootIndex].name), end(root[rootIndex].name), '\0');
-            copy(name.begin(), name.end(), root[rootIndex].name);
-
-            iss >> token;
-            string type = token.substr(0, 2);
-            fill(begin(root[rootIndex].type), end(root[rootIndex].type), '\0');
-            copy(type.begin(), type.end(), root[rootIndex].type);
-
-            int attribute, indexFirstBlock, size;
-            if (iss >> attribute >> indexFirstBlock >> size) {
-                root[rootIndex].attribute = static_cast<uint8_t>(attribute);
-                root[rootIndex].indexFirstBlock = static_cast<uint8_t>(indexFirstBlock);
-                root[rootIndex].size = static_cast<uint8_t>(size);
-                rootIndex++;
-            } else {
-                std::cerr << "Invalid directory entry format in line" << std::endl;
-                break;
-            }
-        } else {
-            std::cerr << "Exceeded maximum directory entries" << std::endl;
-            break;
-        }
+    if ((u_int32_t)block_disk_count() < fs->sblk.numBlocks) {
+        cerr << "the disk is smaller than the file system ("
+             << block_disk_count() << "/" << fs->sblk.numBlocks << " blocks)" << endl;
+        return -1;
     }
+
+    return 0;
 }
 
 /**
- * root_init - read the specific disk block to the root array
- * @diskname: disk name
- * @index: the index of the disk block
+ * fat_init - init a file allocation table
  *
- * read the line to the root array, init the root directory
+ * Extract the file allocation table into internal (global) data FAT
+ * loading fat table from blocks 1..%numFAT of the disk, one 32-bit
+ * entry per block of the volume. The array keeps the on-disk layout
+ * (whole FAT blocks) so that a block can be written back as is.
  *
- * Return: -1 if read failed, 0 otherwise
+ * Return: -1 if error is found, 0 otherwise
 */
-int root_init(const char *diskname, u_int8_t index)
+int fat_init()
 {
-    ifstream file(diskname);
-    string line;
-
-    // read the root directory
-    for (int i = 0; i < index; ++i) {
-        std::getline(file, line);
+    u_int32_t per_block = fs->sblk.blockSize / sizeof(int32_t);
+
+    fs->fat.assign((size_t)fs->sblk.numFAT * per_block, 0);
+    fs->fat_dirty.assign(fs->sblk.numFAT, false);
+    fs->fat_dirty_list.clear();
+    for (u_int32_t b = 0; b < fs->sblk.numFAT; b++) {
+        if (cache_read(1 + b, &fs->fat[b * per_block]) < 0) {
+            cerr << "can't read the fat" << endl;
+            return -1;
+        }
     }
 
-    if (getline(file, line)) {
-        parseDirectoryLine(line);
+    bitmap_init(&fs->freemap, fs->sblk.numBlocks);
+    for (u_int32_t i = fs->sblk.dataIndex; i < fs->sblk.numBlocks; i++) {
+        if (fs->fat[i] == 0)
+            bitmap_set_free(&fs->freemap, i);
     }
 
     return 0;
 }
 
+/**
+ * parseDirEntry - read a directory entry from its on-disk form
+ * @entry: the on-disk entry
+ * @root: the directory entry to fill
+*/
+void parseDirEntry(const DirEntry *entry, Root *root)
+{
+    // because the pre name's length maybe larger than this
+    // take a example, pre: xy, now: a, if no init
+    // it will be ay
+    fill(begin(root->name), end(root->name), '\0');
+    memcpy(root->name, entry->name, sizeof(entry->name));
+    fill(begin(root->type), end(root->type), '\0');
+    memcpy(root->type, entry->type, sizeof(entry->type));
+
+    // a slot that was never written reads back as zeros: empty slot
+    if (root->name[0] == '\0') {
+        strcpy(root->name, "$");
+        strcpy(root->type, "$");
+    }
+
+    root->attribute = entry->attribute;
+    root->indexFirstBlock = entry->indexFirstBlock;
+    root->size = entry->size;
+    root->length = entry->length;
+}
+
 // int fd_init()
 // {
 //     for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
@@ -219,15 +529,112 @@ int root_init(const char *diskname, u_int8_t index)
 //     return 0;
 // }
 
+FileSystem *fs_new(void)
+{
+    FileSystem *f = new FileSystem();
+
+    f->disk = block_disk_new();
+    f->cache = cache_new();
+    f->journal = journal_new();
+
+    return f;
+}
+
+int fs_delete(FileSystem *f)
+{
+    if (!f || f == fs) {
+        cerr << "file system in use" << endl;
+        return -1;
+    }
+
+    // the disk stays open while mounted, and the cache and journal with it
+    if (block_disk_delete(f->disk) != 0) {
+        cerr << "file system still mounted" << endl;
+        return -1;
+    }
+    cache_delete(f->cache);
+    journal_delete(f->journal);
+
+    delete f;
+
+    return 0;
+}
+
+FileSystem *fs_use(FileSystem *f)
+{
+    FileSystem *prev = fs;
+
+    fs = f ? f : &fs0;
+    block_disk_use(fs->disk);
+    cache_use(fs->cache);
+    journal_use(fs->journal);
+
+    return prev == &fs0 ? NULL : prev;
+}
+
 int fs_mount(const char *diskname)
 {
-    if (block_disk_open(diskname) != 0) {
+    return fs_mount_flags(diskname, 0);
+}
+
+int fs_mount_flags(const char *diskname, int flags)
+{
+    return fs_mount_cache(diskname, flags, 0);
+}
+
+/**
+ * cache_blocks_default - size the cache after the geometry of the volume
+ *
+ * Return: the number of block buffers
+*/
+static size_t cache_blocks_default()
+{
+    return fs->sblk.numFAT + journal_txn_max(fs->sblk.numJournal)
+           + max<size_t>(CACHE_DEFAULT_BLOCKS, FS_CACHE_BYTES / fs->sblk.blockSize);
+}
+
+int fs_mount_cache(const char *diskname, int flags, size_t cache_blocks)
+{
+    int ret;
+
+    if (flags & FS_MOUNT_MMAP)
+        ret = block_disk_open_mapped(diskname);
+    else
+        ret = block_disk_open(diskname);
+    if (ret != 0) {
+        return -1;
+    }
+
+    if (sb_init() != 0) {
+        block_disk_close();
         return -1;
     }
 
-    sb_init();
-    fat_init(diskname);
-    root_init(diskname, 2);
+    fs->cache_blocks = cache_blocks ? cache_blocks : cache_blocks_default();
+    if (cache_init(fs->cache_blocks) != 0) {
+        block_disk_close();
+        return -1;
+    }
+    dcache_clear();
+    fd_reset();
+    dir_locks_reset();
+    stats_reset();
+    // recovery must come first, the fat may be in the journal. A transaction
+    // leaves buffers unpinned for the directories being walked
+    size_t unpinned = min(fs->cache_blocks / 2, (size_t)CACHE_DEFAULT_BLOCKS / 2);
+    if (journal_init(fs->sblk.journalIndex, fs->sblk.numJournal,
+                     fs->cache_blocks - unpinned, release_block) != 0) {
+        cache_destroy();
+        block_disk_close();
+        return -1;
+    }
+    // every call walks from the root directory, keep it in memory
+    if (fat_init() != 0 || !cache_get(fs->sblk.rootIndex)) {
+        journal_destroy();
+        cache_destroy();
+        block_disk_close();
+        return -1;
+    }
 
     //fd_init();
 
@@ -235,72 +642,236 @@ int fs_mount(const char *diskname)
 }
 
 /**
- * saveFatToFile - write the fat array back to the disk(file)
- * @diskname: the disk's name
+ * fat_set - change a fat entry
+ * @index: the block whose entry changes
+ * @value: the next block, %FAT_EOC or 0 (free)
+ *
+ * the FAT block holding the entry is flagged to be written back by
+ * the next fat_sync()
+*/
+void fat_set(u_int32_t index, int32_t value)
+{
+    lock_guard<recursive_mutex> guard(fs->alloc_lock);
+    u_int32_t b = index / (fs->sblk.blockSize / sizeof(int32_t));
+
+    fs->fat[index] = value;
+    if (!fs->fat_dirty[b]) {
+        fs->fat_dirty[b] = true;
+        fs->fat_dirty_list.push_back(b);
+    }
+}
+
+/**
+ * fat_sync - write the changed fat blocks back to the disk
  *
- * At the end of the program, you must write back the data to the disk
- * it can be persistent storage.
+ * Only the FAT blocks changed since the last call are written, so the
+ * cost follows the number of changed entries, not the size of the fat.
+ * Called after every operation that changes the fat and at umount.
+ *
+ * A block is copied under the allocator lock and written without it, so
+ * that other threads can keep allocating; a block changed meanwhile is
+ * flagged again and written once more.
  *
  * Return: -1 if write back failed. 0 otherwise.
 */
-void saveFatToFile(const string& filename) {
-    // read all the content from the file
-    ifstream fileIn(filename);
-    vector<string> lines;
-    string line;
-    while (getline(fileIn, line)) {
-        lines.push_back(line);
-    }
-    fileIn.close();
-
-    // ready for the new content, write fat to the first two lines
-    ostringstream fatData;
-    for (int i = 0; i < 64; ++i) {
-        fatData << fat[i];
-        if (i < 63) fatData << " ";
-    }
-    string firstLine = fatData.str();
-    fatData.str("");
-    fatData.clear();
-
-    for (int i = 64; i < 128; ++i) {
-        fatData << fat[i];
-        if (i < 127) fatData << " ";
-    }
-    string secondLine = fatData.str();
-
-    // use new fat data substitude for the old fat
-    if (lines.size() >= 2) {
-        lines[0] = firstLine;
-        lines[1] = secondLine;
-    } else {
-        // if data line < 2, supplement blank lines, (but it will never happen)
-        lines.resize(2, "");
-        lines[0] = firstLine;
-        lines[1] = secondLine;
+int fat_sync()
+{
+    lock_guard<mutex> sync(fs->fat_sync_lock);
+    u_int32_t per_block = fs->sblk.blockSize / sizeof(int32_t);
+    vector<int32_t> buf(per_block);
+
+    for (;;) {
+        u_int32_t b;
+        {
+            lock_guard<recursive_mutex> guard(fs->alloc_lock);
+            if (fs->fat_dirty_list.empty())
+                break;
+            b = fs->fat_dirty_list.back();
+            fs->fat_dirty_list.pop_back();
+            fs->fat_dirty[b] = false;
+            memcpy(buf.data(), &fs->fat[(size_t)b * per_block], fs->sblk.blockSize);
+        }
+        if (journal_write(1 + b, buf.data()) < 0) {
+            cerr << "can't write back the fat" << endl;
+            fat_set(b * per_block, fs->fat[(size_t)b * per_block]);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int fs_sync(void)
+{
+    OpStat counted(FS_OP_SYNC);
+    if (block_disk_count() == -1) {
+        return -1;
     }
 
-    // write back all the content to the file
-    ofstream fileOut(filename);
-    for (const auto& l : lines) {
-        fileOut << l; // don need extra "\n"
-        if (&l != &lines.back()) // add the "\n" if it is not the last line
-            fileOut << "\n";
+    // the journal writes the cache back itself, between two transactions
+    if (fd_flush() != 0 || batch_write_data() != 0 || fat_sync() != 0
+        || journal_flush() != 0
+        || (fs->sblk.numJournal == 0 && cache_flush() != 0)) {
+        return -1;
     }
-    fileOut.close();
+
+    return block_disk_sync();
 }
 
-int fs_umount(const char *diskname)
+int fs_batch_begin(void)
 {
-    if (block_disk_close() != 0) {
+    if (block_disk_count() == -1) {
         return -1;
     }
 
-    saveFatToFile(diskname);
+    {
+        lock_guard<recursive_mutex> guard(fs->batch.lock);
+        if (fs->batch.depth++ == 0) {
+            // in place writes cost no I/O, there is nothing to gather
+            fs->batch.buffered = block_map(0) == NULL;
+        }
+    }
+    journal_start();
 
     return 0;
 }
 
+int fs_batch_commit(void)
+{
+    OpStat counted(FS_OP_BATCH_COMMIT);
+    // the appends held by open files join the batch, under their own locks
+    int flushed = fd_flush();
+    unique_lock<recursive_mutex> guard(fs->batch.lock);
+
+    if (fs->batch.depth == 0) {
+        cerr << "no batch to commit" << endl;
+        return -1;
+    }
+
+    if (--fs->batch.depth > 0) {
+        journal_stop();
+        return 0;
+    }
+
+    // the data is on the disk before the metadata pointing to it
+    int ret = batch_write_data() | flushed;
+    if (fat_sync() != 0) {
+        ret = -1;
+    }
+    // the commit waits for the other operations, they may need the lock
+    guard.unlock();
+    if (journal_commit() != 0) {
+        ret = -1;
+    }
+    // without a journal the batch is written out as a whole instead
+    if (fs->sblk.numJournal == 0 && (cache_flush() != 0 || block_disk_sync() != 0)) {
+        ret = -1;
+    }
+    journal_stop();
+
+    return ret;
+}
+
+int fs_umount(const char *diskname)
+{
+    if (block_disk_count() == -1) {
+        return -1;
+    }
+
+    // a batch left open is committed with the rest. Every step runs even if
+    // one fails, so that the file system is unmounted anyway
+    int ret = 0;
+    ret |= fd_flush();
+    ret |= batch_write_data();
+    ret |= fat_sync();
+    fs->batch.lock.lock();
+    fs->batch.depth = 0;
+    fs->batch.lock.unlock();
+
+    cache_put(fs->sblk.rootIndex, 0);
+    dcache_clear();
+    fd_reset();
+    dir_locks_reset();
+    ret |= journal_destroy();
+    ret |= cache_destroy();
+    ret |= block_disk_sync();
+    ret |= block_disk_close();
+
+    return ret ? -1 : 0;
+}
+
+int fs_format(const char *diskname, size_t numBlocks, size_t blockSize)
+{
+    SuperBlock sb;
+    // a sixteenth of the volume goes to the journal
+    size_t numJournal = min(max(numBlocks / 16, (size_t)JOURNAL_MIN_BLOCKS),
+                            (size_t)JOURNAL_MAX_BLOCKS);
+
+    if (blockSize < BLOCK_SIZE || (blockSize & (blockSize - 1))) {
+        cerr << "block size must be a power of two >= " << BLOCK_SIZE << endl;
+        return -1;
+    }
+    if (numBlocks > UINT32_MAX
+        || numBlocks <= fat_blocks(numBlocks, blockSize) + numJournal + 2) {
+        cerr << "invalid number of blocks" << endl;
+        return -1;
+    }
+
+    memset(&sb, 0, sizeof(sb));
+    memcpy(sb.sig, FS_SIGNATURE, sizeof(sb.sig));
+    sb.blockSize = blockSize;
+    sb.numBlocks = numBlocks;
+    sb.numFAT = fat_blocks(numBlocks, blockSize);
+    sb.journalIndex = sb.numFAT + 1;
+    sb.numJournal = numJournal;
+    sb.rootIndex = sb.journalIndex + sb.numJournal;
+    sb.dataIndex = sb.rootIndex + 1;
+    sb.version = FS_VERSION;
+    sb.numDataBlocks = sb.numBlocks - sb.dataIndex;
+
+    if (block_disk_create(diskname, numBlocks, blockSize) != 0
+        || block_disk_open(diskname) != 0) {
+        return -1;
+    }
+    if (block_disk_set_block_size(blockSize) != 0) {
+        block_disk_close();
+        return -1;
+    }
+
+    vector<char> buf(blockSize, 0);
+    int ret = 0;
+
+    memcpy(buf.data(), &sb, sizeof(sb));
+    ret |= block_write(0, buf.data());
+
+    // superblock, FAT, journal and root are reserved, the rest of the FAT is zero
+    // already, only the blocks holding reserved entries are written
+    u_int32_t per_block = blockSize / sizeof(int32_t);
+    for (u_int32_t i = 0; i <= sb.rootIndex; i += per_block) {
+        int32_t *entries = (int32_t *)buf.data();
+        fill(buf.begin(), buf.end(), 0);
+        for (u_int32_t j = 0; j < per_block && i + j <= sb.rootIndex; j++) {
+            entries[j] = FAT_EOC;
+        }
+        ret |= block_write(1 + i / per_block, buf.data());
+    }
+
+    fill(buf.begin(), buf.end(), 0);
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+        Root empty = {"$", "$", 0, 0, 0};
+        formatRoot(empty, (DirEntry *)buf.data() + i);
+    }
+    ret |= block_write(sb.rootIndex, buf.data());
+    ret |= journal_format(sb.journalIndex, sb.numJournal);
+
+    if (ret != 0) {
+        block_disk_close();
+        return -1;
+    }
+
+    return block_disk_close();
+}
+
 /**
  * num_free_fat - calculate how much free block it have
  *
@@ -308,13 +879,8 @@ int fs_umount(const char *diskname)
 */
 int num_free_fat()
 {
-    int count = 0;
-    for (int i = 0; i < sblk.numDataBlocks; i++) {
-        if (fat[i] == 0)
-            count++;
-    }
-
-    return count;
+    lock_guard<recursive_mutex> guard(fs->alloc_lock);
+    return fs->freemap.nfree;
 }
 
 /**
@@ -324,13 +890,15 @@ int num_free_fat()
 */
 int num_free_rdir()
 {
-    int count = 0;
-    for (int i = 1; i < FS_FILE_MAX_COUNT; i++) {
-        if ((char)*(root[i].name) == '\0')
-            count++;
-    }
+    vector<Root> entries;
+    size_t nfree = 0;
+    DirLock lock;
+
+    lock.lock(fs->sblk.rootIndex, false);
+    if (dir_list(fs->sblk.rootIndex, &entries, &nfree) != 0)
+        return -1;
 
-    return count;
+    return nfree;
 }
 
 int fs_info(void)
@@ -340,91 +908,149 @@ int fs_info(void)
     }
 
     cout << "FS info:" << endl;
-    cout << "total_blk_count = " << sblk.numBlocks << endl;
-    cout << "fat_blk_count = " << sblk.numFAT << endl;
-    cout << "data_blk_count = " << sblk.numDataBlocks << endl;
-    cout << "rdir_blk = " << sblk.rootIndex << endl;
-    cout << "data_blk = " << sblk.dataIndex << endl;
+    cout << "blk_size = " << fs->sblk.blockSize << endl;
+    cout << "total_blk_count = " << fs->sblk.numBlocks << endl;
+    cout << "fat_blk_count = " << fs->sblk.numFAT << endl;
+    cout << "data_blk_count = " << fs->sblk.numDataBlocks << endl;
+    cout << "rdir_blk = " << fs->sblk.rootIndex << endl;
+    cout << "data_blk = " << fs->sblk.dataIndex << endl;
 
     cout << "fat_free = " << num_free_fat() << endl;
     cout << "rdir_free = " << num_free_rdir() << endl;
 
-    for (int i = 0; i < 8; ++i) {
-        if (root[i].name[0] == '\0') continue;  // Ŀ¼
-        std::cout << "File " << i << ": " << root[i].name << ", "
-                  << "Type: " << root[i].type << ", "
-                  << "Attribute: " << static_cast<int>(root[i].attribute) << ", "
-                  << "IndexFirstBlock: " << static_cast<int>(root[i].indexFirstBlock) << ", "
-                  << "Size: " << static_cast<int>(root[i].size) << " blocks" << std::endl;
+    struct cache_stats cs;
+    cache_get_stats(&cs);
+    cout << "cache_blk_count = " << fs->cache_blocks << endl;
+    cout << "cache_hits = " << cs.hits << endl;
+    cout << "cache_misses = " << cs.misses << endl;
+    cout << "cache_evictions = " << cs.evictions << endl;
+    cout << "cache_writebacks = " << cs.writebacks << endl;
+    cout << "cache_readahead = " << cs.readahead << endl;
+    cout << "cache_readahead_hits = " << cs.readahead_hits << endl;
+
+    struct journal_stats js;
+    journal_get_stats(&js);
+    cout << "journal_blk_count = " << fs->sblk.numJournal << endl;
+    cout << "journal_ops = " << js.ops << endl;
+    cout << "journal_commits = " << js.commits << endl;
+    cout << "journal_logged_blks = " << js.blocks << endl;
+    cout << "journal_checkpoints = " << js.checkpoints << endl;
+    cout << "journal_splits = " << js.splits << endl;
+
+    vector<Root> entries;
+    size_t nfree = 0;
+    dir_list(fs->sblk.rootIndex, &entries, &nfree);
+    for (size_t i = 0; i < entries.size(); ++i) {
+        std::cout << "File " << i << ": " << entries[i].name << ", "
+                  << "Type: " << entries[i].type << ", "
+                  << "Attribute: " << static_cast<int>(entries[i].attribute) << ", "
+                  << "IndexFirstBlock: " << static_cast<int>(entries[i].indexFirstBlock) << ", "
+                  << "Size: " << static_cast<int>(entries[i].size) << " blocks" << std::endl;
     }
     return 0;
 }
 
-/**
- * formatRoot - transfer the root directory to the string
- * @root: the root array
- *
- * change to a string
- *
- * Return: the string of the transfered root dir
-*/
-string formatRoot(const Root& root)
+void fs_set_quiet(bool quiet)
 {
-    ostringstream oss;
-    oss << root.name << " " << root.type << " "
-        << static_cast<int>(root.attribute) << " "
-        << static_cast<int>(root.indexFirstBlock) << " "
-        << static_cast<int>(root.size);
-    return oss.str();
+    fs->quiet = quiet;
 }
 
-/**
- * writeDirToDisk - write root array to Specific lines
- * @roots: the root array, that store directory structure
- * @filename: the diskname
- * @linetoreplace: the line to be replaced
- *
- * when the directory is changed, you must write it to the disk timely
- * because you have to keep reading it later, such as the root_init function
- * or when you create a new directory, you must init the disk timely.
-*/
-void writeDirToDisk(const vector<Root>& roots, const string& filename, int lineToReplace)
+int fs_get_stats(struct fs_stats *stats)
 {
-    ifstream inputFile(filename);
-    vector<string> lines;
-    string line;
+    if (block_disk_count() == -1) {
+        return -1;
+    }
 
-    // read all the file content to lines
-    while (std::getline(inputFile, line)) {
-        lines.push_back(line);
+    memset(stats, 0, sizeof(*stats));
+    for (const StatShard &shard : fs->stats) {
+        for (int op = 0; op < FS_OP_COUNT; op++) {
+            stats->ops[op].calls += shard.calls[op].load(memory_order_relaxed);
+            stats->ops[op].usec += shard.usec[op].load(memory_order_relaxed);
+            for (int b = 0; b < FS_STATS_BUCKETS; b++)
+                stats->ops[op].latency[b] += shard.latency[op][b].load(memory_order_relaxed);
+        }
+        stats->bytes_read += shard.bytes_read.load(memory_order_relaxed);
+        stats->bytes_written += shard.bytes_written.load(memory_order_relaxed);
     }
-    inputFile.close();
 
-    // change subDir array to a string
-    ostringstream oss;
-    for (const auto& root : roots) {
-        oss << formatRoot(root) << " ";
+    struct block_stats bs;
+    block_get_stats(&bs);
+    stats->disk_reads = bs.reads;
+    stats->disk_writes = bs.writes;
+    stats->blocks_read = bs.blocks_read;
+    stats->blocks_written = bs.blocks_written;
+
+    lock_guard<recursive_mutex> guard(fs->alloc_lock);
+    stats->allocs = fs->freemap.allocs;
+    stats->alloc_scanned = fs->freemap.scanned;
+
+    return 0;
+}
+
+int fs_stats(void)
+{
+    struct fs_stats st;
+
+    if (fs_get_stats(&st) != 0) {
+        return -1;
     }
-    string rootLine = oss.str();
 
-    // replace
-    if (lineToReplace < lines.size()) {
-        lines[lineToReplace] = rootLine;
-    } else {
-        // fill with '\n'
-        while (lines.size() <= lineToReplace) {
-            lines.push_back("");
+    ostringstream out;
+    out << fixed << setprecision(2);
+    out << "FS stats:" << endl;
+    for (int op = 0; op < FS_OP_COUNT; op++) {
+        const struct fs_op_stats &o = st.ops[op];
+        if (o.calls == 0)
+            continue;
+        out << fs_op_names[op] << ": calls = " << o.calls
+            << ", avg_us = " << (double)o.usec / o.calls << endl;
+        out << "  latency_us";
+        for (int b = 0; b < FS_STATS_BUCKETS; b++) {
+            if (o.latency[b] == 0)
+                continue;
+            if (b < FS_STATS_BUCKETS - 1)
+                out << " <" << (1UL << b);
+            else
+                out << " >=" << (1UL << (b - 1));
+            out << ": " << o.latency[b];
         }
-        lines[lineToReplace] = rootLine;
-    }
+        out << endl;
+    }
+
+    size_t written = st.blocks_written * fs->sblk.blockSize;
+    out << "bytes_read = " << st.bytes_read << endl;
+    out << "bytes_written = " << st.bytes_written << endl;
+    out << "disk_reads = " << st.disk_reads << endl;
+    out << "disk_writes = " << st.disk_writes << endl;
+    out << "disk_blk_read = " << st.blocks_read << endl;
+    out << "disk_blk_written = " << st.blocks_written << endl;
+    // bytes reaching the image, journal included, per byte written to a file
+    out << "write_amplification = "
+        << (st.bytes_written ? (double)written / st.bytes_written : 0.0) << endl;
+    out << "alloc_calls = " << st.allocs << endl;
+    out << "alloc_words_scanned = " << st.alloc_scanned << endl;
+    out << "alloc_scan_avg = "
+        << (st.allocs ? (double)st.alloc_scanned / st.allocs : 0.0) << endl;
+    cout << out.str();
 
-    // write back file
-    ofstream outputFile(filename);
-    for (const auto& l : lines) {
-        outputFile << l << "\n";
-    }
+    return 0;
 }
 
+/**
+ * formatRoot - transfer the root directory to its on-disk form
+ * @root: the directory entry
+ * @entry: the on-disk entry to fill
+*/
+void formatRoot(const Root& root, DirEntry *entry)
+{
+    strncpy(entry->name, root.name, sizeof(entry->name));
+    strncpy(entry->type, root.type, sizeof(entry->type));
+    entry->attribute = root.attribute;
+    memset(entry->reserved, 0, sizeof(entry->reserved));
+    entry->indexFirstBlock = root.indexFirstBlock;
+    entry->size = root.size;
+    entry->length = root.length;
+}
 
 /**
  * valid_filename - judge that a filename is valid
@@ -435,7 +1061,7 @@ void writeDirToDisk(const vector<Root>& roots, const string& filename, int lineT
 int valid_name(const string &filename)
 {
     char bad_chars[] = "!@#%^*|~&";
-    for (int i = 0; i < strlen(bad_chars); i++) {
+    for (size_t i = 0; i < strlen(bad_chars); i++) {
         if (filename.find(bad_chars) != string::npos)
             return -1;
     } // check valid filename
@@ -446,38 +1072,120 @@ int valid_name(const string &filename)
 /**
  * find_empty_fat - find the empty block to use
  *
- * Return: -1 if no space to allocate. 0 otherwise
+ * The block is taken from the free bitmap, the caller must link it
+ * in the fat.
+ *
+ * Return: -1 if no space to allocate. the block index otherwise
 */
 int find_empty_fat()
 {
-    u_int8_t itr = 3;
-    while (itr < sblk.numDataBlocks) {
-        if (fat[itr] == 0) {
-            return itr;
-        }
-        itr++;
-    }
-
-    return -1; // no space
+    trace_scope span("find_empty_fat");
+    lock_guard<recursive_mutex> guard(fs->alloc_lock);
+    return bitmap_alloc(&fs->freemap); // -1 if no space
 }
 
 /**
- * splitPath - split the pathname through '/'
- * @path: a string path: /a/b/c
+ * alloc_extent - allocate contiguous blocks
+ * @want: the number of blocks wanted
+ * @ext: filled with the allocated run
  *
- * split the path to the file name, for example, /a/b/c
- * split into a array that ['a', 'b', 'c'].
+ * The blocks are linked to each other in the fat, the last one ends
+ * the chain. Less than @want blocks are returned when no free run is
+ * long enough.
  *
- * Return: a vector<string>
+ * Return: -1 if no space to allocate. 0 otherwise
 */
-vector<string> splitPath(const string &path) {
-    vector<std::string> tokens;
-    istringstream stream(path);
-    string token;
+int alloc_extent(size_t want, Extent *ext)
+{
+    trace_scope span("alloc_extent");
+    lock_guard<recursive_mutex> guard(fs->alloc_lock);
+    size_t len;
+    long start = bitmap_alloc_run(&fs->freemap, want, &len);
 
-    // Use '/' as delimiter to split path
-    while (std::getline(stream, token, '/')) {
-        if (!token.empty()) {  // Ignore empty tokens
+    if (start < 0)
+        return -1; // no space
+
+    for (size_t i = 0; i + 1 < len; i++) {
+        fat_set(start + i, start + i + 1);
+    }
+    fat_set(start + len - 1, FAT_EOC);
+
+    ext->start = start;
+    ext->length = len;
+
+    return 0;
+}
+
+/**
+ * file_extents - get the runs of contiguous blocks of a chain
+ * @first: the first block of the chain
+ * @max_length: split runs longer than this
+ *
+ * Return: the runs of the chain, in file order
+*/
+vector<Extent> file_extents(u_int32_t first, u_int32_t max_length)
+{
+    vector<Extent> exts;
+    int32_t block = first;
+
+    while (block != FAT_EOC) {
+        if (!exts.empty() && exts.back().start + exts.back().length == (u_int32_t)block
+            && exts.back().length < max_length) {
+            exts.back().length++;
+        } else {
+            exts.push_back({(u_int32_t)block, 1});
+        }
+        block = fs->fat[block];
+    }
+
+    return exts;
+}
+
+/**
+ * free_block - give a block back
+ * @block: the block to release
+*/
+void free_block(int block)
+{
+    fs->batch.lock.lock();
+    fs->batch.data.erase(block);
+    fs->batch.lock.unlock();
+
+    fat_set(block, 0);
+    // the journal may call release_block(), not under the allocator lock
+    if (!journal_free(block)) {
+        lock_guard<recursive_mutex> guard(fs->alloc_lock);
+        bitmap_set_free(&fs->freemap, block);
+    }
+}
+
+/**
+ * release_block - make a block freed by free_block() allocatable
+ * @block: a block whose reuse was deferred by the journal
+*/
+void release_block(size_t block)
+{
+    lock_guard<recursive_mutex> guard(fs->alloc_lock);
+    bitmap_set_free(&fs->freemap, block);
+}
+
+/**
+ * splitPath - split the pathname through '/'
+ * @path: a string path: /a/b/c
+ *
+ * split the path to the file name, for example, /a/b/c
+ * split into a array that ['a', 'b', 'c'].
+ *
+ * Return: a vector<string>
+*/
+vector<string> splitPath(const string &path) {
+    vector<std::string> tokens;
+    istringstream stream(path);
+    string token;
+
+    // Use '/' as delimiter to split path
+    while (std::getline(stream, token, '/')) {
+        if (!token.empty()) {  // Ignore empty tokens
             tokens.push_back(token);
         }
     }
@@ -514,279 +1222,1629 @@ vector<string> splitSuffix(string filename)
 
 /**
  * update_block - write the new data to disk block
- * @diskname: disk name
- * @line_number: the specific disk block
- * @new_data: the block's new data
+ * @block: the specific disk block
+ * @new_data: the block's new data (one block of bytes)
  *
  * write the data to the block, and cover the old data
+ *
+ * Return: -1 if the block is invalid or the write failed, 0 otherwise
+*/
+int update_block(int block, const char *new_data)
+{
+    if (block < (int)fs->sblk.dataIndex || block >= (int)fs->sblk.numBlocks) {
+        cerr << "Error: Invalid block number. Must be between " << fs->sblk.dataIndex
+             << " and " << fs->sblk.numBlocks - 1 << "." << endl;
+        return -1;
+    }
+
+    return cache_write(block, new_data);
+}
+
+/**
+ * dir_key - the name under which an entry is stored
+ * @name: a file or directory name, without suffix
+ *
+ * names are cut to %FS_FILENAME_LEN characters when an entry is created,
+ * lookups cut them the same way
+*/
+string dir_key(const string &name)
+{
+    return name.substr(0, FS_FILENAME_LEN);
+}
+
+/**
+ * name_hash - hash of a name in a directory index (32-bit FNV-1a)
+ * @name: the name, as returned by dir_key()
+*/
+u_int32_t name_hash(const string &name)
+{
+    u_int32_t hash = 2166136261u;
+
+    for (unsigned char c : name) {
+        hash ^= c;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static u_int32_t dir_slots()
+{
+    return fs->sblk.blockSize / sizeof(DirEntry);
+}
+
+static u_int32_t dir_index_limit()
+{
+    return (fs->sblk.blockSize - sizeof(DirIndex)) / sizeof(DirIndexEntry);
+}
+
+static bool is_dir_index(const void *block)
+{
+    return memcmp(block, DIR_INDEX_SIGNATURE, sizeof(((DirIndex *)0)->sig)) == 0;
+}
+
+static bool entry_empty(const DirEntry &entry)
+{
+    return entry.name[0] == '\0' || entry.name[0] == '$';
+}
+
+static string entry_name(const DirEntry &entry)
+{
+    return string(entry.name, strnlen(entry.name, sizeof(entry.name)));
+}
+
+/**
+ * index_child - find the child of an index block covering a hash
+ * @entries: the entries of the index block, sorted by hash
+ * @count: the number of entries
+ * @hash: the hash looked up
+ *
+ * Return: the last entry whose hash is not above @hash, the first entry
+ * covers everything below the second one
+*/
+static u_int32_t index_child(const DirIndexEntry *entries, u_int32_t count, u_int32_t hash)
+{
+    u_int32_t lo = 0, hi = count;
+
+    while (hi - lo > 1) {
+        u_int32_t mid = lo + (hi - lo) / 2;
+        if (entries[mid].hash <= hash)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/**
+ * dir_leaf - find the block of entries that may hold a hash
+ * @dir: the first block of the directory
+ * @hash: the hash of the name
+ * @leaf: filled with the block
+ *
+ * Return: -1 if a block can't be read, 0 otherwise
+*/
+int dir_leaf(u_int32_t dir, u_int32_t hash, u_int32_t *leaf)
+{
+    u_int32_t block = dir;
+
+    for (;;) {
+        const char *data = (const char *)cache_get(block);
+        if (!data) {
+            cerr << "can't read the directory" << endl;
+            return -1;
+        }
+        if (!is_dir_index(data)) {
+            cache_put(block, 0);
+            *leaf = block;
+            return 0;
+        }
+
+        const DirIndex *header = (const DirIndex *)data;
+        const DirIndexEntry *entries = (const DirIndexEntry *)(header + 1);
+        u_int32_t next = entries[index_child(entries, header->count, hash)].block;
+        cache_put(block, 0);
+        block = next;
+    }
+}
+
+/**
+ * dcache_clear - forget every cached dentry
+*/
+void dcache_clear()
+{
+    lock_guard<mutex> guard(fs->dcache_lock);
+    fs->dcache.clear();
+    fs->dcache_count = 0;
+}
+
+/**
+ * dcache_invalidate - forget the cached dentries of a directory
+ * @dir: the first block of the directory
+ *
+ * must be called whenever entries of the directory move to other slots,
+ * or the block is reused for another directory
 */
-void update_block(const string& diskname, int line_number, const string& new_data) {
-    if (line_number < 0 || line_number >= FS_DISK_MAX) {
-        cerr << "Error: Invalid line number. Must be between 0 and " << FS_DISK_MAX - 1 << "." << endl;
+void dcache_invalidate(u_int32_t dir)
+{
+    lock_guard<mutex> guard(fs->dcache_lock);
+    auto it = fs->dcache.find(dir);
+
+    if (it == fs->dcache.end())
         return;
+    fs->dcache_count -= it->second.size();
+    fs->dcache.erase(it);
+}
+
+/**
+ * dcache_forget - forget the cached dentry of one name
+ * @dir: the first block of the directory
+ * @name: the name, as returned by dir_key()
+ *
+ * must be called whenever the entry is created, deleted or changed
+*/
+void dcache_forget(u_int32_t dir, const string &name)
+{
+    lock_guard<mutex> guard(fs->dcache_lock);
+    auto it = fs->dcache.find(dir);
+
+    if (it != fs->dcache.end() && it->second.erase(name))
+        fs->dcache_count--;
+}
+
+/**
+ * dcache_lookup - find a name in a directory
+ * @dir: the first block of the directory
+ * @name: the name of the entry, as returned by dir_key()
+ * @d: filled with the entry, its slot is -1 if the name is absent
+ *
+ * the directory index is only walked on a dentry cache miss, the result
+ * (found or not) is cached for the next lookup. The caller holds the lock
+ * of the directory.
+ *
+ * Return: -1 if the directory can't be read, 0 otherwise
+*/
+int dcache_lookup(u_int32_t dir, const string &name, Dentry *d)
+{
+    {
+        lock_guard<mutex> guard(fs->dcache_lock);
+        auto it = fs->dcache.find(dir);
+        if (it != fs->dcache.end()) {
+            auto e = it->second.find(name);
+            if (e != it->second.end()) {
+                *d = e->second;
+                return 0;
+            }
+        }
     }
 
-    // read the file, store to the vector<string>
-    ifstream infile(diskname);
-    vector<string> lines;
-    string line;
+    u_int32_t leaf;
+    if (dir_leaf(dir, name_hash(name), &leaf) != 0)
+        return -1;
 
-    while (getline(infile, line)) {
-        lines.push_back(line.empty() ? "" : line);
+    const DirEntry *entries = (const DirEntry *)cache_get(leaf);
+    if (!entries) {
+        cerr << "can't read the directory" << endl;
+        return -1;
+    }
+    d->block = leaf;
+    d->slot = -1;
+    d->attribute = 0;
+    d->indexFirstBlock = 0;
+    u_int32_t hash = name_hash(name);
+    for (u_int32_t i = 0; i < dir_slots(); i++) {
+        if (!entry_empty(entries[i]) && entries[i].hash == hash
+            && entry_name(entries[i]) == name) {
+            d->slot = i;
+            d->attribute = entries[i].attribute;
+            d->indexFirstBlock = entries[i].indexFirstBlock;
+            break;
+        }
     }
-    infile.close();
+    cache_put(leaf, 0);
 
-    // modify the content
-    if (line_number < lines.size()) {
-        lines[line_number] = new_data;
+    lock_guard<mutex> guard(fs->dcache_lock);
+    if (fs->dcache_count >= FS_DCACHE_MAX) {
+        fs->dcache.clear();
+        fs->dcache_count = 0;
     }
+    fs->dcache[dir][name] = *d;
+    fs->dcache_count++;
+
+    return 0;
+}
+
+/**
+ * walk_path - find the directory holding the last component of a path
+ * @tokens: the path split by splitPath()
+ * @lock: takes the lock of the directory found
+ * @write: lock the directory found alone, to change its entries
+ *
+ * every component but the last one must be a directory, they are looked
+ * up through the dentry cache starting from the root directory. Each
+ * directory is locked before its parent is released, so it can't be
+ * removed in between.
+ *
+ * Return: -1 if a directory on the way is missing, the first block of the
+ * directory holding the last component otherwise
+*/
+int walk_path(const vector<string> &tokens, DirLock *lock, bool write)
+{
+    u_int32_t current_index = fs->sblk.rootIndex;
+    Dentry d;
+
+    if (tokens.empty())
+        return -1;
 
-    while (lines.size() <= line_number) {
-        lines.push_back(""); // fill with blank line
+    lock->lock(current_index, write && tokens.size() == 1);
+    for (size_t k = 0; k + 1 < tokens.size(); k++) {
+        if (dcache_lookup(current_index, dir_key(tokens[k]), &d) != 0)
+            return -1;
+        if (d.slot < 0 || d.attribute != 8)
+            return -1;
+        current_index = d.indexFirstBlock;
+
+        DirLock parent;
+        swap(parent.rw, lock->rw);
+        lock->lock(current_index, write && k + 2 == tokens.size());
     }
-    lines[line_number] = new_data;
 
-    // write back file
-    ofstream outfile(diskname);
-    for (const auto& l : lines) {
-        outfile << l << "\n";
+    return current_index;
+}
+
+/**
+ * dir_find - find an entry of a directory
+ * @dir: the first block of the directory
+ * @name: the name of the entry, without suffix
+ * @entry: filled with the entry if found
+ * @where: filled with the place of the entry if found
+ *
+ * Return: -1 if the directory can't be read, 1 if the entry is found,
+ * 0 otherwise
+*/
+int dir_find(u_int32_t dir, const string &name, Root *entry, DirSlot *where)
+{
+    Dentry d;
+
+    if (dcache_lookup(dir, dir_key(name), &d) != 0)
+        return -1;
+    if (d.slot < 0)
+        return 0;
+
+    const DirEntry *entries = (const DirEntry *)cache_get(d.block);
+    if (!entries) {
+        cerr << "can't read the directory" << endl;
+        return -1;
     }
-    outfile.close();
+    parseDirEntry(&entries[d.slot], entry);
+    cache_put(d.block, 0);
+    where->block = d.block;
+    where->slot = d.slot;
+
+    return 1;
 }
 
-int create_file(const string &pathname, char attribute)
+/**
+ * dir_init - write an empty directory
+ * @block: the block of the new directory
+ *
+ * Return: -1 if write failed, 0 otherwise
+*/
+int dir_init(u_int32_t block)
 {
-    if (valid_name(pathname) == -1)
+    vector<char> buf(fs->sblk.blockSize, 0);
+
+    dcache_invalidate(block);
+
+    return journal_write(block, buf.data());
+}
+
+/**
+ * dir_alloc_block - add a block to a directory
+ * @dir: the first block of the directory
+ *
+ * the block is linked in the chain of the directory right after its first
+ * block, so that rd() releases it with the rest of the directory
+ *
+ * Return: -1 if no space to allocate, the block otherwise
+*/
+int dir_alloc_block(u_int32_t dir)
+{
+    lock_guard<recursive_mutex> guard(fs->alloc_lock);
+    int block = find_empty_fat();
+
+    if (block == -1) {
+        cerr << "no space left on the disk" << endl;
         return -1;
-    root_init("disk.txt", 2);
+    }
+    fat_set(block, fs->fat[dir]);
+    fat_set(dir, block);
 
-    vector<string> tokens = splitPath(pathname);
-    int k = 0; // tokens 's index
-    bool flag = false;
-    int current_index = 2;
-
-    while (tokens.size() - k > 1) {
-        for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-            if (root[i].name == tokens[k]) { // find it
-                k++;
-                current_index = root[i].indexFirstBlock;
-                root_init("disk.txt", root[i].indexFirstBlock);
-                flag = true;
-                break;
+    return block;
+}
+
+static int write_dir_block(u_int32_t block, const vector<DirEntry> &entries)
+{
+    vector<char> buf(fs->sblk.blockSize, 0);
+
+    memcpy(buf.data(), entries.data(), entries.size() * sizeof(DirEntry));
+
+    return journal_write(block, buf.data());
+}
+
+static int write_dir_block(u_int32_t block, const vector<DirIndexEntry> &entries)
+{
+    vector<char> buf(fs->sblk.blockSize, 0);
+    DirIndex *header = (DirIndex *)buf.data();
+
+    memcpy(header->sig, DIR_INDEX_SIGNATURE, sizeof(header->sig));
+    header->count = entries.size();
+    memcpy(header + 1, entries.data(), entries.size() * sizeof(DirIndexEntry));
+
+    return journal_write(block, buf.data());
+}
+
+/**
+ * dir_split - split an overfull block of a directory in two
+ * @dir: the first block of the directory
+ * @block: the block to split
+ * @lo: the entries staying in @block
+ * @hi: the entries moving to a new block
+ * @bound: the lowest hash in @hi
+ * @split: filled with the index entry of the new block
+ *
+ * The first block of the directory can't move, its halves both go to
+ * new blocks and it becomes an index pointing to them.
+ *
+ * Return: -1 on error, 0 if the first block was split, 1 if the parent
+ * of @block must add @split
+*/
+template <typename T>
+static int dir_split(u_int32_t dir, u_int32_t block, const vector<T> &lo,
+                     const vector<T> &hi, u_int32_t bound, DirIndexEntry *split)
+{
+    // entries change slots, cached dentries are stale
+    dcache_invalidate(dir);
+
+    // the new blocks are in the chain of the directory before an index
+    // points to them: a split transaction can only leak them
+    if (block == dir) {
+        int left = dir_alloc_block(dir);
+        int right = left == -1 ? -1 : dir_alloc_block(dir);
+        if (right == -1 || fat_sync() != 0)
+            return -1;
+        vector<DirIndexEntry> index = {{0, (u_int32_t)left}, {bound, (u_int32_t)right}};
+        if (write_dir_block(left, lo) != 0 || write_dir_block(right, hi) != 0
+            || write_dir_block(dir, index) != 0)
+            return -1;
+        return 0;
+    }
+
+    int right = dir_alloc_block(dir);
+    if (right == -1 || fat_sync() != 0)
+        return -1;
+    if (write_dir_block(block, lo) != 0 || write_dir_block(right, hi) != 0)
+        return -1;
+    split->hash = bound;
+    split->block = right;
+
+    return 1;
+}
+
+/**
+ * dir_insert - insert an entry under a block of a directory
+ * @dir: the first block of the directory
+ * @block: the block to insert under
+ * @entry: the new entry
+ * @hash: the hash of its name
+ * @split: filled with the index entry of the new block if @block splits
+ *
+ * Return: -1 on error, 1 if @block was split, 0 otherwise
+*/
+int dir_insert(u_int32_t dir, u_int32_t block, const DirEntry &entry, u_int32_t hash,
+               DirIndexEntry *split)
+{
+    vector<char> buf(fs->sblk.blockSize);
+
+    if (cache_read(block, buf.data()) < 0)
+        return -1;
+
+    if (!is_dir_index(buf.data())) {
+        DirEntry *entries = (DirEntry *)buf.data();
+        for (u_int32_t i = 0; i < dir_slots(); i++) {
+            if (entry_empty(entries[i])) {
+                entries[i] = entry;
+                return journal_write(block, buf.data());
             }
         }
-        if (flag) {
-            flag = false;
-            continue;
-        } else {
-            cerr << "can't find the sub Directory" << endl;
+
+        // the block is full: keep the lower hashes, move the others
+        vector<pair<u_int32_t, DirEntry>> all;
+        for (u_int32_t i = 0; i < dir_slots(); i++)
+            all.push_back({(u_int32_t)entries[i].hash, entries[i]});
+        all.push_back({hash, entry});
+        stable_sort(all.begin(), all.end(),
+                    [](const pair<u_int32_t, DirEntry> &a, const pair<u_int32_t, DirEntry> &b) {
+                        return a.first < b.first;
+                    });
+
+        // equal hashes must stay in the same block
+        size_t m = all.size() / 2;
+        while (m < all.size() && all[m].first == all[m - 1].first)
+            m++;
+        if (m == all.size()) {
+            for (m = all.size() / 2; m > 0 && all[m].first == all[m - 1].first; m--)
+                ;
+        }
+        if (m == 0) {
+            cerr << "the dir is full" << endl;
             return -1;
         }
+
+        vector<DirEntry> lo, hi;
+        for (size_t i = 0; i < all.size(); i++)
+            (i < m ? lo : hi).push_back(all[i].second);
+        return dir_split(dir, block, lo, hi, all[m].first, split);
     }
 
-    vector<string> nameAndSuffix = splitSuffix(tokens[k]);
+    const DirIndex *header = (const DirIndex *)buf.data();
+    const DirIndexEntry *first = (const DirIndexEntry *)(header + 1);
+    vector<DirIndexEntry> entries(first, first + header->count);
+    u_int32_t i = index_child(entries.data(), entries.size(), hash);
+    DirIndexEntry child;
 
-    // if the name is exists
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if (nameAndSuffix[0] == root[i].name) {
-            cerr << "the file is exists" << endl;
-            return -1;
-        }
+    int ret = dir_insert(dir, entries[i].block, entry, hash, &child);
+    if (ret != 1)
+        return ret;
+
+    entries.insert(entries.begin() + i + 1, child);
+    if (entries.size() <= dir_index_limit())
+        return write_dir_block(block, entries);
+
+    size_t m = entries.size() / 2;
+    vector<DirIndexEntry> lo(entries.begin(), entries.begin() + m);
+    vector<DirIndexEntry> hi(entries.begin() + m, entries.end());
+    return dir_split(dir, block, lo, hi, hi[0].hash, split);
+}
+
+/**
+ * dir_add - add an entry to a directory
+ * @dir: the first block of the directory
+ * @entry: the new entry, its name must not be in the directory yet
+ *
+ * Return: -1 if the entry can't be added, 0 otherwise
+*/
+int dir_add(u_int32_t dir, const Root &entry)
+{
+    DirEntry e;
+    DirIndexEntry split;
+
+    memset(&e, 0, sizeof(e));
+    formatRoot(entry, &e);
+    string name = entry_name(e);
+    e.hash = name_hash(name);
+    dcache_forget(dir, name);
+
+    return dir_insert(dir, dir, e, e.hash, &split) < 0 ? -1 : 0;
+}
+
+/**
+ * dir_update - rewrite an entry of a directory in place
+ * @dir: the first block of the directory
+ * @where: the place of the entry, from dir_find()
+ * @entry: the new content of the entry, under the same name
+ *
+ * Return: -1 if the directory can't be read, 0 otherwise
+*/
+int dir_update(u_int32_t dir, const DirSlot &where, const Root &entry)
+{
+    DirEntry *entries = (DirEntry *)journal_get(where.block);
+
+    if (!entries) {
+        cerr << "can't read the directory" << endl;
+        return -1;
+    }
+    formatRoot(entry, &entries[where.slot]);
+    dcache_forget(dir, entry_name(entries[where.slot]));
+
+    return journal_put(where.block);
+}
+
+/**
+ * dir_remove - remove an entry from a directory
+ * @dir: the first block of the directory
+ * @where: the place of the entry, from dir_find()
+ *
+ * Return: -1 if the directory can't be read, 0 otherwise
+*/
+int dir_remove(u_int32_t dir, const DirSlot &where)
+{
+    DirEntry *entries = (DirEntry *)journal_get(where.block);
+
+    if (!entries) {
+        cerr << "can't read the directory" << endl;
+        return -1;
     }
+    dcache_forget(dir, entry_name(entries[where.slot]));
+    memset(&entries[where.slot], 0, sizeof(DirEntry));
+
+    return journal_put(where.block);
+}
+
+/**
+ * dir_list - get every entry of a directory
+ * @dir: the first block of the directory
+ * @entries: the entries are appended to it, in hash order
+ * @nfree: increased by the number of free slots in the blocks
+ *
+ * Return: -1 if a block can't be read, 0 otherwise
+*/
+int dir_list(u_int32_t dir, vector<Root> *entries, size_t *nfree)
+{
+    vector<char> buf(fs->sblk.blockSize);
+
+    if (cache_read(dir, buf.data()) < 0) {
+        cerr << "can't read the directory" << endl;
+        return -1;
+    }
+
+    if (is_dir_index(buf.data())) {
+        const DirIndex *header = (const DirIndex *)buf.data();
+        const DirIndexEntry *index = (const DirIndexEntry *)(header + 1);
+        for (u_int32_t i = 0; i < header->count; i++) {
+            if (dir_list(index[i].block, entries, nfree) != 0)
+                return -1;
+        }
+        return 0;
+    }
+
+    const DirEntry *slots = (const DirEntry *)buf.data();
+    for (u_int32_t i = 0; i < dir_slots(); i++) {
+        if (entry_empty(slots[i])) {
+            (*nfree)++;
+            continue;
+        }
+        Root entry;
+        parseDirEntry(&slots[i], &entry);
+        entries->push_back(entry);
+    }
+
+    return 0;
+}
+
+/* Blocks reached by fs_check(), with the path owning each of them */
+typedef struct CheckWalk {
+    vector<string> owner; // empty for a block not reached yet
+    size_t used;
+    size_t errors;
+} CheckWalk;
+
+/**
+ * check_chain - walk the blocks of a file or directory for fs_check()
+ * @walk: the blocks reached so far, those of the chain are added
+ * @first: the first block of the chain
+ * @path: the file or directory, for the messages
+ * @chain: filled with the blocks of the chain, up to the first bad one
+ *
+ * The walk stops at the first bad block of the chain.
+*/
+static void check_chain(CheckWalk *walk, u_int32_t first, const string &path,
+                        vector<u_int32_t> *chain)
+{
+    chain->clear();
+    for (u_int32_t block = first; ; block = fs->fat[block]) {
+        if (block >= fs->sblk.numBlocks) {
+            cerr << path << ": block " << block << " is out of the volume" << endl;
+            walk->errors++;
+            return;
+        }
+        if (!walk->owner[block].empty()) {
+            cerr << path << ": block " << block << " is also owned by "
+                 << walk->owner[block] << endl;
+            walk->errors++;
+            return;
+        }
+        if (fs->fat[block] == 0) {
+            cerr << path << ": block " << block << " is free" << endl;
+            walk->errors++;
+            return;
+        }
+        walk->owner[block] = path;
+        walk->used++;
+        chain->push_back(block);
+        if (fs->fat[block] == FAT_EOC)
+            return;
+    }
+}
+
+/**
+ * dir_blocks - get every block of a directory its index points to
+ * @block: the first block of the directory, or an index block in it
+ * @blocks: the blocks are added to it, @block first
+ *
+ * Return: -1 if a block can't be read or is out of the volume, 0 otherwise
+*/
+static int dir_blocks(u_int32_t block, set<u_int32_t> *blocks)
+{
+    vector<char> buf(fs->sblk.blockSize);
+
+    // an index pointing back up is walked once
+    if (!blocks->insert(block).second)
+        return 0;
+    if (block >= fs->sblk.numBlocks || cache_read(block, buf.data()) < 0)
+        return -1;
+    if (!is_dir_index(buf.data()))
+        return 0;
+
+    const DirIndex *header = (const DirIndex *)buf.data();
+    const DirIndexEntry *index = (const DirIndexEntry *)(header + 1);
+    for (u_int32_t i = 0; i < min(header->count, dir_index_limit()); i++) {
+        if (dir_blocks(index[i].block, blocks) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * check_dir - walk the entries of a directory for fs_check()
+ * @walk: the blocks reached so far
+ * @dir: the first block of the directory
+ * @path: the directory, ending with '/'
+ * @chain: the blocks of its chain, from check_chain()
+ *
+ * Every block the index of the directory points to must be in its chain,
+ * else it may be free or belong to another file: the entries are then not
+ * listed.
+ *
+ * Return: -1 if a block can't be read, 0 otherwise
+*/
+static int check_dir(CheckWalk *walk, u_int32_t dir, const string &path,
+                     const vector<u_int32_t> &chain)
+{
+    set<u_int32_t> blocks;
+    if (dir_blocks(dir, &blocks) != 0) {
+        cerr << path << ": the index points out of the volume" << endl;
+        walk->errors++;
+        return 0;
+    }
+
+    set<u_int32_t> linked(chain.begin(), chain.end());
+    size_t errors = walk->errors;
+    for (u_int32_t block : blocks) {
+        if (linked.count(block))
+            continue;
+        cerr << path << ": block " << block << " of the index is "
+             << (fs->fat[block] == 0 ? "free" : "not in the chain") << endl;
+        walk->errors++;
+    }
+    if (walk->errors != errors)
+        return 0;
+
+    vector<Root> entries;
+    size_t nfree = 0;
+    if (dir_list(dir, &entries, &nfree) != 0)
+        return -1;
+
+    vector<u_int32_t> sub;
+    for (const Root &entry : entries) {
+        string name = path + entry.name;
+        string type(entry.type, strnlen(entry.type, sizeof(entry.type)));
+        if (entry.attribute != 8 && !type.empty())
+            name += "." + type;
+
+        // a directory whose blocks are bad is not listed, it may be a loop
+        errors = walk->errors;
+        check_chain(walk, entry.indexFirstBlock, name, &sub);
+        if (entry.attribute == 8 && walk->errors == errors
+            && check_dir(walk, entry.indexFirstBlock, name + "/", sub) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+int fs_check(void)
+{
+    if (block_disk_count() == -1) {
+        return -1;
+    }
+
+    CheckWalk walk;
+    walk.owner.assign(fs->sblk.numBlocks, string());
+    walk.used = walk.errors = 0;
+    // the superblock, the FAT and the journal are in no chain
+    for (u_int32_t i = 0; i < fs->sblk.rootIndex; i++)
+        walk.owner[i] = "(reserved)";
+
+    vector<u_int32_t> chain;
+    check_chain(&walk, fs->sblk.rootIndex, "/", &chain);
+    if (walk.errors == 0 && check_dir(&walk, fs->sblk.rootIndex, "/", chain) != 0)
+        return -1;
+
+    // blocks taken in the FAT that no chain reaches only waste space
+    size_t leaked = 0;
+    for (u_int32_t i = fs->sblk.dataIndex; i < fs->sblk.numBlocks; i++) {
+        if (fs->fat[i] != 0 && walk.owner[i].empty())
+            leaked++;
+    }
+    cout << "check: " << walk.used << " blocks used, " << leaked << " leaked, "
+         << walk.errors << " errors" << endl;
+
+    return walk.errors ? 1 : 0;
+}
+
+/**
+ * open_key - key of an open file in the open file table
+ * @dir: the first block of the directory holding the file
+ * @name: the name of the file, without suffix
+*/
+static string open_key(u_int32_t dir, const string &name)
+{
+    return to_string(dir) + "/" + dir_key(name);
+}
+
+/**
+ * fd_reset - close every file
+*/
+void fd_reset()
+{
+    lock_guard<mutex> guard(fs->fd_lock);
+    fs->fd.file.clear();
+    fs->fd.lock.clear();
+    fs->fd.free.clear();
+    fs->fd.byname.clear();
+    fs->fd.length = 0;
+}
+
+/**
+ * fd_get - get an open file and lock it
+ * @fildes: the file descriptor
+ * @guard: takes the lock of the file
+ *
+ * Return: NULL if @fildes is not open, the open file otherwise
+*/
+OFILE *fd_get(int fildes, unique_lock<mutex> *guard)
+{
+    OFILE *file;
+    mutex *lock;
+
+    {
+        lock_guard<mutex> table(fs->fd_lock);
+        if (fildes < 0 || (size_t)fildes >= fs->fd.file.size())
+            return NULL;
+        // the entries of a deque don't move when it grows
+        file = &fs->fd.file[fildes];
+        lock = &fs->fd.lock[fildes];
+    }
+
+    // fs_close() takes the table lock under the lock of the file
+    *guard = unique_lock<mutex>(*lock);
+    if (file->name[0] == '\0') {
+        guard->unlock();
+        return NULL;
+    }
+
+    return file;
+}
+
+/**
+ * fd_find - find an open file by name
+ * @dir: the first block of the directory holding the file
+ * @name: the name of the file, without suffix
+ *
+ * Return: -1 if the file is not open, its file descriptor otherwise
+*/
+int fd_find(u_int32_t dir, const string &name)
+{
+    lock_guard<mutex> guard(fs->fd_lock);
+    auto it = fs->fd.byname.find(open_key(dir, name));
+
+    return it == fs->fd.byname.end() ? -1 : it->second;
+}
+
+static int file_flush(OFILE *file);
+
+/**
+ * fd_flush - write out the appends held by every open file
+ *
+ * Return: -1 if the appends of a file can't be written, 0 otherwise
+*/
+int fd_flush()
+{
+    size_t count;
+    int ret = 0;
+
+    {
+        lock_guard<mutex> table(fs->fd_lock);
+        count = fs->fd.file.size();
+    }
+    for (size_t i = 0; i < count; i++) {
+        unique_lock<mutex> guard;
+        OFILE *file = fd_get(i, &guard);
+        if (file && file_flush(file) != 0)
+            ret = -1;
+    }
+
+    return ret;
+}
+
+int create_file(const string &pathname, char attribute)
+{
+    OpStat counted(FS_OP_CREATE_FILE);
+    journal_handle op;
+
+    if (valid_name(pathname) == -1)
+        return -1;
+
+    vector<string> tokens = splitPath(pathname);
+
+    DirLock lock;
+    int current_index = walk_path(tokens, &lock, true);
+    if (current_index < 0) {
+        cerr << "can't find the sub Directory" << endl;
+        return -1;
+    }
+    int k = tokens.size() - 1; // tokens 's index
+
+    vector<string> nameAndSuffix = splitSuffix(tokens[k]);
+    Root entry;
+    DirSlot where;
+
+    // if the name is exists
+    int found = dir_find(current_index, nameAndSuffix[0], &entry, &where);
+    if (found != 0) {
+        if (found == 1)
+            cerr << "the file is exists" << endl;
+        return -1;
+    }
+
+    int empty_block_index = find_empty_fat();
+    if (empty_block_index == -1) {
+        cerr << "no space left on the disk" << endl;
+        return -1;
+    }
+    memset(&entry, 0, sizeof(entry));
+    strncpy(entry.name, nameAndSuffix[0].c_str(), sizeof(entry.name) - 1);
+    if (nameAndSuffix.size() == 2) {
+        strncpy(entry.type, nameAndSuffix[1].c_str(), sizeof(entry.type) - 1);
+    }
+    entry.attribute = attribute;
+    entry.indexFirstBlock = empty_block_index;
+    fat_set(entry.indexFirstBlock, FAT_EOC);
+    entry.size = 1;
+    entry.length = 0;
+    // the block is taken before the entry points to it: a transaction split
+    // in between can only leak it
+    if (fat_sync() != 0 || dir_add(current_index, entry) != 0) {
+        free_block(empty_block_index);
+        fat_sync();
+        return -1;
+    }
+    // a split of the directory took blocks, they join the same transaction
+    if (fat_sync() != 0)
+        return -1;
+    if (!fs->quiet)
+        cout << "file create success!" << endl;
+
+    return 0;
+}
+
+int open_file(const string &filename, int flag)
+{
+    OpStat counted(FS_OP_OPEN_FILE);
+    if (valid_name(filename) == -1) {
+        return -1;
+    }
+
+    vector<string> tokens = splitPath(filename);
+
+    DirLock lock;
+    int current_index = walk_path(tokens, &lock, false);
+    if (current_index < 0) {
+        cerr << "can't find the sub Directory" << endl;
+        return -1;
+    }
+    int k = tokens.size() - 1; // tokens 's index
+
+    vector<string> nameAndSuffix = splitSuffix(tokens[k]);
+
+    Root entry;
+    DirSlot where;
+    int found = dir_find(current_index, nameAndSuffix[0], &entry, &where); // judge a file is existed
+    if (found < 0)
+        return -1;
+    if (found == 0) {
+        cerr << "The file is no exist!" << endl;
+        return -1;
+    }
+    if (entry.attribute == 8) {
+        cerr << "it is a directory, not a file" << endl;
+        // it is no a file, it is a directory
+        return -1;
+    }
+
+    lock_guard<mutex> table(fs->fd_lock);
+
+    // if the open file count > FS_OPEN_MAX_COUNT
+    if (fs->fd.length >= FS_OPEN_MAX_COUNT) {
+        cerr << "too many open files" << endl;
+        return -1;
+    }
+
+    string key = open_key(current_index, entry.name);
+    if (fs->fd.byname.count(key)) {
+        cerr << "the file is opened" << endl;
+        return -1;
+    }
+
+    // reuse a closed descriptor before growing the table
+    int i;
+    if (!fs->fd.free.empty()) {
+        i = fs->fd.free.back();
+        fs->fd.free.pop_back();
+    } else {
+        i = fs->fd.file.size();
+        fs->fd.file.push_back(OFILE());
+        fs->fd.lock.emplace_back();
+    }
+    fs->fd.length++;
+    fs->fd.byname[key] = i;
+    // closed, the entry is only used by callers racing with fs_close()
+    fs->fd.file[i] = OFILE();
+    strcpy(fs->fd.file[i].name, entry.name);
+    fs->fd.file[i].attribute = entry.attribute;
+    fs->fd.file[i].indexOfFirstBlock = entry.indexFirstBlock;
+    fs->fd.file[i].length = entry.length;
+    fs->fd.file[i].flag = flag; // 0 read or 1 write
+    fs->fd.file[i].read.dnum = entry.indexFirstBlock;
+    fs->fd.file[i].read.bnum = 0;
+    fs->fd.file[i].read.offset = 0;
+    fs->fd.file[i].write.dnum = entry.indexFirstBlock;
+    fs->fd.file[i].write.bnum = 0;
+    fs->fd.file[i].write.offset = 0;
+    fs->fd.file[i].dir = current_index;
+
+    return i;
+}
+
+/**
+ * file_map - extend the block map of an open file
+ * @file: the open file
+ * @n: the index in the chain of the block wanted
+ *
+ * the map is built lazily: the chain is only followed from the last block
+ * already mapped. Blocks are only ever appended to the chain of an open
+ * file (it can't be deleted), so the mapped part never goes stale.
+ *
+ * Return: the number of mapped blocks, at most @n + 1
+*/
+size_t file_map(OFILE *file, size_t n)
+{
+    vector<u_int32_t> &blocks = file->blocks;
+
+    if (blocks.empty())
+        blocks.push_back(file->indexOfFirstBlock);
+    while (blocks.size() <= n && fs->fat[blocks.back()] != FAT_EOC)
+        blocks.push_back(fs->fat[blocks.back()]);
+
+    return blocks.size();
+}
+
+/**
+ * file_block - find the block holding a byte of an open file
+ * @file: the open file
+ * @offset: the byte offset in the file
+ *
+ * Return: -1 if the chain is shorter than @offset, the block otherwise
+*/
+int file_block(OFILE *file, size_t offset)
+{
+    size_t n = offset / fs->sblk.blockSize;
+
+    if (n >= file_map(file, n))
+        return -1;
+
+    return file->blocks[n];
+}
+
+/**
+ * file_readahead - read the blocks after a read ahead of the reader
+ * @file: the open file, locked by the caller
+ * @offset: the byte offset of the read
+ * @len: the number of bytes read
+ *
+ * a read that starts where the previous one stopped is sequential: the
+ * window starts at FS_READAHEAD_MIN blocks and doubles with every such read,
+ * up to FS_READAHEAD_MAX, any other read collapses it. Once the blocks read
+ * ahead are down to half of the window, the next ones up to the window are
+ * prefetched into the cache, in runs of blocks contiguous on the disk.
+ * Reads of a whole window or more are left alone.
+*/
+void file_readahead(OFILE *file, u_int64_t offset, size_t len)
+{
+    size_t bs = fs->sblk.blockSize;
+
+    if (offset != file->ra_next) {
+        file->ra_window = 0;
+        file->ra_end = 0;
+        file->ra_next = offset + len;
+        return;
+    }
+    file->ra_next = offset + len;
+    file->ra_window = file->ra_window ? min<u_int32_t>(file->ra_window * 2, FS_READAHEAD_MAX)
+                                      : FS_READAHEAD_MIN;
+
+    // a read as large as the window already moves it in its own I/Os
+    if (len >= (size_t)FS_READAHEAD_MAX * bs)
+        return;
+
+    // the first block not read yet, a partial one is in the cache already
+    size_t n = (offset + len + bs - 1) / bs;
+    size_t last = min<u_int64_t>(n + file->ra_window, (file->length + bs - 1) / bs);
+    if (file->ra_end > n + file->ra_window / 2)
+        return;
+    n = max(n, file->ra_end);
+    file->ra_end = last;
+
+    while (n < last && n < file_map(file, n)) {
+        u_int32_t start = file->blocks[n];
+        u_int32_t count = 1;
+        while (n + count < last && count < FS_RUN_MAX_BLOCKS
+               && n + count < file_map(file, n + count)
+               && file->blocks[n + count] == start + count)
+            count++;
+        if (cache_prefetch(start, count) != 0)
+            break;
+        n += count;
+    }
+}
+
+/**
+ * pointer_set - move a read or write pointer of an open file
+ * @file: the open file
+ * @p: the pointer
+ * @offset: the new byte offset
+*/
+void pointer_set(OFILE *file, pointer *p, long offset)
+{
+    p->offset = offset;
+    p->dnum = file_block(file, offset); // -1 past the last block
+    p->bnum = offset % fs->sblk.blockSize;
+}
+
+/**
+ * file_set_length - change the length of an open file
+ * @file: the open file
+ * @length: the new length in bytes
+ *
+ * Return: -1 if the directory entry can't be updated, 0 otherwise
+*/
+int file_set_length(OFILE *file, u_int64_t length)
+{
+    Root entry;
+    DirSlot where;
+    DirLock lock;
+
+    lock.lock(file->dir, true);
+    if (dir_find(file->dir, file->name, &entry, &where) != 1)
+        return -1;
+    entry.length = length;
+    file->length = length;
+
+    return dir_update(file->dir, where, entry);
+}
+
+/**
+ * file_grow - make the chain of an open file hold a number of bytes
+ * @file: the open file
+ * @bytes: the bytes the chain must hold
+ *
+ * new blocks are allocated in extents at the end of the chain, the FAT is
+ * synced and the directory entry of the file is updated
+ *
+ * Return: -1 if no space is left or the entry can't be updated, 0 otherwise
+*/
+int file_grow(OFILE *file, size_t bytes)
+{
+    size_t blocks = file_map(file, SIZE_MAX);
+    int32_t last = file->blocks.back();
+
+    size_t want = (bytes + fs->sblk.blockSize - 1) / fs->sblk.blockSize;
+    if (want <= blocks)
+        return 0;
+
+    Root entry;
+    DirSlot where;
+    DirLock lock;
+    lock.lock(file->dir, true);
+    if (dir_find(file->dir, file->name, &entry, &where) != 1)
+        return -1;
+
+    while (blocks < want) {
+        Extent ext;
+        if (alloc_extent(want - blocks, &ext) != 0) {
+            cerr << "no space left on the disk" << endl;
+            break;
+        }
+        fat_set(last, ext.start);
+        last = ext.start + ext.length - 1;
+        blocks += ext.length;
+        entry.size += ext.length;
+    }
+    // the chain is linked before the entry counts the blocks
+    if (fat_sync() != 0 || dir_update(file->dir, where, entry) != 0)
+        return -1;
+
+    return blocks < want ? -1 : 0;
+}
+
+/**
+ * batch_write_data - write out the data blocks buffered by a batch
+ *
+ * The blocks are written in block order, adjacent ones with one I/O, and
+ * flushed so that they are on the disk before the journal commits the
+ * metadata pointing to them.
+ *
+ * Return: -1 if a block can't be written, 0 otherwise
+*/
+int batch_write_data()
+{
+    lock_guard<recursive_mutex> guard(fs->batch.lock);
+    if (fs->batch.data.empty())
+        return 0;
+
+    vector<char> run;
+    int ret = 0;
+
+    for (auto it = fs->batch.data.begin(); it != fs->batch.data.end(); ) {
+        u_int32_t first = it->first;
+        u_int32_t count = 0;
+        run.clear();
+        for (; it != fs->batch.data.end() && it->first == first + count
+               && count < FS_RUN_MAX_BLOCKS; ++it, ++count)
+            run.insert(run.end(), it->second.begin(), it->second.end());
+        if (cache_write_run(first, count, run.data()) < 0)
+            ret = -1;
+    }
+    fs->batch.data.clear();
+
+    if (ret == 0 && block_disk_sync() != 0)
+        ret = -1;
+
+    return ret;
+}
+
+/**
+ * batch_block - get the buffered content of a data block
+ * @block: the block
+ * @fill: read the block first if it is not buffered yet
+ *
+ * the caller holds the batch lock for as long as it uses the content
+ *
+ * Return: NULL if the block can't be read, its buffered bytes otherwise
+*/
+static char *batch_block(u_int32_t block, bool fill)
+{
+    auto it = fs->batch.data.find(block);
+    if (it != fs->batch.data.end())
+        return it->second.data();
+
+    if (fs->batch.data.size() >= FS_BATCH_MAX_BLOCKS && batch_write_data() != 0)
+        return NULL;
+
+    vector<char> &data = fs->batch.data[block];
+    data.resize(fs->sblk.blockSize);
+    if (fill && cache_read(block, data.data()) < 0) {
+        fs->batch.data.erase(block);
+        return NULL;
+    }
+
+    return data.data();
+}
+
+/**
+ * batch_overlay - copy the buffered blocks of a run over what the disk holds
+ * @block: the first block of the run
+ * @count: the number of blocks
+ * @buf: the blocks as read from the disk
+*/
+static void batch_overlay(u_int32_t block, u_int32_t count, char *buf)
+{
+    lock_guard<recursive_mutex> guard(fs->batch.lock);
+    if (fs->batch.data.empty())
+        return;
+
+    for (u_int32_t i = 0; i < count; i++) {
+        auto it = fs->batch.data.find(block + i);
+        if (it != fs->batch.data.end())
+            memcpy(buf + (size_t)i * fs->sblk.blockSize, it->second.data(), fs->sblk.blockSize);
+    }
+}
+
+/**
+ * file_copy - copy bytes between an open file and a buffer
+ * @file: the open file, its chain must hold the bytes
+ * @buf: the buffer
+ * @len: the number of bytes
+ * @offset: the byte offset in the file
+ * @write: copy @buf to the file if set, the file to @buf otherwise
+ *
+ * runs of whole blocks contiguous on the disk are moved with one I/O
+ * straight from or to @buf, partial blocks are copied in the cache. The
+ * runs are queued asynchronously, up to BLOCK_AIO_DEPTH of them in flight,
+ * and all of them completed before returning. In a batch the written blocks
+ * are buffered until batch_write_data().
+ *
+ * Return: -1 if a block can't be read or written, 0 otherwise
+*/
+int file_copy(OFILE *file, char *buf, size_t len, size_t offset, bool write)
+{
+    size_t bs = fs->sblk.blockSize;
+    int32_t block = file_block(file, offset);
+    struct block_aio aios[BLOCK_AIO_DEPTH];
+    size_t queued = 0;
+    int ret = 0;
+
+    // the batch is shared by every thread, only held while one is running
+    unique_lock<recursive_mutex> guard(fs->batch.lock);
+    bool buffered = fs->batch.buffered && fs->batch.depth;
+    if (!buffered && fs->batch.data.empty())
+        guard.unlock();
+
+    for (size_t done = 0; done < len && ret == 0; ) {
+        if (block < 0) {
+            ret = -1;
+            break;
+        }
+
+        size_t in_block = (offset + done) % bs;
+        u_int32_t count = 1;
+
+        if (in_block == 0 && len - done >= bs) {
+            while (count < FS_RUN_MAX_BLOCKS && len - done >= (count + 1) * bs
+                   && fs->fat[block + count - 1] == block + (int32_t)count)
+                count++;
+            if (write && buffered) {
+                ret = 0;
+                for (u_int32_t i = 0; i < count && ret == 0; i++) {
+                    char *data = batch_block(block + i, false);
+                    if (data)
+                        memcpy(data, buf + done + i * bs, bs);
+                    else
+                        ret = -1;
+                }
+            } else if (!write && guard.owns_lock()) {
+                // pending batch blocks go over the run once it is read
+                ret = cache_read_run(block, count, buf + done);
+                batch_overlay(block, count, buf + done);
+            } else {
+                struct block_aio *aio = &aios[queued++ % BLOCK_AIO_DEPTH];
+                if (queued > BLOCK_AIO_DEPTH && block_aio_wait(aio) < 0)
+                    ret = -1;
+                else if (write)
+                    ret = cache_write_run_async(block, count, buf + done, aio);
+                else
+                    ret = cache_read_run_async(block, count, buf + done, aio);
+                if (ret < 0)
+                    queued--;
+            }
+            done += count * bs;
+        } else if ((write && buffered) || (guard.owns_lock() && fs->batch.data.count(block))) {
+            size_t n = min(bs - in_block, len - done);
+            char *data = batch_block(block, true);
+            if (!data) {
+                ret = -1;
+                break;
+            }
+            if (write)
+                memcpy(data + in_block, buf + done, n);
+            else
+                memcpy(buf + done, data + in_block, n);
+            done += n;
+        } else {
+            size_t n = min(bs - in_block, len - done);
+            char *data = (char *)cache_get(block);
+            if (!data) {
+                ret = -1;
+                break;
+            }
+            if (write)
+                memcpy(data + in_block, buf + done, n);
+            else
+                memcpy(buf + done, data + in_block, n);
+            ret = cache_put(block, write);
+            done += n;
+        }
+        block = fs->fat[block + count - 1];
+    }
+
+    // the buffer and the requests must outlive every queued I/O
+    for (size_t i = 0; i < min(queued, (size_t)BLOCK_AIO_DEPTH); i++) {
+        if (block_aio_wait(&aios[i]) < 0)
+            ret = -1;
+    }
+
+    return ret < 0 ? -1 : 0;
+}
+
+/**
+ * file_pread - read bytes of an open file at an offset
+ * @file: the open file, locked by the caller
+ * @buf: filled with the bytes
+ * @len: the number of bytes wanted
+ * @offset: the byte offset in the file
+ *
+ * Return: -1 on error, the number of bytes read otherwise
+*/
+static ssize_t file_pread(OFILE *file, void *buf, size_t len, off_t offset)
+{
+    if (offset < 0 || file_flush(file) != 0)
+        return -1;
+    if (offset >= file->length)
+        return 0;
+
+    // the length is known, whole blocks are copied without looking at them
+    len = min<size_t>(len, file->length - offset);
+    if (file_copy(file, (char *)buf, len, offset, false) != 0)
+        return -1;
+    file_readahead(file, offset, len);
+    fs->stats[stat_shard].bytes_read.fetch_add(len, memory_order_relaxed);
+
+    return len;
+}
+
+ssize_t fs_pread(int fildes, void *buf, size_t len, off_t offset)
+{
+    OpStat counted(FS_OP_PREAD);
+    unique_lock<mutex> guard;
+    OFILE *file = fd_get(fildes, &guard);
+    if (!file) {
+        cerr << "bad file descriptor" << endl;
+        return -1;
+    }
+
+    return file_pread(file, buf, len, offset);
+}
+
+/**
+ * file_write_blocks - write bytes to the blocks of an open file
+ * @file: the open file, locked by the caller, with no pending append
+ * @buf: the bytes
+ * @len: the number of bytes
+ * @offset: the byte offset in the file
+ *
+ * the chain is grown to hold the bytes, they are copied and the length of
+ * the file is updated.
+ *
+ * Return: -1 on error, @len otherwise
+*/
+static ssize_t file_write_blocks(OFILE *file, const void *buf, size_t len, off_t offset)
+{
+    size_t capacity = (size_t)fs->sblk.numDataBlocks * fs->sblk.blockSize;
+    if ((size_t)offset > capacity || len > capacity - offset) {
+        cerr << "the file can't be larger than the disk" << endl;
+        return -1;
+    }
+
+    // file_grow() syncs the FAT: the new blocks are linked in the chain on
+    // the disk before the length of the file covers them
+    size_t end = offset + len;
+    if (file_grow(file, end) != 0)
+        return -1;
+
+    // a hole past the end of the file reads back as zeros
+    vector<char> zeros(fs->sblk.blockSize, 0);
+    for (size_t at = file->length, n; at < (size_t)offset; at += n) {
+        n = min(zeros.size(), offset - at);
+        if (file_copy(file, zeros.data(), n, at, true) != 0)
+            return -1;
+    }
+    if (file_copy(file, (char *)buf, len, offset, true) != 0)
+        return -1;
+    if (end > (size_t)file->length && file_set_length(file, end) != 0)
+        return -1;
+
+    return len;
+}
+
+/**
+ * file_flush - write out the bytes appended to an open file
+ * @file: the open file, locked by the caller
+ *
+ * the blocks of the appends are allocated at once, as one extent when a free
+ * run is long enough, and written with as few I/Os. The appends are dropped
+ * if they can't be written.
+ *
+ * Return: -1 on error, 0 otherwise
+*/
+static int file_flush(OFILE *file)
+{
+    if (file->pending.empty())
+        return 0;
+
+    // the file is locked, a closed transaction may wait for it
+    journal_handle op(true);
+    vector<char> data;
+    data.swap(file->pending);
+
+    return file_write_blocks(file, data.data(), data.size(), file->length) < 0 ? -1 : 0;
+}
+
+/**
+ * file_pwrite - write bytes to an open file at an offset
+ * @file: the open file, locked by the caller
+ * @buf: the bytes
+ * @len: the number of bytes
+ * @offset: the byte offset in the file
+ *
+ * bytes written at or past the end of the file are only appended in memory,
+ * up to FS_APPEND_MAX_BLOCKS blocks, until file_flush(): many small appends
+ * then cost a single allocation and run of writes. Any other write flushes
+ * the appends first and goes to the blocks.
+ *
+ * Return: -1 on error, @len otherwise
+*/
+static ssize_t file_pwrite(OFILE *file, const void *buf, size_t len, off_t offset)
+{
+    size_t max = (size_t)FS_APPEND_MAX_BLOCKS * fs->sblk.blockSize;
+
+    if (offset < 0)
+        return -1;
 
-    if (tokens.size() - k == 1) {
-        for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-            if(root[i].name[0] == '$') {
-                strncpy(root[i].name, nameAndSuffix[0].c_str(), sizeof(root[i].name) - 1);
-                root[i].name[sizeof(root[i].name) - 1] = '\0';
-                if (nameAndSuffix.size() == 2) {
-                    strncpy(root[i].type, nameAndSuffix[1].c_str(), sizeof(root[i].type) - 1);
-                    root[i].type[sizeof(root[i].type) - 1] = '\0';
-                } else {
-                    memset(root[i].type, '\0', sizeof(root[i].type));
-                }
-                root[i].attribute = attribute;
-                root[i].indexFirstBlock = find_empty_fat();
-                fat[root[i].indexFirstBlock] = FAT_EOC;
-                root[i].size = 1;
-                writeDirToDisk(root, "disk.txt", current_index);
-                string block_data(BLOCK_SIZE, '#');
-                update_block("disk.txt", root[i].indexFirstBlock, block_data);
-                cout << "file create success!" << endl;
-                root_init("disk.txt", 2);
-                return 0;
-            }
-        }
-        cerr << "the dir is full" << endl;
+    // the appends that don't fit are written out, the file grows meanwhile
+    if (offset >= file->length && offset + len - file->length > max
+        && file_flush(file) != 0)
         return -1;
+    if (offset >= file->length && offset + len - file->length <= max) {
+        size_t end = offset + len - file->length;
+        // a gap left before the bytes is a hole, zeros
+        if (end > file->pending.size())
+            file->pending.resize(end, 0);
+        memcpy(file->pending.data() + (offset - file->length), buf, len);
+        fs->stats[stat_shard].bytes_written.fetch_add(len, memory_order_relaxed);
+        return len;
     }
 
-    return 0;
+    if (file_flush(file) != 0 || file_write_blocks(file, buf, len, offset) < 0)
+        return -1;
+    fs->stats[stat_shard].bytes_written.fetch_add(len, memory_order_relaxed);
+
+    return len;
 }
 
-int open_file(const string &filename, int flag)
+ssize_t fs_pwrite(int fildes, const void *buf, size_t len, off_t offset)
 {
-    if (valid_name(filename) == -1) {
+    OpStat counted(FS_OP_PWRITE);
+    journal_handle op;
+
+    unique_lock<mutex> guard;
+    OFILE *file = fd_get(fildes, &guard);
+    if (!file) {
+        cerr << "bad file descriptor" << endl;
         return -1;
     }
-    root_init("disk.txt", 2);
 
-    // if the open file count > FS_OPEN_MAX_COUNT
-    if (fd.length >= FS_OPEN_MAX_COUNT) {
+    return file_pwrite(file, buf, len, offset);
+}
+
+off_t fs_lseek(int fildes, off_t offset)
+{
+    OpStat counted(FS_OP_LSEEK);
+    unique_lock<mutex> guard;
+    OFILE *file = fd_get(fildes, &guard);
+    if (!file) {
+        cerr << "bad file descriptor" << endl;
         return -1;
     }
-
-    vector<string> tokens = splitPath(filename);
-    int k = 0; // tokens 's index
-    bool flag1 = false;
-    int current_index = 2;
-
-    while (tokens.size() - k > 1) {
-        for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-            if (root[i].name == tokens[k]) { // find it
-                k++;
-                current_index = root[i].indexFirstBlock;
-                root_init("disk.txt", root[i].indexFirstBlock);
-                flag1 = true;
-                break;
-            }
-        }
-        if (flag1) {
-            flag1 = false;
-            continue;
-        } else {
-            cerr << "can't find the sub Directory" << endl;
-            return -1;
-        }
+    if (offset < 0 || (size_t)offset > file->length + file->pending.size()) {
+        cerr << "invalid offset" << endl;
+        return -1;
     }
 
-    vector<string> nameAndSuffix = splitSuffix(tokens[k]);
+    pointer_set(file, &file->read, offset);
+    pointer_set(file, &file->write, offset);
 
-    int index = 0;
-    bool flag2 = false; // judge a file is existed
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if (nameAndSuffix[0] == root[i].name) {
-            if (root[i].attribute == 8) {
-                cerr << "it is a directory, not a file" << endl;
-                // it is no a file, it is a directory
-                return -1;
-            }else {
-                index = i;
-                flag2 = true;
-                break;
-            }
-        }
+    return offset;
+}
+
+int fs_read(int fildes, int read_length)
+{
+    OpStat counted(FS_OP_READ);
+    unique_lock<mutex> guard;
+    OFILE *file = fd_get(fildes, &guard);
+    if (!file) {
+        cerr << "bad file descriptor" << endl;
+        return -1;
     }
-    if (!flag)
-        cerr << "The file is no exist!" << endl;
+
+    string data(max(read_length, 0), '\0'); // the data we read
+    ssize_t n = file_pread(file, &data[0], data.size(), file->read.offset);
+    if (n < 0)
         return -1;
+    data.resize(n);
+    pointer_set(file, &file->read, file->read.offset + n);
+    cout << data << endl;
 
-    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-        if (fd.file[i].name[0] == '\0') {
-            fd.length++;
-            strcpy(fd.file[i].name, root[index].name);
-            fd.file[i].attribute = root[index].attribute;
-            fd.file[i].indexOfFirstBlock = root[index].indexFirstBlock;
-            fd.file[i].length = root[index].size;
-            fd.file[i].flag = flag; // 0 read or 1 write
-            fd.file[i].read.dnum = root[index].indexFirstBlock;
-            fd.file[i].read.bnum = 0;
-            fd.file[i].write.dnum = root[index].indexFirstBlock;
-            fd.file[i].write.bnum = 0;
-            return 0;
-        }
+    return 0;
+}
+
+/**
+ * fd_close - close a file descriptor
+ * @fildes: the descriptor
+ *
+ * Return: -1 if @fildes is not open or its appends can't be written, 0
+ * otherwise
+*/
+static int fd_close(int fildes)
+{
+    unique_lock<mutex> guard;
+    OFILE *file = fd_get(fildes, &guard);
+    if (!file) {
+        cerr << "bad file descriptor" << endl;
+        return -1;
     }
 
-    return -1;
+    // the descriptor is closed even if the appends are lost
+    int ret = file_flush(file);
+    string key = open_key(file->dir, file->name);
+    fill(begin(file->name), end(file->name), '\0');
+    file->attribute = 0;
+    file->indexOfFirstBlock = 0;
+    file->length = 0;
+    file->flag = -1; // 0 read or 1 write
+    file->read.dnum = 0;
+    file->read.bnum = 0;
+    file->write.dnum = 0;
+    file->write.bnum = 0;
+    file->blocks.clear();
+    file->blocks.shrink_to_fit();
+    guard.unlock();
+
+    // the descriptor is reused only once the file is unlocked
+    lock_guard<mutex> table(fs->fd_lock);
+    fs->fd.byname.erase(key);
+    fs->fd.free.push_back(fildes);
+    fs->fd.length--;
+
+    return ret != 0 ? -1 : 0;
 }
 
 int read_file(const string &filename, int read_length)
 {
-    // open the disk
-    ifstream disk("disk.txt", ios::in);
-    if (!disk.is_open()) {
-        std::cerr << "can't open the disk" << std::endl;
-        return false;
-    }
-
+    OpStat counted(FS_OP_READ_FILE);
     // invalid name
     if (valid_name(filename) == -1) {
         return -1;
     }
-    root_init("disk.txt", 2);
 
     vector<string> tokens = splitPath(filename);
-    int k = 0; // tokens 's index
-    bool flag1 = false;
-    int current_index = 2;
-
-    while (tokens.size() - k > 1) {
-        for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-            if (root[i].name == tokens[k]) { // find it
-                k++;
-                current_index = root[i].indexFirstBlock;
-                root_init("disk.txt", root[i].indexFirstBlock);
-                flag1 = true;
-                break;
-            }
-        }
-        if (flag1) {
-            flag1 = false;
-            continue;
-        } else {
-            cerr << "can't find the sub Directory" << endl;
-            return -1;
-        }
+
+    DirLock lock;
+    int current_index = walk_path(tokens, &lock, false);
+    if (current_index < 0) {
+        cerr << "can't find the sub Directory" << endl;
+        return -1;
     }
+    int k = tokens.size() - 1; // tokens 's index
 
     vector<string> nameAndSuffix = splitSuffix(tokens[k]);
 
-    int index = 0;
-    flag1 = false;
-    // find the file
-    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-        if (nameAndSuffix[0] == fd.file[i].name) {
-            index = i;
-            flag1 = true;
-            break;
-        }
-    }
-    int m = 0;
-    if(!flag1)
-        m = open_file(filename, 0);
-    if (m == -1)
-        return -1;
-
-    string line; // store the line we read currently
-    int current_line = 0; // the current line number
-    int remaining_length = read_length; // the remain length don't read
-    string data; // the data we read
-    while (getline(disk, line)) {
-        if (current_line >= fd.file[index].read.dnum) {
-            for (int i = fd.file[index].read.bnum; i < BLOCK_SIZE; i++) {
-                fd.file[index].read.bnum++;
-                if (line[i] == '#') {  // if encounter '#', stop
-                    remaining_length = 0;
-                    break;
-                }
-                data.push_back(line[i]);
-                --remaining_length;
-                if (fd.file[index].read.bnum >= 64) {
-                    if (fat[fd.file[index].read.dnum] != -1) {
-                        fd.file[index].read.dnum = fat[fd.file[index].read.dnum];
-                    }
-                    fd.file[index].read.bnum = 0;
-                }
-                if (remaining_length == 0) break; // up to the read_length
-            }
-        }
+    // find the file, a file that isn't open is only open for the call
+    int index = fd_find(current_index, nameAndSuffix[0]);
+    lock.unlock();
+    if (index != -1)
+        return fs_read(index, read_length);
+    index = open_file(filename, 0);
+    if (index == -1)
+        return -1;
 
-        if (remaining_length == 0) break; // up to the read_length
-        ++current_line;
-    }
-    cout << data << endl;
+    int ret = fs_read(index, read_length);
+    if (fd_close(index) != 0)
+        ret = -1;
 
-    return 0;
+    return ret;
 }
 
 // void replace_line(const string& filename, int line_number, const string& new_content) {
@@ -826,602 +2884,468 @@ int read_file(const string &filename, int read_length)
 //     file_out.close();
 // }
 
-int write_file(const string &filename, const string buffer, int write_length)
+int fs_write(int fildes, const string &buffer, int write_length)
 {
-    // open the disk
-    fstream disk("disk.txt", ios::in | ios::out);
-    if (!disk.is_open()) {
-        cerr << "can't open the disk" << std::endl;
-        return false;
+    OpStat counted(FS_OP_WRITE);
+    journal_handle op;
+
+    unique_lock<mutex> guard;
+    OFILE *file = fd_get(fildes, &guard);
+    if (!file) {
+        cerr << "bad file descriptor" << endl;
+        return -1;
     }
 
+    size_t n = min<size_t>(max(write_length, 0), buffer.size());
+    if (file_pwrite(file, buffer.data(), n, file->write.offset) < 0)
+        return -1;
+    pointer_set(file, &file->write, file->write.offset + n);
+
+    // the content is covered: the file ends with the data written
+    if ((size_t)file->write.offset < file->length + file->pending.size()
+        && (file_flush(file) != 0 || file_set_length(file, file->write.offset) != 0))
+        return -1;
+    if (!fs->quiet)
+        cout << "write success" << endl;
+
+    return 0;
+}
+
+int write_file(const string &filename, const string &buffer, int write_length)
+{
+    OpStat counted(FS_OP_WRITE_FILE);
     // invalid name
     if (valid_name(filename) == -1) {
         return -1;
     }
-    root_init("disk.txt", 2);
 
     vector<string> tokens = splitPath(filename);
-    int k = 0; // tokens 's index
-    bool flag1 = false;
-    int current_index = 2;
-
-    while (tokens.size() - k > 1) {
-        for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-            if (root[i].name == tokens[k]) { // find it
-                k++;
-                current_index = root[i].indexFirstBlock;
-                root_init("disk.txt", root[i].indexFirstBlock);
-                flag1 = true;
-                break;
-            }
-        }
-        if (flag1) {
-            flag1 = false;
-            continue;
-        } else {
-            cerr << "can't find the sub Directory" << endl;
-            return -1;
-        }
+
+    DirLock lock;
+    int current_index = walk_path(tokens, &lock, false);
+    if (current_index < 0) {
+        cerr << "can't find the sub Directory" << endl;
+        return -1;
     }
+    int k = tokens.size() - 1; // tokens 's index
 
     vector<string> nameAndSuffix = splitSuffix(tokens[k]);
 
-    int index = 0;
-    flag1 = false;
-    // find the file
-    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-        if (nameAndSuffix[0] == fd.file[i].name) {
-            index = i;
-            flag1 = true;
-            break;
-        }
-    }
-    int m = 0;
-    if(!flag1)
-        m = open_file(filename, 1);
-    if (m == -1) {
+    // find the file, a file that isn't open is only open for the call
+    int index = fd_find(current_index, nameAndSuffix[0]);
+    lock.unlock();
+    if (index != -1)
+        return fs_write(index, buffer, write_length);
+    index = open_file(filename, 1);
+    if (index == -1) {
         cout << "The file is no existed" << endl;
         return -1;
     }
 
-    int dir_index = 0;
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if (nameAndSuffix[0] == root[i].name) {
-            dir_index = i;
-            break;
-        }
-    }
+    int ret = fs_write(index, buffer, write_length);
+    if (fd_close(index) != 0)
+        ret = -1;
 
-    string line; // store the line we read currently
-    int current_line = 0; // the current line number
-    int remaining_length = write_length; // the remain length don't read
-    int buffer_index = 0; // the index of buffer
-    while (getline(disk, line)) {
-        if (current_line >= fd.file[index].write.dnum) {
-            for (int i = fd.file[index].write.bnum; i < BLOCK_SIZE; i++) {
-                line[fd.file[index].write.bnum] = buffer[buffer_index];
-                fd.file[index].write.bnum++;
-                buffer_index++;
-                remaining_length--;
-                if (remaining_length == 0 || buffer_index == buffer.size()) break;
-                // the block space isn't enough
-                if (fd.file[index].write.bnum >= 64) {
-                    // write current data to the block
-                    update_block("disk.txt", fd.file[index].write.dnum, line);
-                    if (fat[fd.file[index].write.dnum] != -1) {
-                        fd.file[index].write.dnum = fat[fd.file[index].write.dnum];
-                        fd.file[index].write.bnum = 0;
-                    } else {
-                        int empty_block_index = find_empty_fat();
-                        fat[fd.file[index].write.dnum] = empty_block_index;
-                        fat[empty_block_index] = FAT_EOC;
-                        string block_data(BLOCK_SIZE, '#');
-                        update_block("disk.txt", empty_block_index, block_data);
-                        root[dir_index].size++;
-                        writeDirToDisk(root, "disk.txt", current_index);
-                        fd.file[index].write.dnum = empty_block_index;
-                        fd.file[index].write.bnum = 0;
-                        break;
-                    }
-                }
-            }
-        }
-        if (remaining_length == 0 || buffer_index == buffer.size()) break; // ݶȡ
-        ++current_line;
-    }
-    line[fd.file[index].write.bnum] = '#';
-    update_block("disk.txt", fd.file[index].write.dnum, line);
-    cout << "write success" << endl;
+    return ret;
+}
 
-    return 0;
+int fs_close(int fildes)
+{
+    OpStat counted(FS_OP_CLOSE);
+    int ret = fd_close(fildes);
+
+    if (ret == 0 && !fs->quiet)
+        cout << "close success" << endl;
+    return ret;
 }
 
 int close_file(const string &filename)
 {
+    OpStat counted(FS_OP_CLOSE_FILE);
     // invalid name
     if (valid_name(filename) == -1) {
         return -1;
     }
-    root_init("disk.txt", 2);
 
     vector<string> tokens = splitPath(filename);
-    int k = 0; // tokens 's index
-    bool flag1 = false;
-    int current_index = 2;
-
-    while (tokens.size() - k > 1) {
-        for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-            if (root[i].name == tokens[k]) { // find it
-                k++;
-                current_index = root[i].indexFirstBlock;
-                root_init("disk.txt", root[i].indexFirstBlock);
-                flag1 = true;
-                break;
-            }
-        }
-        if (flag1) {
-            flag1 = false;
-            continue;
-        } else {
-            cerr << "can't find the sub Directory" << endl;
-            return -1;
-        }
+
+    DirLock lock;
+    int current_index = walk_path(tokens, &lock, false);
+    if (current_index < 0) {
+        cerr << "can't find the sub Directory" << endl;
+        return -1;
     }
+    int k = tokens.size() - 1; // tokens 's index
 
     vector<string> nameAndSuffix = splitSuffix(tokens[k]);
 
-    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-        if (nameAndSuffix[0] == fd.file[i].name) {
-            fill(begin(fd.file[i].name), end(fd.file[i].name), '\0');
-            fd.file[i].attribute = 0;
-            fd.file[i].indexOfFirstBlock = 0;
-            fd.file[i].length = 0;
-            fd.file[i].flag = -1; // 0 read or 1 write
-            fd.file[i].read.dnum = 0;
-            fd.file[i].read.bnum = 0;
-            fd.file[i].write.dnum = 0;
-            fd.file[i].write.bnum = 0;
-
-            cout << "close success" << endl;
-            return 0;
-        }
+    int index = fd_find(current_index, nameAndSuffix[0]);
+    lock.unlock();
+    if (index == -1) {
+        cout << "can't find the file" << endl;
+        return -1;
     }
 
-    cout << "can't find the file" << endl;
-    return -1;
+    return fs_close(index);
 }
 
 int delete_file(const string &filename)
 {
+    OpStat counted(FS_OP_DELETE_FILE);
+    journal_handle op;
+
     // invalid name
     if (valid_name(filename) == -1) {
         return -1;
     }
-    root_init("disk.txt", 2);
 
     vector<string> tokens = splitPath(filename);
-    int k = 0; // tokens 's index
-    bool flag1 = false;
-    int current_index = 2;
-
-    while (tokens.size() - k > 1) {
-        for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-            if (root[i].name == tokens[k]) { // find it
-                k++;
-                current_index = root[i].indexFirstBlock;
-                root_init("disk.txt", root[i].indexFirstBlock);
-                flag1 = true;
-                break;
-            }
-        }
-        if (flag1) {
-            flag1 = false;
-            continue;
-        } else {
-            cerr << "can't find the sub Directory" << endl;
-            return -1;
-        }
+
+    DirLock lock;
+    int current_index = walk_path(tokens, &lock, true);
+    if (current_index < 0) {
+        cerr << "can't find the sub Directory" << endl;
+        return -1;
     }
+    int k = tokens.size() - 1; // tokens 's index
 
     vector<string> nameAndSuffix = splitSuffix(tokens[k]);
 
-    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-        if (nameAndSuffix[0] == fd.file[i].name) {
-            cerr << "the file open, can't delete" << endl;
-            return -1;
-        }
+    if (fd_find(current_index, nameAndSuffix[0]) != -1) {
+        cerr << "the file open, can't delete" << endl;
+        return -1;
     }
 
-    int dir_index = 0;
-    flag1 = false;
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if (nameAndSuffix[0] == root[i].name) {
-            int linked_index = root[i].indexFirstBlock;
-            int linked_index_copy = linked_index;
-            int tmp = 0;
-            while (linked_index != -1) {
-                tmp = linked_index;
-                linked_index = fat[linked_index];
-                fat[tmp] = 0;
-            }
-            strncpy(root[i].name, "$\0\0\0", sizeof(root[i].name));
-            strncpy(root[i].type, "$\0\0", sizeof(root[i].type));
-            root[i].attribute = 0;
-            root[i].indexFirstBlock = 0;
-            root[i].size = 0;
-            writeDirToDisk(root, "disk.txt", current_index);
-
-            cout << "file delete success" << endl;
-            return 0;
-        }
+    Root entry;
+    DirSlot where;
+    int found = dir_find(current_index, nameAndSuffix[0], &entry, &where);
+    if (found < 0)
+        return -1;
+    if (found == 0) {
+        cerr << "can't find the file" << endl;
+        return -1;
+    }
+
+    // unlink first: if the journal has to split the operation, blocks leak
+    // rather than stay reachable once free
+    if (dir_remove(current_index, where) != 0)
+        return -1;
+    int linked_index = entry.indexFirstBlock;
+    int tmp = 0;
+    while (linked_index != -1) {
+        tmp = linked_index;
+        linked_index = fs->fat[linked_index];
+        free_block(tmp);
     }
 
-   cerr << "can't find the file" << endl;
-   return -1;
+    fat_sync();
+    if (!fs->quiet)
+        cout << "file delete success" << endl;
+    return 0;
 }
 
 int typefile(const string &filename)
 {
-    // open the disk
-    ifstream disk("disk.txt", ios::in);
-    if (!disk.is_open()) {
-        std::cerr << "can't open the disk" << std::endl;
-        return false;
-    }
-
+    OpStat counted(FS_OP_TYPEFILE);
     // invalid name
     if (valid_name(filename) == -1) {
         return -1;
     }
-    root_init("disk.txt", 2);
 
     vector<string> tokens = splitPath(filename);
-    int k = 0; // tokens 's index
-    bool flag1 = false;
-    int current_index = 2;
-
-    while (tokens.size() - k > 1) {
-        for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-            if (root[i].name == tokens[k]) { // find it
-                k++;
-                current_index = root[i].indexFirstBlock;
-                root_init("disk.txt", root[i].indexFirstBlock);
-                flag1 = true;
-                break;
-            }
-        }
-        if (flag1) {
-            flag1 = false;
-            continue;
-        } else {
-            cerr << "can't find the sub Directory" << endl;
-            return -1;
-        }
+
+    DirLock lock;
+    int current_index = walk_path(tokens, &lock, false);
+    if (current_index < 0) {
+        cerr << "can't find the sub Directory" << endl;
+        return -1;
     }
+    int k = tokens.size() - 1; // tokens 's index
 
     vector<string> nameAndSuffix = splitSuffix(tokens[k]);
 
-    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-        if (nameAndSuffix[0] == fd.file[i].name) {
-            cerr << "the file is opened, can't show." << endl;
-            return -1;
-        }
+    if (fd_find(current_index, nameAndSuffix[0]) != -1) {
+        cerr << "the file is opened, can't show." << endl;
+        return -1;
     }
 
-    int dir_index = 0;
-    flag1 = false;
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if (nameAndSuffix[0] == root[i].name && root[i].attribute != 8) {
-            dir_index = i;
-            flag1 = true;
-            break;
-        }
-    }
-    if (!flag1) {
+    Root entry;
+    DirSlot where;
+    int found = dir_find(current_index, nameAndSuffix[0], &entry, &where);
+    if (found < 0)
+        return -1;
+    if (found == 0 || entry.attribute == 8) {
         cerr << "the file is no exist." << endl;
         return -1;
     }
 
-    int linked_index = root[dir_index].indexFirstBlock;
-    string line; // store the line we read currently
-    int current_line = 0; // the current line number
-    string data; // the data we read
-    while (getline(disk, line)) {
-        if (current_line >= linked_index) {
-            cout << line << endl;
-            if (fat[linked_index] != -1)
-                linked_index = fat[linked_index];
-            else
-                break;
+    // one I/O per run of contiguous blocks instead of one per block, the
+    // next runs are read ahead like for an open file while this one prints
+    OFILE file = OFILE();
+    file.indexOfFirstBlock = entry.indexFirstBlock;
+    file.length = entry.length;
+    vector<char> buf;
+    u_int64_t left = entry.length; // the bytes not printed yet
+    for (const Extent &ext : file_extents(entry.indexFirstBlock,
+                                          FS_RUN_MAX_BLOCKS)) {
+        if (left == 0)
+            break;
+        // a mapped disk is printed in place, no copy
+        const char *data = (const char *)block_map(ext.start);
+        if (!data) {
+            size_t len = (size_t)ext.length * fs->sblk.blockSize;
+            buf.resize(len);
+            if (cache_read_run(ext.start, ext.length, buf.data()) < 0)
+                return -1;
+            batch_overlay(ext.start, ext.length, buf.data());
+            file_readahead(&file, entry.length - left, len);
+            data = buf.data();
+        }
+        for (u_int32_t i = 0; i < ext.length && left > 0; i++) {
+            size_t n = min<u_int64_t>(left, fs->sblk.blockSize);
+            cout.write(data + (size_t)i * fs->sblk.blockSize, n) << endl;
+            left -= n;
         }
-        ++current_line;
     }
 
-    cout << "show the file success" << endl;
+    fs->stats[stat_shard].bytes_read.fetch_add(entry.length, memory_order_relaxed);
+    if (!fs->quiet)
+        cout << "show the file success" << endl;
     return 0;
 }
 
 int change(const string &filename, int attribute)
 {
-    // open the disk
-    ifstream disk("disk.txt", ios::in);
-    if (!disk.is_open()) {
-        std::cerr << "can't open the disk" << std::endl;
-        return false;
-    }
+    OpStat counted(FS_OP_CHANGE);
+    journal_handle op;
 
     // invalid name
     if (valid_name(filename) == -1) {
         return -1;
     }
-    root_init("disk.txt", 2);
 
     vector<string> tokens = splitPath(filename);
-    int k = 0; // tokens 's index
-    bool flag1 = false;
-    int current_index = 2;
-
-    while (tokens.size() - k > 1) {
-        for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-            if (root[i].name == tokens[k]) { // find it
-                k++;
-                current_index = root[i].indexFirstBlock;
-                root_init("disk.txt", root[i].indexFirstBlock);
-                flag1 = true;
-                break;
-            }
-        }
-        if (flag1) {
-            flag1 = false;
-            continue;
-        } else {
-            cerr << "can't find the sub Directory" << endl;
-            return -1;
-        }
+
+    DirLock lock;
+    int current_index = walk_path(tokens, &lock, true);
+    if (current_index < 0) {
+        cerr << "can't find the sub Directory" << endl;
+        return -1;
     }
+    int k = tokens.size() - 1; // tokens 's index
 
     vector<string> nameAndSuffix = splitSuffix(tokens[k]);
 
-    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-        if (nameAndSuffix[0] == fd.file[i].name) {
-            cerr << "the file is opened, can't show." << endl;
-            return -1;
-        }
+    if (fd_find(current_index, nameAndSuffix[0]) != -1) {
+        cerr << "the file is opened, can't show." << endl;
+        return -1;
     }
 
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if (nameAndSuffix[0] == root[i].name) {
-            root[i].attribute = attribute;
-            writeDirToDisk(root, "disk.txt", current_index);
-
-            cout << "change success" << endl;
-            return 0;
-        }
+    Root entry;
+    DirSlot where;
+    int found = dir_find(current_index, nameAndSuffix[0], &entry, &where);
+    if (found < 0)
+        return -1;
+    if (found == 0) {
+        cerr << "can't find the file" << endl;
+        return -1;
     }
 
-    cerr << "can't find the file" << endl;
-    return -1;
+    entry.attribute = attribute;
+    if (dir_update(current_index, where, entry) != 0)
+        return -1;
+
+    if (!fs->quiet)
+        cout << "change success" << endl;
+    return 0;
 }
 
 int md(const string &pathdir)
 {
+    OpStat counted(FS_OP_MD);
+    journal_handle op;
+
     if (valid_name(pathdir) == -1)
         return -1;
-    root_init("disk.txt", 2);
 
-    int k = 0; // tokens 's index
-    bool flag = false;
-    int current_index = 2;
     vector<string> tokens = splitPath(pathdir);
 
-    while (tokens.size() - k > 1) {
-        for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-            if (root[i].name == tokens[k] && root[i].attribute == 8) { // find it
-                k++;
-                current_index = root[i].indexFirstBlock;
-                root_init("disk.txt", root[i].indexFirstBlock);
-                flag = true;
-                break;
-            }
-        }
-        if (flag) {
-            flag = false;
-            continue;
-        } else {
-            cerr << "can't find the sub Directory" << endl;
-            return -1;
-        }
+    DirLock lock;
+    int current_index = walk_path(tokens, &lock, true);
+    if (current_index < 0) {
+        cerr << "can't find the sub Directory" << endl;
+        return -1;
     }
+    int k = tokens.size() - 1; // tokens 's index
+
+    Root entry;
+    DirSlot where;
 
     // if the name is exists
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if (tokens[k] == root[i].name) {
+    int found = dir_find(current_index, tokens[k], &entry, &where);
+    if (found != 0) {
+        if (found == 1)
             cerr << "the directory is exists" << endl;
-            return -1;
-        }
+        return -1;
     }
 
-    if (tokens.size() - k == 1) {
-        for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-            if(root[i].name[0] == '$') {
-                strncpy(root[i].name, tokens[k].c_str(), sizeof(root[i].name) - 1);
-                root[i].name[sizeof(root[i].name) - 1] = '\0';
-                strncpy(root[i].type, "$\0\0", sizeof(root[i].type));
-                root[i].attribute = 8;
-                root[i].indexFirstBlock = find_empty_fat();
-                fat[root[i].indexFirstBlock] = FAT_EOC;
-                root[i].size = 1;
-                writeDirToDisk(root, "disk.txt", current_index);
-                vector<Root> subDir = {
-                    {"$", "$", 0, 0, 0},
-                    {"$", "$", 0, 0, 0},
-                    {"$", "$", 0, 0, 0},
-                    {"$", "$", 0, 0, 0},
-                    {"$", "$", 0, 0, 0},
-                    {"$", "$", 0, 0, 0},
-                    {"$", "$", 0, 0, 0},
-                    {"$", "$", 0, 0, 0}
-                };
-                writeDirToDisk(subDir, "disk.txt", root[i].indexFirstBlock);
-                cout << "directory create success!" << endl;
-                root_init("disk.txt", 2);
-                return 0;
-            }
-        }
-        cerr << "the dir is full" << endl;
+    int empty_block_index = find_empty_fat();
+    if (empty_block_index == -1) {
+        cerr << "no space left on the disk" << endl;
+        return -1;
+    }
+    memset(&entry, 0, sizeof(entry));
+    strncpy(entry.name, tokens[k].c_str(), sizeof(entry.name) - 1);
+    strncpy(entry.type, "$\0\0", sizeof(entry.type));
+    entry.attribute = 8;
+    entry.indexFirstBlock = empty_block_index;
+    fat_set(entry.indexFirstBlock, FAT_EOC);
+    entry.size = 1;
+    // the block is taken before the entry points to it, see create_file()
+    if (fat_sync() != 0 || dir_init(entry.indexFirstBlock) != 0
+        || dir_add(current_index, entry) != 0) {
+        free_block(empty_block_index);
+        fat_sync();
         return -1;
     }
+    // the blocks of a split of the parent, see create_file()
+    if (fat_sync() != 0)
+        return -1;
+    if (!fs->quiet)
+        cout << "directory create success!" << endl;
 
     return 0;
 }
 
 int dir(const string &pathdir)
 {
+    OpStat counted(FS_OP_DIR);
     if (valid_name(pathdir) == -1)
         return -1;
-    root_init("disk.txt", 2);
+
+    vector<Root> entries;
+    size_t nfree = 0;
 
     if (pathdir == "/") {
-        cout << left << setw(10) << "name"
+        DirLock lock;
+        lock.lock(fs->sblk.rootIndex, false);
+        if (dir_list(fs->sblk.rootIndex, &entries, &nfree) != 0)
+            return -1;
+
+        // formatted aside: the flags of cout are shared by every thread
+        ostringstream out;
+        out << left << setw(10) << "name"
                 << setw(10) << "type"
                 << setw(12) << "attribute"
                 << setw(18) << "indexoffirstblock"
                 << setw(10) << "size" << endl;
-        cout << string(60, '-') << endl;
-
-        for (int j = 0; j < FS_FILE_MAX_COUNT; j++) {
-            if (root[j].name[0] != '$') {
-                cout << left << setw(10) << root[j].name
-                << setw(10) << root[j].type
-                << setw(12) << static_cast<int>(root[j].indexFirstBlock)
-                << setw(18) << static_cast<int>(root[j].attribute)
-                << setw(10) << static_cast<int>(root[j].size)
-                << endl;
-            }
+        out << string(60, '-') << endl;
+
+        for (const Root &e : entries) {
+            out << left << setw(10) << e.name
+            << setw(10) << e.type
+            << setw(12) << static_cast<int>(e.indexFirstBlock)
+            << setw(18) << static_cast<int>(e.attribute)
+            << setw(10) << static_cast<int>(e.size)
+            << endl;
         }
-        cout << "print success" << endl;
+        cout << out.str();
+        if (!fs->quiet)
+            cout << "print success" << endl;
         return 0;
     }
 
-    int k = 0; // tokens 's index
-    bool flag = false;
-    int current_index = 2;
     vector<string> tokens = splitPath(pathdir);
 
-    while (tokens.size() - k > 1) {
-        for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-            if (root[i].name == tokens[k]) { // find it
-                k++;
-                current_index = root[i].indexFirstBlock;
-                root_init("disk.txt", root[i].indexFirstBlock);
-                flag = true;
-                break;
-            }
-        }
-        if (flag) {
-            flag = false;
-            continue;
-        } else {
-            cerr << "can't find the sub Directory" << endl;
-            return -1;
-        }
+    DirLock lock;
+    int current_index = walk_path(tokens, &lock, false);
+    if (current_index < 0) {
+        cerr << "can't find the sub Directory" << endl;
+        return -1;
     }
+    int k = tokens.size() - 1; // tokens 's index
 
     // find the dir
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if (tokens[k] == root[i].name) {
-            current_index = root[i].indexFirstBlock;
-            root_init("disk.txt", root[i].indexFirstBlock);
-            cout << "name  type   attribute  indexoffirstblock  size " << endl;
-            for (int j = 0; j < FS_FILE_MAX_COUNT; j++) {
-                if (root[j].name[0] != '$') {
-                    cout << root[j].name << "      "
-                    << root[j].type << "      "
-                    << static_cast<int>(root[j].attribute) << "             "
-                    << static_cast<int>(root[j].indexFirstBlock) << "               "
-                    << static_cast<int>(root[j].size)
-                    << endl;
-                }
-
-            }
-            cout << "print success" << endl;
-            return 0;
-        }
+    Root entry;
+    DirSlot where;
+    int found = dir_find(current_index, tokens[k], &entry, &where);
+    if (found < 0)
+        return -1;
+    if (found == 0 || entry.attribute != 8) {
+        cerr << "can't find the dir" << endl;
+        return -1;
     }
 
-    cerr << "can't find the dir" << endl;
-    return -1;
+    DirLock child;
+    child.lock(entry.indexFirstBlock, false);
+    if (dir_list(entry.indexFirstBlock, &entries, &nfree) != 0)
+        return -1;
+    cout << "name  type   attribute  indexoffirstblock  size " << endl;
+    for (const Root &e : entries) {
+        cout << e.name << "      "
+        << e.type << "      "
+        << static_cast<int>(e.attribute) << "             "
+        << static_cast<int>(e.indexFirstBlock) << "               "
+        << static_cast<int>(e.size)
+        << endl;
+    }
+    if (!fs->quiet)
+        cout << "print success" << endl;
+    return 0;
 }
 
 int rd(const string &pathdir)
 {
+    OpStat counted(FS_OP_RD);
+    journal_handle op;
+
     if (valid_name(pathdir) == -1)
         return -1;
-    root_init("disk.txt", 2);
 
-    int k = 0; // tokens 's index
-    bool flag = false;
-    int current_index = 2;
     vector<string> tokens = splitPath(pathdir);
 
-    while (tokens.size() - k > 1) {
-        for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-            if (root[i].name == tokens[k]) { // find it
-                k++;
-                current_index = root[i].indexFirstBlock;
-                root_init("disk.txt", root[i].indexFirstBlock);
-                flag = true;
-                break;
-            }
-        }
-        if (flag) {
-            flag = false;
-            continue;
-        } else {
-            cerr << "can't find the sub Directory" << endl;
-            return -1;
-        }
+    DirLock lock;
+    int current_index = walk_path(tokens, &lock, true);
+    if (current_index < 0) {
+        cerr << "can't find the sub Directory" << endl;
+        return -1;
     }
+    int k = tokens.size() - 1; // tokens 's index
 
     // find the dir
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if (tokens[k] == root[i].name) {
-            int pre_index = current_index;
-            current_index = root[i].indexFirstBlock;
-            root_init("disk.txt", root[i].indexFirstBlock);
-            for(int j = 0; j < FS_FILE_MAX_COUNT; j++) {
-                if (root[j].name[0] != '$') {
-                    cerr << "it is no a empty dir" << endl;
-                    return -1;
-                }
-            }
-            vector<Root> subDir = {
-                {"$", "$", 0, 0, 0},
-                {"$", "$", 0, 0, 0},
-                {"$", "$", 0, 0, 0},
-                {"$", "$", 0, 0, 0},
-                {"$", "$", 0, 0, 0},
-                {"$", "$", 0, 0, 0},
-                {"$", "$", 0, 0, 0},
-                {"$", "$", 0, 0, 0}
-            };
-            writeDirToDisk(subDir, "disk.txt", current_index);
-            root_init("disk.txt", pre_index);
-            for(int j = 0; j < FS_FILE_MAX_COUNT; j++) {
-                if (root[j].name == tokens[k]) {
-                    strncpy(root[i].name, "$\0\0\0", sizeof(root[i].name));
-                    strncpy(root[i].type, "$\0\0", sizeof(root[i].type));
-                    root[i].attribute = 0;
-                    root[i].indexFirstBlock = 0;
-                    root[i].size = 0;
-                    writeDirToDisk(root, "disk.txt", pre_index);
-                }
-            }
-            cout << "delete dir success" << endl;
-            return 0;
-        }
+    Root entry;
+    DirSlot where;
+    int found = dir_find(current_index, tokens[k], &entry, &where);
+    if (found < 0)
+        return -1;
+    if (found == 0 || entry.attribute != 8) {
+        cerr << "can't find the dir." << endl;
+        return -1;
     }
-    cerr << "can't find the dir." << endl;
-    return -1;
-}
\ No newline at end of file
+
+    // nothing can be created in the directory until it is gone
+    DirLock child;
+    child.lock(entry.indexFirstBlock, true);
+    vector<Root> entries;
+    size_t nfree = 0;
+    if (dir_list(entry.indexFirstBlock, &entries, &nfree) != 0)
+        return -1;
+    if (!entries.empty()) {
+        cerr << "it is no a empty dir" << endl;
+        return -1;
+    }
+
+    // unlink first, then release the blocks of the directory
+    if (dir_remove(current_index, where) != 0)
+        return -1;
+    for (int linked_index = entry.indexFirstBlock, tmp; linked_index != FAT_EOC; ) {
+        tmp = linked_index;
+        linked_index = fs->fat[linked_index];
+        free_block(tmp);
+    }
+    dcache_invalidate(entry.indexFirstBlock);
+    fat_sync();
+    if (!fs->quiet)
+        cout << "delete dir success" << endl;
+    return 0;
+}
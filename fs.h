@@ -3,33 +3,206 @@
 
 #include <cstddef>
 #include <string>
+#include <sys/types.h>
 
 using namespace std;
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 3
 
-/** Maximum number of files in the root directory */
-#define FS_FILE_MAX_COUNT 8
+/** Number of directory entries in a block of %BLOCK_SIZE bytes */
+#define FS_FILE_MAX_COUNT 4
 
-/** Maximum number of open files */
-#define FS_OPEN_MAX_COUNT 5
+/** Maximum number of open files (the open file table grows up to it) */
+#define FS_OPEN_MAX_COUNT 65536
 
-/** Maximum column of the disk (by blocks) */
+/** Default column of the disk (by blocks) for fs_format() */
 #define FS_DISK_MAX 128
 
+/** fs_mount_flags() flag: map the image in memory instead of pread/pwrite */
+#define FS_MOUNT_MMAP 0x1
+
+/**
+ * Bytes of the default buffer cache besides the FAT and the journal
+ * transaction, see fs_mount_cache(): the directories being used
+ */
+#define FS_CACHE_BYTES (64 * 1024)
+
+/** Latency buckets of a call counted by fs_get_stats() */
+#define FS_STATS_BUCKETS 24
+
+/** Calls counted by fs_get_stats(), one per function of this header */
+enum fs_op {
+    FS_OP_CREATE_FILE,
+    FS_OP_OPEN_FILE,
+    FS_OP_READ,
+    FS_OP_WRITE,
+    FS_OP_CLOSE,
+    FS_OP_PREAD,
+    FS_OP_PWRITE,
+    FS_OP_LSEEK,
+    FS_OP_READ_FILE,
+    FS_OP_WRITE_FILE,
+    FS_OP_CLOSE_FILE,
+    FS_OP_DELETE_FILE,
+    FS_OP_TYPEFILE,
+    FS_OP_CHANGE,
+    FS_OP_MD,
+    FS_OP_DIR,
+    FS_OP_RD,
+    FS_OP_SYNC,
+    FS_OP_BATCH_COMMIT,
+    FS_OP_COUNT
+};
+
+/** Counters of one function */
+struct fs_op_stats {
+    /* Calls that returned */
+    size_t calls;
+    /* Time spent in them, in microseconds */
+    size_t usec;
+    /*
+     * Calls by latency: @latency[0] counts the calls under 1 us, @latency[b]
+     * those from 2^(b-1) to 2^b us, the last bucket every slower one
+     */
+    size_t latency[FS_STATS_BUCKETS];
+};
+
+/** File system counters */
+struct fs_stats {
+    struct fs_op_stats ops[FS_OP_COUNT];
+    /* Bytes of files read and written by the callers */
+    size_t bytes_read;
+    size_t bytes_written;
+    /* Block I/Os of the disk and the blocks they moved, journal included */
+    size_t disk_reads;
+    size_t disk_writes;
+    size_t blocks_read;
+    size_t blocks_written;
+    /* Block allocations and the free bitmap words they scanned */
+    size_t allocs;
+    size_t alloc_scanned;
+};
+
+/** A file system instance, see fs_new() */
+typedef struct FileSystem FileSystem;
+
+/**
+ * fs_new - Create a file system instance
+ *
+ * An instance has its own virtual disk, buffer cache, journal, FAT, directory
+ * locks and open file table, so that one process can mount many images and
+ * serve them all at once. Every other function acts on the instance of the
+ * calling thread, picked with fs_use(); file descriptors are only valid in
+ * the instance that returned them. Threads that did not pick one share a
+ * default instance, so a process with a single image needs none of its own.
+ *
+ * Return: A new instance, with no file system mounted.
+ */
+FileSystem *fs_new(void);
+
+/**
+ * fs_delete - Release a file system instance
+ * @fs: Instance created by fs_new()
+ *
+ * Return: -1 if @fs is used by the calling thread or is still mounted.
+ * 0 otherwise.
+ */
+int fs_delete(FileSystem *fs);
+
+/**
+ * fs_use - Pick the file system instance of the calling thread
+ * @fs: Instance created by fs_new(), NULL for the default instance
+ *
+ * Any number of threads may use the same instance at once, see fs_mount().
+ *
+ * Return: The instance used until then, NULL if it was the default one.
+ */
+FileSystem *fs_use(FileSystem *fs);
+
+/** Uses a file system instance in the calling thread for the life of a scope */
+struct fs_scope {
+    FileSystem *prev;
+    fs_scope(FileSystem *fs) : prev(fs_use(fs)) {}
+    ~fs_scope() { fs_use(prev); }
+};
+
+/**
+ * fs_format - Create an empty file system
+ * @diskname: Name of the virtual disk file
+ * @numBlocks: Number of blocks of the volume
+ * @blockSize: Size of a block in bytes
+ *
+ * Create the virtual disk file @diskname (replacing any previous content) and
+ * write a superblock, an empty FAT, an empty journal (a sixteenth of the
+ * volume, between %JOURNAL_MIN_BLOCKS and %JOURNAL_MAX_BLOCKS blocks) and an
+ * empty root directory to it. The geometry is recorded in the superblock,
+ * fs_mount() reads it back from there.
+ *
+ * Return: -1 if @blockSize is not a power of two of at least %BLOCK_SIZE, if
+ * @numBlocks leaves no data block, or if the file cannot be written.
+ * 0 otherwise.
+*/
+int fs_format(const char* diskname, size_t numBlocks, size_t blockSize);
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
  *
  * Open the virtual disk file @diskname and mount the file system that it
  * contains. A file system needs to be mounted before files can be read from it
- * with fs_read() or written to it with fs_write().
+ * with fs_read() or written to it with fs_write(). The transactions left in
+ * the journal by a crash are replayed first.
+ *
+ * FAT and directory changes are logged in the journal before they reach their
+ * place, so an operation is either complete or absent after a crash; one that
+ * changes more blocks than a transaction holds may only leak blocks. Data
+ * blocks are not logged.
+ *
+ * Once mounted, the other functions may be called from many threads at once.
+ * Every directory has a reader/writer lock, taken from the root down while a
+ * path is resolved, so operations in different directories do not wait for
+ * each other; every open file and the block allocator have their own locks.
+ * fs_format(), fs_mount() and fs_umount() must not run concurrently with any
+ * other call on the same instance; instances don't share any lock.
  *
  * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
  * file system can be located. 0 otherwise.
 */
 int fs_mount(const char* diskname);
 
+/**
+ * fs_mount_flags - Mount a file system with options
+ * @diskname: Name of the virtual disk file
+ * @flags: Bitwise or of %FS_MOUNT_* flags
+ *
+ * Same as fs_mount(). With %FS_MOUNT_MMAP the image is mapped in memory, so
+ * blocks are read and written in place without system calls, and fs_umount()
+ * msync()s the mapping. Blocks then change in place: the journal is replayed
+ * but later changes are not logged.
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
+ * file system can be located. 0 otherwise.
+*/
+int fs_mount_flags(const char* diskname, int flags);
+
+/**
+ * fs_mount_cache - Mount a file system with options and a cache size
+ * @diskname: Name of the virtual disk file
+ * @flags: Bitwise or of %FS_MOUNT_* flags
+ * @cache_blocks: Number of block buffers of the cache, 0 for the default
+ *
+ * Same as fs_mount_flags(). The default cache holds the whole FAT, the
+ * largest journal transaction the journal region allows, and %FS_CACHE_BYTES
+ * of other blocks, %CACHE_DEFAULT_BLOCKS at least, so it grows with the
+ * volume and keeps the same memory across block sizes. A smaller cache also
+ * makes the transactions smaller. The counters of fs_info() tell whether
+ * another size fits the load better.
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened, if no valid
+ * file system can be located or if the cache can't be set up. 0 otherwise.
+*/
+int fs_mount_cache(const char* diskname, int flags, size_t cache_blocks);
+
 /**
  * fs_umount - Unmount the file system
  * @diskname: Name of the virtual disk file
@@ -42,6 +215,41 @@ int fs_mount(const char* diskname);
 */
 int fs_umount(const char* diskname);
 
+/**
+ * fs_sync - Flush the file system to the disk
+ *
+ * Write out the appends held by open files, commit the running journal
+ * transaction, write back the changed FAT blocks and every cached block, then
+ * flush the virtual disk file to stable storage.
+ *
+ * Return: -1 if no file system is mounted or if a write fails. 0 otherwise.
+*/
+int fs_sync(void);
+
+/**
+ * fs_batch_begin - Start a batch of operations
+ *
+ * Until the matching fs_batch_commit(), the directory and FAT changes of every
+ * operation stay in one journal transaction, where a block changed several
+ * times is logged once, and the written file data stays in memory. Reads see
+ * the buffered data. Batches nest: only the outermost commit writes.
+ *
+ * Return: -1 if no file system is mounted. 0 otherwise.
+*/
+int fs_batch_begin(void);
+
+/**
+ * fs_batch_commit - Write out a batch of operations
+ *
+ * The buffered data blocks are written in block order, adjacent blocks with
+ * one I/O, and flushed, then the changed metadata is committed to the journal
+ * with one log write. A batch larger than a journal transaction is committed
+ * in several transactions.
+ *
+ * Return: -1 if no batch was started or if a write fails. 0 otherwise.
+*/
+int fs_batch_commit(void);
+
 /**
  * fs_info - show information about file system
  *
@@ -51,6 +259,52 @@ int fs_umount(const char* diskname);
 */
 int fs_info(void);
 
+/**
+ * fs_set_quiet - Silence the success messages
+ * @quiet: Print only the errors and the data asked for if set
+ *
+ * Applies to the file system of the calling thread, and must not run
+ * concurrently with any other call on it.
+*/
+void fs_set_quiet(bool quiet);
+
+/**
+ * fs_get_stats - Get the counters of the file system
+ * @stats: Filled with the counters accumulated since fs_mount()
+ *
+ * Each thread counts its calls in a shard of relaxed atomics of its own, so
+ * the counters stay on. The shards are summed here, without stopping the
+ * other threads: a call still running is not counted yet.
+ *
+ * Return: -1 if no underlying virtual disk was opened. 0 otherwise.
+*/
+int fs_get_stats(struct fs_stats *stats);
+
+/**
+ * fs_stats - show the counters of the file system
+ *
+ * Display the calls of every function with their latency histogram, the
+ * block I/Os, the bytes written to the disk for each byte written to a file
+ * and the allocator scan lengths.
+ *
+ * Return: -1 if no underlying virtual disk was opened. 0 otherwise.
+*/
+int fs_stats(void);
+
+/**
+ * fs_check - Check the FAT and the directories
+ *
+ * Walk the FAT chain of every file and directory from the root, and report
+ * the entries pointing to a free block or out of the volume and the blocks
+ * owned twice. Blocks taken in the FAT that no chain reaches are counted as
+ * leaked, which a crash may leave but which is no error. The summary is
+ * printed even in quiet mode. Must not run concurrently with other calls.
+ *
+ * Return: -1 if no underlying virtual disk was opened or a directory can't
+ * be read, 1 if an error was found, 0 otherwise.
+*/
+int fs_check(void);
+
 /**
  * create_file - Create a new file
  * @filename: File name
@@ -62,8 +316,8 @@ int fs_info(void);
  * character).
  *
  * Return: -1 if @filename is invalid. if a file named @filename already exist,
- * or if string @filename is too long, or if the root directory already contains
- * %FS_FILE_MAX_COUNT files. 0 otherwise.
+ * or if string @filename is too long, or if no block is left to grow the
+ * directory. 0 otherwise.
 */
 int create_file(const string &pathname, char attribute);
 
@@ -73,20 +327,108 @@ int create_file(const string &pathname, char attribute);
  * @flag: Access mode (e.g., read, write, or both)
  *
  * Open an existing file for reading, writing, or both. 
- * The file must exist in the file system.
+ * The file must exist in the file system and not be open yet.
  *
- * Return: -1 if the file does not exist or if the maximum number of 
- * open files is exceeded. File descriptor otherwise.
+ * Return: -1 if the file does not exist, is already open, or if the maximum
+ * number of open files is exceeded. File descriptor otherwise.
 */
 int open_file(const string &filename, int flag);
 
+/**
+ * fs_read - Read data from an open file
+ * @fd: File descriptor returned by open_file()
+ * @read_length: Number of bytes to read
+ *
+ * Same as read_file(), on a file already opened.
+ *
+ * Return: -1 if @fd is not open or if the read operation fails. 0 otherwise.
+*/
+int fs_read(int fd, int read_length);
+
+/**
+ * fs_write - Write data to an open file
+ * @fd: File descriptor returned by open_file()
+ * @buffer: Data to write
+ * @write_length: Number of bytes to write
+ *
+ * Same as write_file(), on a file already opened.
+ *
+ * Return: -1 if @fd is not open, the write operation fails, or there is
+ * insufficient space. 0 otherwise.
+*/
+int fs_write(int fd, const string &buffer, int write_length);
+
+/**
+ * fs_close - Close an open file
+ * @fd: File descriptor returned by open_file()
+ *
+ * The appends held by @fd are written out first. The descriptor may be
+ * returned again by a later open_file().
+ *
+ * Return: -1 if @fd is not open or its appends cannot be written, the
+ * descriptor is closed all the same. 0 otherwise.
+*/
+int fs_close(int fd);
+
+/**
+ * fs_pread - Read data from an open file into a buffer
+ * @fd: File descriptor returned by open_file()
+ * @buf: Buffer to fill
+ * @len: Number of bytes to read
+ * @offset: Byte offset in the file to read from
+ *
+ * Copy up to @len bytes of the file, starting at @offset, into @buf. Runs of
+ * whole blocks are read straight into @buf. The read and write pointers of
+ * @fd are not moved and nothing is printed.
+ *
+ * Return: -1 if @fd is not open, @offset is negative or a block cannot be
+ * read. The number of bytes read otherwise, 0 at the end of the file.
+*/
+ssize_t fs_pread(int fd, void *buf, size_t len, off_t offset);
+
+/**
+ * fs_pwrite - Write data from a buffer to an open file
+ * @fd: File descriptor returned by open_file()
+ * @buf: Data to write
+ * @len: Number of bytes to write
+ * @offset: Byte offset in the file to write to
+ *
+ * Copy @len bytes of @buf into the file at @offset, growing the file if
+ * needed. Runs of whole blocks are written straight from @buf. Writing past
+ * the end of the file fills the gap with zeros.
+ *
+ * Bytes written at or past the end of the file are appended in memory, up to
+ * 64 blocks, and their blocks are allocated and written in one go by the next
+ * read, overwrite or fs_close() of @fd, fs_sync(), fs_batch_commit() or
+ * fs_umount(). Until then the directory entry of the file keeps its old
+ * length.
+ *
+ * Return: -1 if @fd is not open, @offset is invalid, or there is insufficient
+ * space. The number of bytes written otherwise.
+*/
+ssize_t fs_pwrite(int fd, const void *buf, size_t len, off_t offset);
+
+/**
+ * fs_lseek - Move the read and write pointers of an open file
+ * @fd: File descriptor returned by open_file()
+ * @offset: Byte offset in the file
+ *
+ * The next fs_read() or fs_write() on @fd starts at @offset. The block holding
+ * @offset is found in the block map of @fd, built lazily as the chain is
+ * followed, so a seek does not walk the chain again.
+ *
+ * Return: -1 if @fd is not open or @offset is negative or past the end of the
+ * file. @offset otherwise.
+*/
+off_t fs_lseek(int fd, off_t offset);
+
 /**
  * read_file - Read data from a file
  * @filename: File name
  * @read_length: Number of bytes to read
  *
  * Read up to @read_length bytes from the specified file. 
- * The file must be opened for reading.
+ * A file that is not open is opened for the call only.
  *
  * Return: -1 if the file is not open or if the read operation fails.
  * Number of bytes read otherwise.
@@ -100,12 +442,12 @@ int read_file(const string &filename, int read_length);
  * @write_length: Number of bytes to write
  *
  * Write up to @write_length bytes from the @buffer to the specified file. 
- * The file must be opened for writing.
+ * A file that is not open is opened for the call only.
  *
  * Return: -1 if the file is not open, the write operation fails, 
  * or there is insufficient space. Number of bytes written otherwise.
 */
-int write_file(const string &filename, const string buffer, int write_length);
+int write_file(const string &filename, const string &buffer, int write_length);
 
 /**
  * close_file - Close an open file
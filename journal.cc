@@ -0,0 +1,823 @@
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "journal.h"
+#include "trace.h"
+
+using namespace std;
+
+/** Signature at the start of the journal region */
+#define JOURNAL_SIGNATURE "FSJOURNL"
+
+/** Magic of every descriptor and commit record */
+#define JOURNAL_MAGIC 0x4a4e524c
+
+/** Record types */
+#define JOURNAL_DESCRIPTOR 1
+#define JOURNAL_COMMIT 2
+
+/*
+ * First block of the region. The rest of the region is the log, a circular
+ * list of transactions starting at @start: a descriptor block listing the
+ * blocks of the transaction, their images in the same order, and a commit
+ * record. Transactions are numbered
+ * from @sequence on, so that a stale record left by a previous pass of the
+ * log is never taken for a new one.
+ */
+typedef struct __attribute__((__packed__)) journal_super {
+    char sig[8];
+    uint32_t start; // log block of the oldest transaction
+    uint32_t sequence; // number of that transaction
+} journal_super;
+
+/* Header of a descriptor or commit record */
+typedef struct __attribute__((__packed__)) journal_record {
+    uint32_t magic;
+    uint32_t type;
+    uint32_t sequence;
+    uint32_t count; // number of blocks of the transaction
+    uint32_t checksum; // commit: FNV-1a of the descriptor and the images
+} journal_record;
+
+/** Journal instance description */
+struct journal {
+    /* Changes are logged (the volume has a journal and is not mapped) */
+    bool active;
+    /* Block holding the journal_super */
+    size_t first;
+    /* Number of log blocks, after the journal_super */
+    size_t size;
+    size_t bsize;
+    /* Log block where the next transaction goes */
+    size_t head;
+    /* Log blocks written since the last checkpoint */
+    size_t used;
+    /* Number of the running transaction */
+    uint32_t sequence;
+    /* Most blocks in a transaction */
+    size_t max_blocks;
+    /* Operations between journal_start() and journal_stop() */
+    int handles;
+    /*
+     * The running transaction takes no new operation: it is committed once
+     * the operations in it stop, see close_txn()
+     */
+    bool closing;
+    /* A thread is committing the closed transaction */
+    bool committing;
+    /* Commit a checkpoint after the closed transaction, see journal_flush() */
+    bool flushing;
+    /* Handles of the threads waiting in wait_commit() */
+    int waiting;
+    /* Handles each thread holds, nested or from a batch, see held() */
+    unordered_map<thread::id, int> holders;
+    /* Result of the last end_txn(), for the threads that waited for it */
+    int status;
+    /* Signalled as operations stop and transactions commit */
+    condition_variable turn;
+    /* Time of the first change of the running transaction */
+    chrono::steady_clock::time_point born;
+    /* Blocks of the running transaction, each pinned once in the cache */
+    vector<size_t> blocks;
+    unordered_set<size_t> pinned;
+    /* Blocks with an image in the log since the last checkpoint */
+    unordered_set<size_t> logged;
+    /* Logged blocks freed since the last checkpoint */
+    vector<size_t> freed;
+    /*
+     * Blocks freed in the log or by the running transaction, reused once a
+     * commit between operations carries the FAT change that freed them
+     */
+    vector<size_t> released;
+    void (*release)(size_t block);
+    struct journal_stats stats;
+    /* Guards every field */
+    mutex lock;
+    /* Blocks between journal_get() and journal_put(), being changed */
+    int editing;
+    condition_variable edited;
+};
+
+/* Journal of the threads that did not pick one */
+static struct journal journal0;
+
+/* Journal of the calling thread, see journal_use() */
+static thread_local struct journal *journal = &journal0;
+
+/* Handles the calling thread holds on its journal, under the journal lock */
+static int held(void)
+{
+    auto it = journal->holders.find(this_thread::get_id());
+
+    return it == journal->holders.end() ? 0 : it->second;
+}
+
+static uint32_t checksum(const char *data, size_t len)
+{
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+/**
+ * log_io - Read or write consecutive log blocks
+ * @pos: First log block
+ * @count: Number of blocks, the log wraps after its last block
+ * @buf: Block images
+ * @write: Write @buf instead of reading into it
+ *
+ * Return: -1 if the I/O fails. 0 otherwise.
+ */
+static int log_io(size_t pos, size_t count, char *buf, bool write)
+{
+    while (count > 0) {
+        size_t run = min(count, journal->size - pos);
+        size_t block = journal->first + 1 + pos;
+        int ret = write ? block_write_run(block, run, buf)
+                        : block_read_run(block, run, buf);
+        if (ret < 0)
+            return -1;
+        buf += run * journal->bsize;
+        count -= run;
+        pos = (pos + run) % journal->size;
+    }
+
+    return 0;
+}
+
+static int write_super(void)
+{
+    vector<char> buf(journal->bsize, 0);
+    journal_super *sb = (journal_super *)buf.data();
+
+    memcpy(sb->sig, JOURNAL_SIGNATURE, sizeof(sb->sig));
+    sb->start = (journal->head + journal->size - journal->used) % journal->size;
+    sb->sequence = journal->sequence;
+
+    return block_write(journal->first, buf.data());
+}
+
+/**
+ * desc_max - Most blocks a descriptor of the region can list
+ * @count: Number of blocks of the journal region
+ */
+static size_t desc_max(size_t count)
+{
+    size_t bsize = block_disk_block_size();
+
+    // the descriptor lists the blocks after its record header, and a
+    // transaction also takes its descriptor and commit record
+    return min((bsize - sizeof(journal_record)) / sizeof(uint32_t), count - 1 - 2);
+}
+
+/**
+ * txn_blocks - Log blocks taken by the largest transaction
+ */
+static size_t txn_blocks(void)
+{
+    return journal->max_blocks + 2;
+}
+
+static bool txn_empty(void)
+{
+    return journal->blocks.empty();
+}
+
+static void txn_touch(void)
+{
+    if (txn_empty())
+        journal->born = chrono::steady_clock::now();
+}
+
+static bool txn_half_full(void)
+{
+    return journal->blocks.size() > journal->max_blocks / 2;
+}
+
+/**
+ * txn_due - Tell if the running transaction has waited long enough
+ */
+static bool txn_due(void)
+{
+    if (!journal->active || txn_empty())
+        return false;
+
+    auto age = chrono::steady_clock::now() - journal->born;
+    return chrono::duration_cast<chrono::microseconds>(age).count()
+           >= JOURNAL_COMMIT_USEC;
+}
+
+/**
+ * checkpoint - Write every logged block back in place and empty the log
+ *
+ * Only called between transactions: every dirty metadata block in the cache
+ * is then committed.
+ *
+ * Return: -1 if a write fails. 0 otherwise.
+ */
+static int checkpoint(void)
+{
+    trace_scope span("journal_checkpoint");
+
+    if (cache_flush() != 0 || block_disk_sync() != 0)
+        return -1;
+
+    journal->used = 0;
+    journal->logged.clear();
+    journal->stats.checkpoints++;
+    if (write_super() != 0 || block_disk_sync() != 0)
+        return -1;
+
+    // no image of them is left to be replayed
+    journal->released.insert(journal->released.end(), journal->freed.begin(),
+                             journal->freed.end());
+    journal->freed.clear();
+
+    return 0;
+}
+
+static int commit(unique_lock<mutex> &lock);
+
+/**
+ * drained - Tell if the operations left in the transaction are whole
+ *
+ * Every open handle then belongs to a thread waiting in wait_commit(), between
+ * two of its operations.
+ */
+static bool drained(void)
+{
+    return journal->handles == journal->waiting;
+}
+
+/**
+ * close_txn - Keep new operations out of the running transaction
+ *
+ * journal_start() waits until it is committed, by the last operation to stop
+ * or by a thread waiting in wait_commit().
+ */
+static void close_txn(void)
+{
+    if (journal->active && !txn_empty())
+        journal->closing = true;
+}
+
+/**
+ * release_freed - Make the blocks freed so far reusable
+ *
+ * Only called between operations: every FAT change is then in a transaction,
+ * the one just committed or an older one.
+ */
+static void release_freed(void)
+{
+    for (size_t block : journal->released)
+        journal->release(block);
+    journal->released.clear();
+}
+
+/**
+ * end_txn - Commit the closed transaction and open the next one
+ * @lock: The journal lock, held
+ * @between: Every open handle is between two operations
+ *
+ * The log is also checkpointed if journal_flush() asked for it.
+ *
+ * Return: -1 if a write fails. 0 otherwise.
+ */
+static int end_txn(unique_lock<mutex> &lock, bool between)
+{
+    journal->committing = true;
+    int ret = commit(lock);
+    if (ret == 0 && journal->flushing)
+        ret = checkpoint();
+    if (ret == 0 && between)
+        release_freed();
+    journal->flushing = false;
+    journal->committing = false;
+    journal->closing = false;
+    journal->status = ret;
+    journal->turn.notify_all();
+
+    return ret;
+}
+
+/**
+ * wait_commit - Commit the running transaction once its operations stop
+ * @lock: The journal lock, held
+ *
+ * The transaction is closed, then committed when every handle left is held
+ * by a thread waiting here: the handles of the caller stay open, it is between
+ * two of its operations. Threads that wait together share one commit.
+ *
+ * Return: -1 if a write fails. 0 otherwise.
+ */
+static int wait_commit(unique_lock<mutex> &lock)
+{
+    int ret;
+
+    journal->closing = true;
+    journal->waiting += held();
+    journal->turn.notify_all();
+    journal->turn.wait(lock, [] {
+        return !journal->closing || (drained() && !journal->committing);
+    });
+    ret = journal->closing ? end_txn(lock, true) : journal->status;
+    journal->waiting -= held();
+
+    return ret;
+}
+
+/**
+ * reserve - Make room for a block in the running transaction
+ * @lock: The journal lock, held
+ * @block: Index of the block about to join
+ *
+ * Past half of its blocks the transaction is closed, the operations already
+ * in it have the other half to finish. A full transaction is committed at
+ * once only if no other operation is in it; otherwise those outgrew the room
+ * left, and one of them spans two transactions. Called before the block
+ * changes, so the commit doesn't carry half of the change.
+ *
+ * Return: -1 if the commit fails. 0 otherwise.
+ */
+static int reserve(unique_lock<mutex> &lock, size_t block)
+{
+    if (journal->pinned.count(block))
+        return 0;
+    // a commit in progress empties the transaction
+    journal->turn.wait(lock, [] { return !journal->committing; });
+    if (txn_half_full())
+        close_txn();
+    if (journal->blocks.size() < journal->max_blocks)
+        return 0;
+
+    if (journal->handles > held() + journal->waiting)
+        journal->stats.splits++;
+
+    // the blocks freed by the operation may not be in the FAT on the disk yet
+    return end_txn(lock, false);
+}
+
+/**
+ * join - Add a block pinned by the caller to the running transaction
+ * @block: Index of the block
+ *
+ * Return: false if the block was already in it, the caller keeps its pin.
+ */
+static bool join(size_t block)
+{
+    if (journal->pinned.count(block))
+        return false;
+
+    txn_touch();
+    journal->pinned.insert(block);
+    journal->blocks.push_back(block);
+
+    return true;
+}
+
+struct journal *journal_new(void)
+{
+    return new struct journal();
+}
+
+int journal_delete(struct journal *j)
+{
+    if (!j || j == &journal0 || j == journal || j->active) {
+        cout << "journal in use" << endl;
+        return -1;
+    }
+
+    delete j;
+
+    return 0;
+}
+
+struct journal *journal_use(struct journal *j)
+{
+    struct journal *prev = journal;
+
+    journal = j ? j : &journal0;
+
+    return prev == &journal0 ? NULL : prev;
+}
+
+int journal_format(size_t first, size_t count)
+{
+    if (count < JOURNAL_MIN_BLOCKS) {
+        cerr << "the journal needs " << JOURNAL_MIN_BLOCKS << " blocks" << endl;
+        return -1;
+    }
+
+    lock_guard<mutex> guard(journal->lock);
+
+    journal->first = first;
+    journal->size = count - 1;
+    journal->bsize = block_disk_block_size();
+    journal->head = journal->used = 0;
+    journal->sequence = 1;
+
+    return write_super();
+}
+
+/**
+ * recover - Redo the committed transactions of the log
+ * @start: Log block of the oldest transaction
+ *
+ * Return: -1 if a read or write fails. 0 otherwise.
+ */
+static int recover(size_t start)
+{
+    vector<char> buf(journal->bsize), images;
+    vector<uint32_t> blocks;
+    size_t pos = start, consumed = 0, count = 0;
+
+    // a transaction ends the log if it's torn or older than the previous one
+    while (consumed + 2 <= journal->size) {
+        journal_record *rec = (journal_record *)buf.data();
+
+        if (log_io(pos, 1, buf.data(), false) != 0)
+            return -1;
+        if (rec->magic != JOURNAL_MAGIC || rec->type != JOURNAL_DESCRIPTOR
+            || rec->sequence != journal->sequence || rec->count > desc_max(journal->size + 1)
+            || consumed + rec->count + 2 > journal->size)
+            break;
+
+        size_t n = rec->count;
+        uint32_t *first = (uint32_t *)(rec + 1);
+        uint32_t sum = checksum(buf.data(), journal->bsize);
+        blocks.assign(first, first + n);
+        images.resize(n * journal->bsize);
+        if (log_io((pos + 1) % journal->size, n, images.data(), false) != 0
+            || log_io((pos + 1 + n) % journal->size, 1, buf.data(), false) != 0)
+            return -1;
+        if (rec->magic != JOURNAL_MAGIC || rec->type != JOURNAL_COMMIT
+            || rec->sequence != journal->sequence || rec->count != n
+            || rec->checksum != checksum(images.data(), images.size()) + sum)
+            break;
+
+        for (size_t i = 0; i < n; i++) {
+            if (block_write(blocks[i], &images[i * journal->bsize]) < 0)
+                return -1;
+        }
+        pos = (pos + n + 2) % journal->size;
+        consumed += n + 2;
+        journal->sequence++;
+        count++;
+    }
+
+    journal->head = pos;
+    journal->used = 0;
+    if (count == 0)
+        return 0;
+
+    journal->stats.replayed = count;
+    cout << "recovered " << count << " transactions from the journal" << endl;
+    if (block_disk_sync() != 0 || write_super() != 0)
+        return -1;
+
+    return block_disk_sync();
+}
+
+size_t journal_txn_max(size_t count)
+{
+    if (count < JOURNAL_MIN_BLOCKS)
+        return 0;
+
+    return min(desc_max(count), (count - 1) / 2 - 2);
+}
+
+int journal_init(size_t first, size_t count, size_t max_pinned,
+                 void (*release)(size_t block))
+{
+    lock_guard<mutex> guard(journal->lock);
+
+    journal->active = false;
+    journal->handles = 0;
+    journal->closing = journal->committing = journal->flushing = false;
+    journal->waiting = 0;
+    journal->status = 0;
+    journal->editing = 0;
+    journal->holders.clear();
+    journal->blocks.clear();
+    journal->pinned.clear();
+    journal->logged.clear();
+    journal->freed.clear();
+    journal->released.clear();
+    journal->release = release;
+    memset(&journal->stats, 0, sizeof(journal->stats));
+    if (count == 0)
+        return 0;
+
+    journal->first = first;
+    journal->size = count - 1;
+    journal->bsize = block_disk_block_size();
+    // recovery takes any transaction that fits the region, the new ones
+    // also have to fit the cache
+    journal->max_blocks = min(max_pinned, journal_txn_max(count));
+
+    vector<char> buf(journal->bsize);
+    journal_super *sb = (journal_super *)buf.data();
+    if (block_read(first, buf.data()) < 0
+        || memcmp(sb->sig, JOURNAL_SIGNATURE, sizeof(sb->sig)) != 0
+        || sb->start >= journal->size || journal->size < txn_blocks()) {
+        cerr << "the journal is corrupted" << endl;
+        return -1;
+    }
+    journal->sequence = sb->sequence;
+
+    if (recover(sb->start) != 0) {
+        cerr << "can't recover the journal" << endl;
+        return -1;
+    }
+
+    // a mapped disk is changed in place, there is nothing to hold back
+    journal->active = block_map(0) == NULL;
+
+    return 0;
+}
+
+static int flush(unique_lock<mutex> &lock);
+
+int journal_destroy(void)
+{
+    unique_lock<mutex> lock(journal->lock);
+    int ret = flush(lock);
+
+    journal->active = false;
+    journal->handles = 0;
+    journal->holders.clear();
+
+    return ret;
+}
+
+/**
+ * settle - Commit the closed transaction if its operations all stopped
+ * @lock: The journal lock, held
+ *
+ * Threads waiting in wait_commit() are woken to commit it themselves.
+ */
+static void settle(unique_lock<mutex> &lock)
+{
+    if (!journal->closing || !drained())
+        return;
+    if (journal->waiting == 0 && !journal->committing)
+        end_txn(lock, true);
+    else
+        journal->turn.notify_all();
+}
+
+/**
+ * enter - Add an operation to the running transaction
+ * @lock: The journal lock, held
+ */
+static void enter(unique_lock<mutex> &lock)
+{
+    journal->handles++;
+    journal->holders[this_thread::get_id()]++;
+    journal->stats.ops++;
+}
+
+void journal_start(void)
+{
+    unique_lock<mutex> lock(journal->lock);
+
+    // don't let a transaction wait for the window to be used again, and
+    // leave an operation half of a transaction so it isn't split. A thread
+    // already in the transaction goes on, its operation isn't whole yet
+    if (held() == 0) {
+        if (txn_due() || txn_half_full()) {
+            if (journal->handles == 0 && !journal->closing && commit(lock) == 0)
+                release_freed();
+            else
+                close_txn();
+        }
+        // closed by a change made out of any operation, nothing stops then
+        settle(lock);
+        journal->turn.wait(lock, [] { return !journal->closing; });
+    }
+    enter(lock);
+}
+
+void journal_join(void)
+{
+    unique_lock<mutex> lock(journal->lock);
+
+    enter(lock);
+}
+
+void journal_stop(void)
+{
+    unique_lock<mutex> lock(journal->lock);
+
+    journal->handles--;
+    auto it = journal->holders.find(this_thread::get_id());
+    if (it != journal->holders.end() && --it->second == 0)
+        journal->holders.erase(it);
+    // under load the handles never all stop at once: close the transaction
+    // so that the window still ends, with the operations in it
+    if (txn_due())
+        close_txn();
+    settle(lock);
+}
+
+int journal_write(size_t block, const void *buf)
+{
+    unique_lock<mutex> lock(journal->lock);
+
+    if (!journal->active)
+        return cache_write(block, buf);
+
+    if (reserve(lock, block) != 0)
+        return -1;
+    // pinned before it changes: a dirty block of the transaction can't be
+    // evicted, written in place before its commit
+    bool fresh = !journal->pinned.count(block);
+    if (fresh && !cache_get(block))
+        return -1;
+    if (cache_write(block, buf) != 0) {
+        if (fresh)
+            cache_put(block, 0);
+        return -1;
+    }
+    if (fresh)
+        join(block);
+
+    return 0;
+}
+
+void *journal_get(size_t block)
+{
+    unique_lock<mutex> lock(journal->lock);
+
+    if (journal->active && reserve(lock, block) != 0)
+        return NULL;
+
+    void *data = cache_get(block);
+    if (data && journal->active)
+        journal->editing++;
+
+    return data;
+}
+
+int journal_put(size_t block)
+{
+    unique_lock<mutex> lock(journal->lock);
+
+    if (journal->active && --journal->editing == 0)
+        journal->edited.notify_all();
+
+    // the transaction takes a pin of its own before the caller drops its
+    // pin, see journal_write()
+    if (journal->active && !journal->pinned.count(block)) {
+        if (!cache_get(block)) {
+            cache_put(block, 1);
+            return -1;
+        }
+        join(block);
+    }
+
+    return cache_put(block, 1);
+}
+
+bool journal_free(size_t block)
+{
+    lock_guard<mutex> guard(journal->lock);
+
+    if (!journal->active)
+        return false;
+
+    if (journal->pinned.erase(block)) {
+        for (size_t i = 0; i < journal->blocks.size(); i++) {
+            if (journal->blocks[i] == block) {
+                journal->blocks.erase(journal->blocks.begin() + i);
+                break;
+            }
+        }
+        cache_put(block, 0);
+    }
+
+    // until the transaction freeing it is committed, the block may still be
+    // in use once recovered: it isn't written over before
+    if (journal->logged.count(block))
+        journal->freed.push_back(block);
+    else
+        journal->released.push_back(block);
+
+    return true;
+}
+
+/**
+ * commit - Commit the running transaction
+ * @lock: The journal lock, held
+ *
+ * Waits first for the blocks being changed through journal_get(), so that no
+ * half changed image is logged.
+ *
+ * Return: -1 if a write fails. 0 otherwise.
+ */
+static int commit(unique_lock<mutex> &lock)
+{
+    if (!journal->active || txn_empty())
+        return 0;
+
+    journal->edited.wait(lock, [] { return journal->editing == 0; });
+    if (txn_empty())
+        return 0;
+
+    size_t n = journal->blocks.size();
+    size_t bsize = journal->bsize;
+    trace_scope span("journal_commit", journal->first + 1 + journal->head, n + 2);
+    vector<char> buf((n + 2) * bsize, 0);
+    journal_record *desc = (journal_record *)buf.data();
+    uint32_t *blocks = (uint32_t *)(desc + 1);
+
+    desc->magic = JOURNAL_MAGIC;
+    desc->type = JOURNAL_DESCRIPTOR;
+    desc->sequence = journal->sequence;
+    desc->count = n;
+    for (size_t i = 0; i < n; i++) {
+        blocks[i] = journal->blocks[i];
+        // a hit: the block is pinned
+        if (cache_read(journal->blocks[i], &buf[(i + 1) * bsize]) < 0)
+            return -1;
+    }
+
+    journal_record *commit = (journal_record *)&buf[(n + 1) * bsize];
+    commit->magic = JOURNAL_MAGIC;
+    commit->type = JOURNAL_COMMIT;
+    commit->sequence = journal->sequence;
+    commit->count = n;
+    commit->checksum = checksum(buf.data(), bsize)
+                       + checksum(&buf[bsize], n * bsize);
+
+    if (log_io(journal->head, n + 2, buf.data(), true) != 0
+        || block_disk_sync() != 0) {
+        cerr << "can't write the journal" << endl;
+        return -1;
+    }
+
+    // committed: the blocks may now reach their place
+    for (size_t block : journal->blocks) {
+        cache_put(block, 1);
+        journal->logged.insert(block);
+    }
+    journal->blocks.clear();
+    journal->pinned.clear();
+    journal->head = (journal->head + n + 2) % journal->size;
+    journal->used += n + 2;
+    journal->sequence++;
+    journal->stats.commits++;
+    journal->stats.blocks += n;
+
+    if (journal->size - journal->used < txn_blocks())
+        return checkpoint();
+
+    return 0;
+}
+
+int journal_commit(void)
+{
+    unique_lock<mutex> lock(journal->lock);
+
+    if (!journal->active)
+        return 0;
+
+    return wait_commit(lock);
+}
+
+static int flush(unique_lock<mutex> &lock)
+{
+    if (!journal->active)
+        return 0;
+
+    // the checkpoint goes with the commit, before any operation comes in
+    journal->flushing = true;
+
+    return wait_commit(lock);
+}
+
+int journal_flush(void)
+{
+    unique_lock<mutex> lock(journal->lock);
+
+    return flush(lock);
+}
+
+void journal_get_stats(struct journal_stats *stats)
+{
+    lock_guard<mutex> guard(journal->lock);
+    *stats = journal->stats;
+}
@@ -0,0 +1,256 @@
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include <cstddef>
+
+#include "cache.h"
+
+/** Smallest journal region created by journal_format(), in blocks */
+#define JOURNAL_MIN_BLOCKS 32
+
+/** Largest journal region created by journal_format(), in blocks */
+#define JOURNAL_MAX_BLOCKS 1024
+
+/**
+ * Operations that stop within this many microseconds of the first change of
+ * a transaction share its commit
+ */
+#define JOURNAL_COMMIT_USEC 5000
+
+/** Journal counters */
+struct journal_stats {
+    /* Operations that ran between journal_start() and journal_stop() */
+    size_t ops;
+    /* Transactions written to the log */
+    size_t commits;
+    /* Block images written to the log */
+    size_t blocks;
+    /* Times the log was emptied by writing its blocks back in place */
+    size_t checkpoints;
+    /* Transactions redone by journal_init() */
+    size_t replayed;
+    /*
+     * Transactions committed full while other operations were in them, each
+     * leaving one of those operations across two transactions
+     */
+    size_t splits;
+};
+
+/** A journal instance, see journal_new() */
+struct journal;
+
+/**
+ * journal_new - Create a journal instance
+ *
+ * Every other journal_*() function acts on the journal of the calling thread,
+ * picked with journal_use(), through the cache of that thread. Threads that
+ * did not pick one share a default journal.
+ *
+ * Return: A new journal, to be opened with journal_init().
+ */
+struct journal *journal_new(void);
+
+/**
+ * journal_delete - Release a journal instance
+ * @j: Journal created by journal_new()
+ *
+ * Return: -1 if @j is the default journal, is used by the calling thread or
+ * was not closed with journal_destroy(). 0 otherwise.
+ */
+int journal_delete(struct journal *j);
+
+/**
+ * journal_use - Pick the journal of the calling thread
+ * @j: Journal created by journal_new(), NULL for the default journal
+ *
+ * Return: The journal used until then, NULL if it was the default journal.
+ */
+struct journal *journal_use(struct journal *j);
+
+/**
+ * journal_format - Write an empty journal
+ * @first: Index of the first block of the journal region
+ * @count: Number of blocks of the region
+ *
+ * The disk must be open with the block size of the file system.
+ *
+ * Return: -1 if @count is less than %JOURNAL_MIN_BLOCKS or the write fails.
+ * 0 otherwise.
+ */
+int journal_format(size_t first, size_t count);
+
+/**
+ * journal_txn_max - Get the most blocks a transaction may hold
+ * @count: Number of blocks of the journal region
+ *
+ * A transaction is listed by one descriptor block, and takes half of the log
+ * at most so that the log holds two between checkpoints. The disk must be open
+ * with the block size of the file system.
+ *
+ * Return: The number of blocks, 0 if @count is 0.
+ */
+size_t journal_txn_max(size_t count);
+
+/**
+ * journal_init - Recover and open the journal of the mounted file system
+ * @first: Index of the first block of the journal region
+ * @count: Number of blocks of the region, 0 if the volume has none
+ * @max_pinned: Most cache buffers a transaction may keep pinned, a
+ * transaction holds journal_txn_max() blocks unless this is smaller
+ * @release: Called by a commit for every block deferred by journal_free()
+ *
+ * Every transaction of the log that was committed but not checkpointed is
+ * written back in place, then the log is emptied. This must run after
+ * cache_init() and before any block is read through the cache.
+ *
+ * Changes are logged only when the cache keeps its own buffers: a disk opened
+ * with block_disk_open_mapped() changes blocks in place, so the journal is
+ * only replayed.
+ *
+ * Return: -1 if the region is not a journal or recovery fails. 0 otherwise.
+ */
+int journal_init(size_t first, size_t count, size_t max_pinned,
+                 void (*release)(size_t block));
+
+/**
+ * journal_destroy - Close the journal
+ *
+ * Commit the running transaction and checkpoint the log, so that the next
+ * journal_init() has nothing to replay.
+ *
+ * Return: -1 if a write fails. 0 otherwise.
+ */
+int journal_destroy(void);
+
+/**
+ * journal_start - Enter an operation
+ *
+ * Every metadata change until the matching journal_stop() belongs to the
+ * running transaction, which is not committed in between unless the
+ * operation alone outgrows it. The operations of every thread share the
+ * running transaction, and calls of one thread nest.
+ *
+ * Once the transaction is older than %JOURNAL_COMMIT_USEC or half full, it is
+ * closed: the outermost journal_start() of other threads waits until the
+ * operations in it stop and it is committed. The caller must not hold any
+ * lock an operation may wait for, see journal_join().
+ */
+void journal_start(void);
+
+/**
+ * journal_join - Enter an operation while holding a lock
+ *
+ * Same as journal_start(), but a closed transaction is joined instead of
+ * waited for, so it is only for callers holding a lock that the operations
+ * in that transaction may wait for.
+ */
+void journal_join(void);
+
+/**
+ * journal_stop - Leave an operation
+ *
+ * A transaction older than %JOURNAL_COMMIT_USEC is closed. The last
+ * operation to stop in a closed transaction commits it: every operation that
+ * stopped in it shares the same log write and flush. A young transaction
+ * stays open for the next operations.
+ */
+void journal_stop(void);
+
+/**
+ * journal_write - Write a metadata block through the journal
+ * @block: Index of the block to write to
+ * @buf: Data buffer to write in the block
+ *
+ * Same as cache_write(), and the block joins the running transaction. It stays
+ * pinned in the cache until the transaction is committed, so it can't reach
+ * its place on the disk before the log does.
+ *
+ * Return: -1 if the block cannot be written. 0 otherwise.
+ */
+int journal_write(size_t block, const void *buf);
+
+/**
+ * journal_get - Pin a metadata block to change it in place
+ * @block: Index of the block
+ *
+ * Same as cache_get(). The change must end with journal_put(), without any
+ * other journal call in between: a commit waits for every block being
+ * changed, so that it never logs half of a change made by another thread.
+ *
+ * Return: NULL if the block cannot be read. A pointer to the bytes of the
+ * cached block otherwise.
+ */
+void *journal_get(size_t block);
+
+/**
+ * journal_put - Unpin a metadata block changed in place
+ * @block: Index of a block pinned with journal_get()
+ *
+ * The block is marked dirty and joins the running transaction.
+ *
+ * Return: -1 if @block is not pinned. 0 otherwise.
+ */
+int journal_put(size_t block);
+
+/**
+ * journal_free - Forget a metadata block that was released
+ * @block: Index of the block
+ *
+ * The block leaves the running transaction. Until the FAT change freeing it is
+ * committed, a crash recovers the block as still used, so it is not reused
+ * before: a commit made between operations hands it to the release function
+ * given to journal_init(). If an image of it is still in the log, recovery
+ * would also write that image back over whatever the block is reused for: it
+ * then waits for the next checkpoint as well.
+ *
+ * Return: true if reusing the block is deferred, false if it is free now.
+ */
+bool journal_free(size_t block);
+
+/**
+ * journal_commit - Commit the running transaction
+ *
+ * The transaction is closed and committed once the operations of the other
+ * threads in it stop; those of the calling thread stay open. The descriptor,
+ * the block images and the commit record are written with one
+ * block_write_run() (two if the log wraps), followed by one block_disk_sync().
+ * The log is checkpointed when it can't hold another transaction.
+ *
+ * Return: -1 if a write fails. 0 otherwise.
+ */
+int journal_commit(void);
+
+/**
+ * journal_flush - Commit and checkpoint
+ *
+ * Commit the running transaction, write every dirty cached block back in
+ * place and empty the log. The blocks are written between two transactions,
+ * under the journal lock: on a journaled file system this replaces
+ * cache_flush(), which would also write the blocks of a running transaction.
+ *
+ * Return: -1 if a write fails. 0 otherwise.
+ */
+int journal_flush(void);
+
+/**
+ * journal_get_stats - Get the journal counters
+ * @stats: Filled with the counters accumulated since journal_init()
+ */
+void journal_get_stats(struct journal_stats *stats);
+
+/**
+ * Keeps an operation open for the life of a scope, with journal_join() if
+ * @join is set, else journal_start()
+ */
+struct journal_handle {
+    journal_handle(bool join = false)
+    {
+        if (join)
+            journal_join();
+        else
+            journal_start();
+    }
+    ~journal_handle() { journal_stop(); }
+};
+
+#endif
@@ -1,12 +1,139 @@
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <streambuf>
+#include <vector>
+
+#include "disk.h"
 #include "fs.h"
+#include "oplog.h"
 #include "user.h"
 
-int main()
+/*
+ * Output buffer of the quiet shell: std::endl flushes cout after every line,
+ * this buffer ignores the flushes and writes to stdout only once it is full.
+ */
+class batch_buf : public streambuf {
+public:
+    batch_buf() : buf(1 << 16) { setp(buf.data(), buf.data() + buf.size()); }
+
+    /* Write out what is buffered */
+    void drain()
+    {
+        fwrite(pbase(), 1, pptr() - pbase(), stdout);
+        fflush(stdout);
+        setp(buf.data(), buf.data() + buf.size());
+    }
+
+protected:
+    int overflow(int c)
+    {
+        drain();
+        if (c != traits_type::eof()) {
+            *pptr() = c;
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    int sync() { return 0; }
+
+private:
+    vector<char> buf;
+};
+
+int main(int argc, char *argv[])
 {
-    char diskname[] = "disk.txt";
-    fs_mount(diskname);
+    const char *diskname = "disk.txt";
+    const char *record = NULL;
+    int flags = 0;
+    int shell = 0;
+    bool format = false;
+    size_t numBlocks = FS_DISK_MAX;
+    size_t blockSize = BLOCK_SIZE;
+    size_t cacheBlocks = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "mfn:b:c:qtr:")) != -1) {
+        switch (opt) {
+        case 'm': // map the image instead of pread/pwrite
+            flags |= FS_MOUNT_MMAP;
+            break;
+        case 'f': // format a new image first
+            format = true;
+            break;
+        case 'n':
+            numBlocks = strtoull(optarg, NULL, 0);
+            break;
+        case 'b':
+            blockSize = strtoull(optarg, NULL, 0);
+            break;
+        case 'c': // buffers of the cache, 0 for the default
+            cacheBlocks = strtoull(optarg, NULL, 0);
+            break;
+        case 'q': // no success messages, output written in blocks
+            shell |= USER_QUIET;
+            break;
+        case 't': // time every command
+            shell |= USER_TIMING;
+            break;
+        case 'r': // log the commands, see oplog.h
+            record = optarg;
+            break;
+        default:
+            cerr << "Use: " << argv[0] << " [-m] [-c cache_blocks] [-q] [-t] [-r log] [-f [-n blocks] [-b block_size]]"
+                 << " [image [script]]" << endl;
+            return 1;
+        }
+    }
+
+    // the commands come from the script, else from the standard input
+    ifstream script;
+    if (optind < argc) {
+        diskname = argv[optind++];
+    }
+    if (optind < argc) {
+        script.open(argv[optind]);
+        if (!script.is_open()) {
+            cerr << "can't open " << argv[optind] << endl;
+            return 1;
+        }
+    } else if (isatty(STDIN_FILENO)) {
+        shell |= USER_PROMPT;
+    }
+
+    if (format && fs_format(diskname, numBlocks, blockSize) != 0) {
+        return 1;
+    }
+
+    if (fs_mount_cache(diskname, flags, cacheBlocks) != 0) {
+        return 1;
+    }
+
+    if (record && oplog_record_start(record) != 0) {
+        fs_umount(diskname);
+        return 1;
+    }
+
+    batch_buf out;
+    streambuf *terminal = NULL;
+    if (shell & USER_QUIET) {
+        fs_set_quiet(true);
+        terminal = cout.rdbuf(&out);
+    }
+
+    user_info(script.is_open() ? script : cin, shell);
 
-    user_info();
+    // the log of -r or of a record command left running
+    int ret = oplog_recording() && oplog_record_stop() != 0;
+    if (fs_umount(diskname) != 0)
+        ret = 1;
+    if (terminal) {
+        out.drain();
+        cout.rdbuf(terminal);
+    }
 
 
     //dir("/");
@@ -25,6 +152,5 @@ int main()
     //dir("/a");
     //rd("/a/j/k");
 
-    fs_umount(diskname);
-    return 0;
+    return ret;
 }
\ No newline at end of file
@@ -0,0 +1,256 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <unordered_map>
+
+#include "oplog.h"
+
+using namespace std;
+
+/** Signature at the start of every log */
+#define OPLOG_SIGNATURE "FSOPLOG1"
+
+/** Encoder of a log being written */
+struct oplog_writer {
+    FILE *f;
+    /* Time of the previous operation, the next one is stored as a delta */
+    uint64_t last;
+    /* Path -> its index in the table + 1, 0 standing for no path */
+    unordered_map<string, uint64_t> paths;
+};
+
+/* Log of oplog_record_start(), written as the operations come */
+static mutex record_lock;
+static struct oplog_writer recorder;
+static chrono::steady_clock::time_point record_start;
+
+const char *oplog_name(int op)
+{
+    static const char *const names[] = {
+        "unknown", "create", "open", "close", "read", "write", "pread", "pwrite",
+        "cat", "delete", "md", "dir", "rd", "sync", "begin", "commit",
+    };
+    static_assert(sizeof(names) / sizeof(names[0]) == OPLOG_COUNT,
+                  "every operation has a name");
+
+    return op > 0 && op < OPLOG_COUNT ? names[op] : names[0];
+}
+
+static void put_varint(FILE *f, uint64_t v)
+{
+    while (v >= 0x80) {
+        putc((v & 0x7f) | 0x80, f);
+        v >>= 7;
+    }
+    putc(v, f);
+}
+
+/**
+ * get_varint - Read a varint
+ * @f: The log
+ * @v: Filled with the value
+ *
+ * Return: -1 at the end of @f or on a malformed value. 0 otherwise.
+ */
+static int get_varint(FILE *f, uint64_t *v)
+{
+    *v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = getc(f);
+        if (c == EOF)
+            return -1;
+        *v |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return 0;
+    }
+
+    return -1;
+}
+
+/**
+ * writer_open - Create a log
+ * @w: The encoder, set up for the log
+ * @path: File to write
+ *
+ * Return: -1 if @path can't be created. 0 otherwise.
+ */
+static int writer_open(struct oplog_writer *w, const char *path)
+{
+    w->f = fopen(path, "wb");
+    if (!w->f) {
+        perror("fopen");
+        return -1;
+    }
+    w->last = 0;
+    w->paths.clear();
+    fwrite(OPLOG_SIGNATURE, 1, strlen(OPLOG_SIGNATURE), w->f);
+
+    return 0;
+}
+
+static void writer_put(struct oplog_writer *w, const struct oplog_rec &rec)
+{
+    put_varint(w->f, rec.usec > w->last ? rec.usec - w->last : 0);
+    w->last = max(w->last, rec.usec);
+    putc(rec.op, w->f);
+
+    if (rec.path.empty()) {
+        put_varint(w->f, 0);
+    } else {
+        auto it = w->paths.find(rec.path);
+        if (it != w->paths.end()) {
+            put_varint(w->f, it->second);
+        } else {
+            // the next index of the table, followed by the new path
+            uint64_t id = w->paths.size() + 1;
+            w->paths[rec.path] = id;
+            put_varint(w->f, id);
+            put_varint(w->f, rec.path.size());
+            fwrite(rec.path.data(), 1, rec.path.size(), w->f);
+        }
+    }
+
+    put_varint(w->f, rec.a);
+    put_varint(w->f, rec.b);
+}
+
+static int writer_close(struct oplog_writer *w)
+{
+    int ret = ferror(w->f) ? -1 : 0;
+
+    if (fclose(w->f) != 0)
+        ret = -1;
+    w->f = NULL;
+    w->paths.clear();
+    if (ret != 0)
+        cerr << "can't write the operation log" << endl;
+
+    return ret;
+}
+
+int oplog_save(const char *path, const vector<struct oplog_rec> &recs)
+{
+    struct oplog_writer w;
+
+    if (writer_open(&w, path) != 0)
+        return -1;
+    for (const struct oplog_rec &rec : recs)
+        writer_put(&w, rec);
+
+    return writer_close(&w);
+}
+
+int oplog_load(const char *path, vector<struct oplog_rec> *recs)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror("fopen");
+        return -1;
+    }
+
+    char sig[sizeof(OPLOG_SIGNATURE) - 1];
+    if (fread(sig, 1, sizeof(sig), f) != sizeof(sig)
+        || memcmp(sig, OPLOG_SIGNATURE, sizeof(sig)) != 0) {
+        cerr << path << " is not an operation log" << endl;
+        fclose(f);
+        return -1;
+    }
+
+    vector<string> paths;
+    uint64_t usec = 0;
+    uint64_t delta, id;
+    int ret = 0;
+
+    recs->clear();
+    while (get_varint(f, &delta) == 0) {
+        struct oplog_rec rec;
+        int op = getc(f);
+        usec += delta;
+        rec.usec = usec;
+        rec.op = (enum oplog_op)op;
+        if (op <= 0 || op >= OPLOG_COUNT || get_varint(f, &id) != 0 || id > paths.size() + 1) {
+            ret = -1;
+            break;
+        }
+        if (id == paths.size() + 1) {
+            uint64_t len;
+            if (get_varint(f, &len) != 0 || len > 4096) {
+                ret = -1;
+                break;
+            }
+            string p(len, '\0');
+            if (fread(&p[0], 1, len, f) != len) {
+                ret = -1;
+                break;
+            }
+            paths.push_back(p);
+        }
+        if (id)
+            rec.path = paths[id - 1];
+        if (get_varint(f, &rec.a) != 0 || get_varint(f, &rec.b) != 0) {
+            ret = -1;
+            break;
+        }
+        recs->push_back(rec);
+    }
+    fclose(f);
+
+    if (ret != 0)
+        cerr << path << " is truncated or corrupted after "
+             << recs->size() << " operations" << endl;
+
+    return ret;
+}
+
+int oplog_record_start(const char *path)
+{
+    lock_guard<mutex> guard(record_lock);
+
+    if (recorder.f) {
+        cerr << "an operation log is already recorded" << endl;
+        return -1;
+    }
+    if (writer_open(&recorder, path) != 0)
+        return -1;
+    record_start = chrono::steady_clock::now();
+
+    return 0;
+}
+
+void oplog_record(enum oplog_op op, const string &path, uint64_t a, uint64_t b)
+{
+    lock_guard<mutex> guard(record_lock);
+
+    if (!recorder.f)
+        return;
+
+    struct oplog_rec rec;
+    rec.usec = chrono::duration_cast<chrono::microseconds>(
+        chrono::steady_clock::now() - record_start).count();
+    rec.op = op;
+    rec.path = path;
+    rec.a = a;
+    rec.b = b;
+    writer_put(&recorder, rec);
+}
+
+bool oplog_recording(void)
+{
+    lock_guard<mutex> guard(record_lock);
+
+    return recorder.f != NULL;
+}
+
+int oplog_record_stop(void)
+{
+    lock_guard<mutex> guard(record_lock);
+
+    if (!recorder.f) {
+        cerr << "no operation log is recorded" << endl;
+        return -1;
+    }
+
+    return writer_close(&recorder);
+}
@@ -0,0 +1,106 @@
+#ifndef _OPLOG_H
+#define _OPLOG_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/** Operations of an operation log, each replayed with a call of fs.h */
+enum oplog_op {
+    OPLOG_CREATE = 1, // create_file(path, a)
+    OPLOG_OPEN, // open_file(path, a)
+    OPLOG_CLOSE, // close_file(path)
+    OPLOG_READ, // read_file(path, a)
+    OPLOG_WRITE, // write_file(path, a bytes, a)
+    OPLOG_PREAD, // fs_pread() of a bytes at offset b of path
+    OPLOG_PWRITE, // fs_pwrite() of a bytes at offset b of path
+    OPLOG_CAT, // typefile(path)
+    OPLOG_DELETE, // delete_file(path)
+    OPLOG_MD, // md(path)
+    OPLOG_DIR, // dir(path)
+    OPLOG_RD, // rd(path)
+    OPLOG_SYNC, // fs_sync()
+    OPLOG_BEGIN, // fs_batch_begin()
+    OPLOG_COMMIT, // fs_batch_commit()
+    OPLOG_COUNT
+};
+
+/** One operation of a log */
+struct oplog_rec {
+    /* Microseconds since the first operation */
+    uint64_t usec;
+    enum oplog_op op;
+    /* Path of the file or directory, empty for the operations without */
+    std::string path;
+    /* Length, attribute or flag, then offset, see enum oplog_op */
+    uint64_t a;
+    uint64_t b;
+};
+
+/**
+ * oplog_name - Get the name of an operation
+ * @op: The operation
+ *
+ * Return: The name of @op, "unknown" if it is not an operation.
+ */
+const char *oplog_name(int op);
+
+/**
+ * oplog_save - Write an operation log
+ * @path: File to write
+ * @recs: The operations, in time order
+ *
+ * The log is compact: after a signature, each operation takes a varint time
+ * delta, its code, a varint index in a table of the paths that is built as
+ * they first appear, and its two arguments as varints.
+ *
+ * Return: -1 if @path can't be written. 0 otherwise.
+ */
+int oplog_save(const char *path, const std::vector<struct oplog_rec> &recs);
+
+/**
+ * oplog_load - Read an operation log
+ * @path: File written by oplog_save() or the recorder
+ * @recs: Filled with the operations
+ *
+ * Return: -1 if @path can't be read or is not an operation log. 0 otherwise.
+ */
+int oplog_load(const char *path, std::vector<struct oplog_rec> *recs);
+
+/**
+ * oplog_record_start - Start recording the operations of the process
+ * @path: File the log is written to
+ *
+ * Return: -1 if a log is already recorded or @path can't be created. 0
+ * otherwise.
+ */
+int oplog_record_start(const char *path);
+
+/**
+ * oplog_record - Record an operation
+ * @op: The operation
+ * @path: Its path, "" if it has none
+ * @a: Its first argument
+ * @b: Its second argument
+ *
+ * Nothing is recorded unless oplog_record_start() was called. Any thread may
+ * record.
+ */
+void oplog_record(enum oplog_op op, const std::string &path, uint64_t a, uint64_t b);
+
+/**
+ * oplog_recording - Tell whether the operations are recorded
+ *
+ * Return: true between oplog_record_start() and oplog_record_stop().
+ */
+bool oplog_recording(void);
+
+/**
+ * oplog_record_stop - Stop recording and close the log
+ *
+ * Return: -1 if no log was recorded or it can't be written. 0 otherwise.
+ */
+int oplog_record_stop(void);
+
+#endif
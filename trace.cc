@@ -0,0 +1,162 @@
+#include <unistd.h>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+#include "trace.h"
+
+using namespace std;
+
+/** One recorded event */
+struct trace_rec {
+    /* Name of the span, not copied */
+    const char *name;
+    /* Nanoseconds on the steady clock */
+    uint64_t ts;
+    uint64_t block;
+    uint64_t count;
+    /* Thread that recorded the event */
+    uint32_t tid;
+    char phase;
+};
+
+/**
+ * Events of one thread. Only the owner thread writes them, and publishes each
+ * one by moving @head with a release store.
+ */
+struct trace_ring {
+    struct trace_rec recs[TRACE_RING_EVENTS];
+    /* Events recorded so far, the next one goes to recs[head % size] */
+    atomic<uint64_t> head;
+};
+
+/** Ring of a thread, handed back for another thread when it exits */
+struct ring_owner {
+    struct trace_ring *ring;
+    uint32_t tid;
+    ~ring_owner();
+};
+
+atomic<bool> trace_enabled(false);
+
+/* Every ring ever created, and those of the threads that exited */
+static mutex rings_lock;
+static vector<struct trace_ring *> rings;
+static vector<struct trace_ring *> free_rings;
+static uint32_t next_tid = 1;
+
+/* Steady clock time of trace_start(), older events are not dumped */
+static atomic<uint64_t> trace_since(0);
+
+static thread_local struct ring_owner owner;
+
+ring_owner::~ring_owner()
+{
+    if (ring) {
+        lock_guard<mutex> guard(rings_lock);
+        free_rings.push_back(ring);
+    }
+}
+
+/**
+ * now_ns - Read the steady clock
+ *
+ * Return: The time in nanoseconds.
+ */
+static uint64_t now_ns()
+{
+    return chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void trace_start(void)
+{
+    trace_since = now_ns();
+    trace_enabled = true;
+}
+
+void trace_stop(void)
+{
+    trace_enabled = false;
+}
+
+void trace_event(const char *name, char phase, uint64_t block, uint64_t count)
+{
+    if (!trace_on()) {
+        return;
+    }
+
+    // the first event of a thread takes a ring, later ones take no lock
+    if (!owner.ring) {
+        lock_guard<mutex> guard(rings_lock);
+        if (free_rings.empty()) {
+            owner.ring = new struct trace_ring();
+            rings.push_back(owner.ring);
+        } else {
+            owner.ring = free_rings.back();
+            free_rings.pop_back();
+        }
+        owner.tid = next_tid++;
+    }
+
+    struct trace_ring *ring = owner.ring;
+    uint64_t head = ring->head.load(memory_order_relaxed);
+    struct trace_rec &rec = ring->recs[head % TRACE_RING_EVENTS];
+
+    rec.name = name;
+    rec.ts = now_ns();
+    rec.block = block;
+    rec.count = count;
+    rec.tid = owner.tid;
+    rec.phase = phase;
+    ring->head.store(head + 1, memory_order_release);
+}
+
+int trace_dump(const char *path)
+{
+    if (trace_on()) {
+        cerr << "stop tracing before dumping it" << endl;
+        return -1;
+    }
+
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror("fopen");
+        return -1;
+    }
+
+    uint64_t since = trace_since.load();
+    bool first = true;
+
+    fprintf(f, "{\"traceEvents\": [\n");
+    lock_guard<mutex> guard(rings_lock);
+    for (struct trace_ring *ring : rings) {
+        uint64_t head = ring->head.load(memory_order_acquire);
+        // the slot at head may still be written by an event begun before
+        // trace_stop(): it is the oldest one of a full ring, skip it
+        uint64_t i = head >= TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS + 1 : 0;
+        for (; i < head; i++) {
+            const struct trace_rec &rec = ring->recs[i % TRACE_RING_EVENTS];
+            if (rec.ts < since)
+                continue;
+            fprintf(f, "%s{\"name\": \"%s\", \"ph\": \"%c\", \"ts\": %.3f, "
+                    "\"pid\": %d, \"tid\": %u", first ? "" : ",\n", rec.name,
+                    rec.phase, (rec.ts - since) / 1000.0, (int)getpid(), rec.tid);
+            if (rec.count)
+                fprintf(f, ", \"args\": {\"block\": %llu, \"count\": %llu}",
+                        (unsigned long long)rec.block, (unsigned long long)rec.count);
+            fprintf(f, "}");
+            first = false;
+        }
+    }
+    fprintf(f, "\n], \"displayTimeUnit\": \"ns\"}\n");
+
+    if (fclose(f) != 0) {
+        perror("fclose");
+        return -1;
+    }
+
+    return 0;
+}
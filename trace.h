@@ -0,0 +1,81 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+
+/** Events kept per thread, the oldest ones are overwritten */
+#define TRACE_RING_EVENTS 16384
+
+/** Set while trace_start() is in effect, see trace_on() */
+extern std::atomic<bool> trace_enabled;
+
+/**
+ * trace_start - Start recording events
+ *
+ * Every thread records its events in a ring of its own, without any lock,
+ * so tracing may stay on under load. Events recorded before this call are
+ * left out of the next trace_dump().
+ */
+void trace_start(void);
+
+/**
+ * trace_stop - Stop recording events
+ *
+ * The events recorded so far stay in the rings for trace_dump().
+ */
+void trace_stop(void);
+
+/**
+ * trace_on - Tell whether events are recorded
+ *
+ * Return: true between trace_start() and trace_stop().
+ */
+static inline bool trace_on(void)
+{
+    return trace_enabled.load(std::memory_order_relaxed);
+}
+
+/**
+ * trace_event - Record an event of the calling thread
+ * @name: Name of the span, a string that outlives the trace
+ * @phase: 'B' where the span begins, 'E' where it ends
+ * @block: First block moved by the span, for block I/Os
+ * @count: Number of blocks, 0 if the span moves none
+ *
+ * Nothing is recorded unless trace_on().
+ */
+void trace_event(const char *name, char phase, uint64_t block, uint64_t count);
+
+/**
+ * trace_dump - Write the recorded events as a Chrome trace
+ * @path: File to write, in the trace event JSON format
+ *
+ * The last %TRACE_RING_EVENTS events of every thread since trace_start() are
+ * written, one track per thread, for chrome://tracing or Perfetto. Events are
+ * only complete once trace_stop() was called.
+ *
+ * Return: -1 if tracing is on or @path can't be written. 0 otherwise.
+ */
+int trace_dump(const char *path);
+
+/** Records a span for the life of a scope */
+struct trace_scope {
+    const char *name;
+    uint64_t block;
+    uint64_t count;
+    trace_scope(const char *name, uint64_t block = 0, uint64_t count = 0)
+        : name(name), block(block), count(count)
+    {
+        if (trace_on())
+            trace_event(name, 'B', block, count);
+    }
+    ~trace_scope()
+    {
+        if (trace_on())
+            trace_event(name, 'E', block, count);
+    }
+};
+
+#endif
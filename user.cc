@@ -1,3 +1,4 @@
+#include <chrono>
 #include <iostream>
 #include <fstream>
 #include <sstream>
@@ -6,9 +7,15 @@
 #include <cstdlib>
 
 #include "fs.h"
+#include "oplog.h"
+#include "trace.h"
+#include "user.h"
 
 using namespace std;
 
+/* user_info() flags of the running shell */
+static int shell_flags;
+
 void show_help() {
     cout << "the command be supported:" << endl;
     cout << "  ls                              - list current file and directory" << endl;
@@ -21,11 +28,19 @@ void show_help() {
     cout << "  close <filename>                - close the file" << endl;
     cout << "  mkdir <dirname>                 - create a directory" << endl;
     cout << "  rmdir <dirname>                 - delete a directory" << endl;
+    cout << "  info                            - show file system and cache info" << endl;
+    cout << "  stats                           - show call counts, latencies and I/O" << endl;
+    cout << "  check                           - check the FAT and the directories" << endl;
+    cout << "  trace start | stop <file>       - record calls and block I/O, dump them" << endl;
+    cout << "  record start <file> | stop      - log the commands for fs_workload -p" << endl;
+    cout << "  sync                            - flush the file system to the disk" << endl;
+    cout << "  begin                           - start a batch of commands" << endl;
+    cout << "  commit                          - write out the batch started by begin" << endl;
     cout << "  exit                            - exit the program" << endl;
 }
 
 // command parser
-void execute_command(const string& input) {
+int execute_command(const string& input) {
     istringstream iss(input);
     string command;
     iss >> command;
@@ -37,16 +52,17 @@ void execute_command(const string& input) {
         string dirPath;
         iss >> dirPath;
         if (dirPath.empty()) {
-            dir("/");
-        } else {
-            dir(dirPath);
+            dirPath = "/";
         }
+        oplog_record(OPLOG_DIR, dirPath, 0, 0);
+        dir(dirPath);
     } else if (command == "touch") {
         string filename;
         iss >> filename;
         int attribute;
         iss >> attribute;
         if (!filename.empty()) {
+            oplog_record(OPLOG_CREATE, filename, attribute, 0);
             create_file(filename, attribute);
         } else {
             cerr << "Use: touch <filename> <attribute>" << endl;
@@ -55,6 +71,7 @@ void execute_command(const string& input) {
         string filename;
         iss >> filename;
         if (!filename.empty()) {
+            oplog_record(OPLOG_CAT, filename, 0, 0);
             typefile(filename);
         } else {
             cerr << "Use: cat <filename>" << endl;
@@ -65,6 +82,7 @@ void execute_command(const string& input) {
         int length = 0;
         iss >> length;
         if (!filename.empty() && length != 0) {
+            oplog_record(OPLOG_READ, filename, length, 0);
             read_file(filename, length);
         } else {
             cerr << "Use: read <filename> <length>" << endl;
@@ -88,8 +106,10 @@ void execute_command(const string& input) {
                 text = text.substr(0, pos);
             } else {
                 cerr << "Use: echo <filename> <text> <length>" << endl;
-                return;
+                return 0;
             }
+            // the log keeps the length only, not the text
+            oplog_record(OPLOG_WRITE, filename, length, 0);
             write_file(filename, text, length);
         } else {
             cerr << "Use: echo <filename> <text> <length>" << endl;
@@ -98,6 +118,7 @@ void execute_command(const string& input) {
         string filename;
         iss >> filename;
         if (!filename.empty()) {
+            oplog_record(OPLOG_DELETE, filename, 0, 0);
             delete_file(filename);
         } else {
             cerr << "Use: rm <filename>" << endl;
@@ -108,7 +129,10 @@ void execute_command(const string& input) {
         int flag;
         iss >> flag;
         if (!filename.empty()) {
-            open_file(filename, flag);
+            oplog_record(OPLOG_OPEN, filename, flag, 0);
+            int fd = open_file(filename, flag);
+            if (fd != -1)
+                cout << "open success, fd = " << fd << endl;
         } else {
             cerr << "Use: open <filename> <flag>" << endl;
         }
@@ -116,6 +140,7 @@ void execute_command(const string& input) {
         string filename;
         iss >> filename;
         if (!filename.empty()) {
+            oplog_record(OPLOG_CLOSE, filename, 0, 0);
             close_file(filename);
         } else {
             cerr << "Use: close <filename>" << endl;
@@ -124,6 +149,7 @@ void execute_command(const string& input) {
         string dirname;
         iss >> dirname;
         if (!dirname.empty()) {
+            oplog_record(OPLOG_MD, dirname, 0, 0);
             md(dirname);
         } else {
             cerr << "Use: mkdir <dirname>" << endl;
@@ -132,30 +158,95 @@ void execute_command(const string& input) {
         string dirname;
         iss >> dirname;
         if (!dirname.empty()) {
+            oplog_record(OPLOG_RD, dirname, 0, 0);
             rd(dirname);
         } else {
             cerr << "Use: rmdir <dirname>" << endl;
         }
+    } else if (command == "info") {
+        fs_info();
+    } else if (command == "stats") {
+        fs_stats();
+    } else if (command == "check") {
+        fs_check();
+    } else if (command == "trace") {
+        string action, filename;
+        iss >> action >> filename;
+        if (action == "start") {
+            trace_start();
+        } else if (action == "stop" && !filename.empty()) {
+            trace_stop();
+            if (trace_dump(filename.c_str()) == 0 && !(shell_flags & USER_QUIET))
+                cout << "trace written to " << filename << endl;
+        } else {
+            cerr << "Use: trace start | trace stop <file>" << endl;
+        }
+    } else if (command == "record") {
+        string action, filename;
+        iss >> action >> filename;
+        if (action == "start" && !filename.empty()) {
+            if (oplog_record_start(filename.c_str()) == 0 && !(shell_flags & USER_QUIET))
+                cout << "recording to " << filename << endl;
+        } else if (action == "stop") {
+            if (oplog_record_stop() == 0 && !(shell_flags & USER_QUIET))
+                cout << "recording stopped" << endl;
+        } else {
+            cerr << "Use: record start <file> | record stop" << endl;
+        }
+    } else if (command == "sync") {
+        oplog_record(OPLOG_SYNC, "", 0, 0);
+        fs_sync();
+    } else if (command == "begin") {
+        oplog_record(OPLOG_BEGIN, "", 0, 0);
+        fs_batch_begin();
+    } else if (command == "commit") {
+        oplog_record(OPLOG_COMMIT, "", 0, 0);
+        fs_batch_commit();
     } else if (command == "exit") {
-        cout << "exit the file system" << endl;
-        fs_umount("disk.txt");
-        exit(0);
+        if (!(shell_flags & USER_QUIET))
+            cout << "exit the file system" << endl;
+        return 1;
     } else {
         cerr << "unknown command: " << command << endl;
         show_help();
     }
+
+    return 0;
 }
 
-void user_info()
+void user_info(istream &in, int flags)
 {
-    cout << "Welcome using File Manage System! input 'help' to check the command." << endl;
+    typedef chrono::steady_clock clock;
+    long long total = 0; // microseconds spent in the commands
+    size_t commands = 0;
+
+    shell_flags = flags;
+    if (flags & USER_PROMPT)
+        cout << "Welcome using File Manage System! input 'help' to check the command." << endl;
 
     string input;
-    while (true) {
-        cout << "user@filesystem:~$ ";
-        getline(cin, input);
-        if (!input.empty()) {
-            execute_command(input);
+    for (;;) {
+        if (flags & USER_PROMPT)
+            cout << "user@filesystem:~$ ";
+        if (!getline(in, input))
+            break;
+        // blank lines and comments of a script
+        size_t first = input.find_first_not_of(" \t");
+        if (first == string::npos || input[first] == '#')
+            continue;
+
+        clock::time_point start = clock::now();
+        int done = execute_command(input);
+        long long usec = chrono::duration_cast<chrono::microseconds>(clock::now() - start).count();
+        if (flags & USER_TIMING) {
+            cout << "time " << usec << " us: " << input << endl;
+            total += usec;
+            commands++;
         }
+        if (done)
+            break;
     }
+
+    if (flags & USER_TIMING)
+        cout << "total " << total << " us, " << commands << " commands" << endl;
 }
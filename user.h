@@ -1,10 +1,20 @@
 #ifndef _USER_H
 #define _USER_H
 
+#include <istream>
 #include <string>
 
 using namespace std;
 
+/** user_info() flag: print a greeting and a prompt before each command */
+#define USER_PROMPT 0x1
+
+/** user_info() flag: print only the errors and the data asked for */
+#define USER_QUIET 0x2
+
+/** user_info() flag: print the time each command took, and the total */
+#define USER_TIMING 0x4
+
 /**
  * show_help - show the helo infomation
 */
@@ -15,12 +25,19 @@ void show_help();
  * @input: the string user input
  * 
  * execute the command
+ *
+ * Return: 1 if the command was exit, 0 otherwise
 */
-void execute_command(const string& input);
+int execute_command(const string& input);
 
 /**
- * user_info - main function
+ * user_info - run the commands of the user
+ * @in: where the commands are read, one per line
+ * @flags: bitwise or of USER_* flags
+ *
+ * Blank lines and lines starting with '#' are skipped. Stop at the exit
+ * command or at the end of @in. The file system stays mounted.
 */
-void user_info();
+void user_info(istream &in, int flags);
 
 #endif
\ No newline at end of file
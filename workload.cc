@@ -0,0 +1,623 @@
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <set>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "fs.h"
+#include "oplog.h"
+
+/*
+ * Workload generator and replayer. A synthetic profile, or an operation log
+ * recorded by the shell, is run against a scratch image and one JSON object
+ * is printed: throughput, latency percentiles, and the same per operation.
+ *
+ * In the closed loop each operation starts when the previous one returns. In
+ * the open loop operations start at the times of the log, so the latency of
+ * an operation counts from its due time: the time spent queued behind slow
+ * operations is part of it.
+ */
+
+/* Swallows the messages the operations print */
+class null_buf : public streambuf {
+protected:
+    int overflow(int c) { return c; }
+};
+
+/* Options of the run */
+struct wl_opts {
+    const char *image;
+    size_t numBlocks;
+    size_t blockSize;
+    size_t cacheBlocks; // 0 for the default
+    int flags;
+    bool keep; // run on the image as it is, else format it
+    const char *profile;
+    const char *save; // log of the generated operations, NULL for none
+    const char *replay; // log to run instead of a profile, NULL for none
+    uint64_t seed;
+    int ops; // operations to generate, before the cleanup
+    size_t minSize; // file sizes in bytes, 0 for the profile default
+    size_t maxSize;
+    int maxDepth; // directories above the files, -1 for the profile default
+    double rate; // operations per second of the generated log
+    double speed; // open loop: the log is run this many times faster
+    bool openLoop;
+};
+
+/* Bytes moved by one pread or pwrite of the profiles */
+#define WL_CHUNK (64 * 1024)
+
+/* Subdirectories per directory of the generated trees */
+#define WL_FANOUT 4
+
+static null_buf devnull;
+
+/**
+ * quiet - silence or restore the messages of the operations
+ * @on: silence them if set
+*/
+static void quiet(bool on)
+{
+    static streambuf *out, *err;
+
+    if (on) {
+        out = cout.rdbuf(&devnull);
+        err = cerr.rdbuf(&devnull);
+    } else {
+        cout.rdbuf(out);
+        cerr.rdbuf(err);
+    }
+}
+
+/*
+ * Builds the log of a profile. Sizes are drawn log-uniform between the size
+ * bounds and depths uniform up to the maximum depth, from a seeded generator,
+ * so a seed always gives the same log. Arrivals are Poisson at the rate of
+ * the options.
+ */
+class generator {
+public:
+    generator(const wl_opts &o) : o(o), rng(o.seed), usec(0), names(0) {}
+
+    vector<struct oplog_rec> run();
+
+private:
+    const wl_opts &o;
+    mt19937_64 rng;
+    double usec;
+    int names;
+    vector<struct oplog_rec> log;
+    set<string> dirs; // directories made, besides the root
+    vector<string> files; // files that exist
+    vector<string> opened; // files open for pread and pwrite
+
+    void emit(enum oplog_op op, const string &path = "", uint64_t a = 0, uint64_t b = 0);
+    size_t size();
+    string dir_at(int depth);
+    string new_file(const string &dir);
+    string take_file();
+    void churn(const string &path, size_t size);
+    void stream(const string &path, size_t size);
+    void cleanup();
+};
+
+void generator::emit(enum oplog_op op, const string &path, uint64_t a, uint64_t b)
+{
+    exponential_distribution<double> gap(o.rate / 1e6);
+
+    usec += gap(rng);
+    log.push_back(oplog_rec{(uint64_t)usec, op, path, a, b});
+}
+
+/**
+ * size - draw a file size
+*/
+size_t generator::size()
+{
+    uniform_real_distribution<double> bits(log2(o.minSize), log2(o.maxSize));
+
+    return (size_t)exp2(bits(rng));
+}
+
+/**
+ * dir_at - draw a directory, made with its parents if needed
+ * @depth: its depth, 0 for the root
+ *
+ * Return: the path of the directory, "" for the root
+*/
+string generator::dir_at(int depth)
+{
+    uniform_int_distribution<int> sub(0, WL_FANOUT - 1);
+    string dir;
+
+    for (int d = 0; d < depth; d++) {
+        dir += "/d" + to_string(sub(rng));
+        if (dirs.insert(dir).second)
+            emit(OPLOG_MD, dir);
+    }
+
+    return dir;
+}
+
+/**
+ * new_file - create a file
+ * @dir: the directory of the file, "" for the root
+ *
+ * Return: the path of the file
+*/
+string generator::new_file(const string &dir)
+{
+    static const char digits[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+    string path;
+
+    // names hold FS_FILENAME_LEN characters, skip those still in use
+    do {
+        string name;
+        for (int k = 0, i = names++ % (36 * 36 * 36); k < 3; k++, i /= 36)
+            name += digits[i % 36];
+        path = dir + "/" + name + ".t";
+    } while (find(files.begin(), files.end(), path) != files.end());
+
+    emit(OPLOG_CREATE, path);
+    files.push_back(path);
+
+    return path;
+}
+
+/**
+ * take_file - pick a closed file and forget it
+ *
+ * Return: its path, "" if every file is open
+*/
+string generator::take_file()
+{
+    vector<size_t> closed;
+
+    for (size_t i = 0; i < files.size(); i++)
+        if (find(opened.begin(), opened.end(), files[i]) == opened.end())
+            closed.push_back(i);
+    if (closed.empty())
+        return "";
+
+    size_t i = closed[uniform_int_distribution<size_t>(0, closed.size() - 1)(rng)];
+    string path = files[i];
+    files.erase(files.begin() + i);
+
+    return path;
+}
+
+/**
+ * churn - write and read back a small file
+ *
+ * write_file() and read_file() open and close the file themselves.
+*/
+void generator::churn(const string &path, size_t size)
+{
+    emit(OPLOG_WRITE, path, size);
+    emit(OPLOG_READ, path, size);
+    if (uniform_int_distribution<int>(0, 3)(rng) == 0)
+        emit(OPLOG_CAT, path);
+}
+
+/**
+ * stream - write then read a file sequentially
+*/
+void generator::stream(const string &path, size_t size)
+{
+    emit(OPLOG_OPEN, path, 1);
+    for (size_t off = 0; off < size; off += WL_CHUNK)
+        emit(OPLOG_PWRITE, path, min<size_t>(WL_CHUNK, size - off), off);
+    for (size_t off = 0; off < size; off += WL_CHUNK)
+        emit(OPLOG_PREAD, path, min<size_t>(WL_CHUNK, size - off), off);
+    emit(OPLOG_CLOSE, path);
+}
+
+/**
+ * cleanup - close and delete the files, remove the directories
+*/
+void generator::cleanup()
+{
+    for (const string &path : opened)
+        emit(OPLOG_CLOSE, path);
+    opened.clear();
+    for (const string &path : files)
+        emit(OPLOG_DELETE, path);
+    files.clear();
+    // the longest paths first: children go before their parents
+    vector<string> order(dirs.begin(), dirs.end());
+    sort(order.begin(), order.end(), [](const string &a, const string &b) {
+        return a.size() > b.size();
+    });
+    for (const string &dir : order)
+        emit(OPLOG_RD, dir);
+    dirs.clear();
+}
+
+vector<struct oplog_rec> generator::run()
+{
+    uniform_int_distribution<int> depth(0, o.maxDepth);
+    uniform_int_distribution<int> percent(0, 99);
+    string profile = o.profile;
+
+    if (profile == "mixed") {
+        // files kept open for the random reads and writes
+        for (int i = 0; i < 16; i++) {
+            string path = new_file(dir_at(depth(rng)));
+            size_t n = size();
+            emit(OPLOG_OPEN, path, 1);
+            for (size_t off = 0; off < n; off += WL_CHUNK)
+                emit(OPLOG_PWRITE, path, min<size_t>(WL_CHUNK, n - off), off);
+            opened.push_back(path);
+        }
+    }
+
+    while (log.size() < (size_t)o.ops) {
+        if (profile == "churn") {
+            // a window of files, one of them deleted at random
+            churn(new_file(dir_at(depth(rng))), size());
+            if (files.size() > 16)
+                emit(OPLOG_DELETE, take_file());
+        } else if (profile == "stream") {
+            stream(new_file(dir_at(depth(rng))), size());
+            emit(OPLOG_DELETE, take_file());
+        } else if (profile == "tree") {
+            int p = percent(rng);
+            if (p < 40) {
+                // a new leaf, made with its parents
+                dir_at(o.maxDepth);
+            } else if (p < 70 || files.empty()) {
+                new_file(dir_at(depth(rng)));
+            } else if (p < 85) {
+                emit(OPLOG_DIR, dir_at(depth(rng)) + "/");
+            } else {
+                emit(OPLOG_DELETE, take_file());
+            }
+        } else {
+            int p = percent(rng);
+            const string &path = opened[uniform_int_distribution<size_t>(0, opened.size() - 1)(rng)];
+            // blocks written by the setup, every file has a chunk at least
+            uint64_t off = uniform_int_distribution<uint64_t>(0, o.minSize / 4096)(rng) * 4096;
+            if (p < 40) {
+                emit(OPLOG_PREAD, path, 4096, off);
+            } else if (p < 70) {
+                emit(OPLOG_PWRITE, path, 4096, off);
+            } else if (p < 80) {
+                churn(new_file(dir_at(depth(rng))), min<size_t>(size(), 16384));
+            } else if (p < 90 && files.size() > opened.size()) {
+                emit(OPLOG_DELETE, take_file());
+            } else if (p < 95) {
+                emit(OPLOG_DIR, dir_at(depth(rng)) + "/");
+            } else {
+                emit(OPLOG_SYNC);
+            }
+        }
+    }
+    cleanup();
+
+    return log;
+}
+
+/* Runs the operations of a log, with the descriptors it opened */
+struct player {
+    unordered_map<string, int> fds;
+    vector<char> buf;
+    string data;
+
+    int run(const struct oplog_rec &rec);
+    int fd_of(const string &path);
+};
+
+/**
+ * fd_of - get the descriptor of a file, opened if needed
+ *
+ * Return: the descriptor, -1 if the file can't be opened
+*/
+int player::fd_of(const string &path)
+{
+    auto it = fds.find(path);
+    if (it != fds.end())
+        return it->second;
+
+    int fd = open_file(path, 1);
+    if (fd >= 0)
+        fds[path] = fd;
+    return fd;
+}
+
+/**
+ * run - run one operation
+ *
+ * Written bytes are filler, logs only keep their length.
+ *
+ * Return: -1 if the operation failed, 0 otherwise
+*/
+int player::run(const struct oplog_rec &rec)
+{
+    const string &path = rec.path;
+    int fd;
+
+    if (data.size() < rec.a && (rec.op == OPLOG_WRITE || rec.op == OPLOG_PWRITE))
+        data.resize(rec.a, 'w');
+    if (buf.size() < rec.a && rec.op == OPLOG_PREAD)
+        buf.resize(rec.a);
+
+    switch (rec.op) {
+    case OPLOG_CREATE:
+        return create_file(path, (char)rec.a);
+    case OPLOG_OPEN:
+        fd = open_file(path, (int)rec.a);
+        if (fd < 0)
+            return -1;
+        fds[path] = fd;
+        return 0;
+    case OPLOG_CLOSE:
+        fds.erase(path);
+        return close_file(path);
+    case OPLOG_READ:
+        return read_file(path, (int)rec.a) < 0 ? -1 : 0;
+    case OPLOG_WRITE:
+        return write_file(path, data.substr(0, rec.a), (int)rec.a) < 0 ? -1 : 0;
+    case OPLOG_PREAD:
+        fd = fd_of(path);
+        return fd < 0 || fs_pread(fd, buf.data(), rec.a, rec.b) < 0 ? -1 : 0;
+    case OPLOG_PWRITE:
+        fd = fd_of(path);
+        return fd < 0 || fs_pwrite(fd, data.data(), rec.a, rec.b) != (ssize_t)rec.a ? -1 : 0;
+    case OPLOG_CAT:
+        return typefile(path);
+    case OPLOG_DELETE:
+        fds.erase(path);
+        return delete_file(path);
+    case OPLOG_MD:
+        return md(path);
+    case OPLOG_DIR:
+        return dir(path);
+    case OPLOG_RD:
+        return rd(path);
+    case OPLOG_SYNC:
+        return fs_sync();
+    case OPLOG_BEGIN:
+        return fs_batch_begin();
+    case OPLOG_COMMIT:
+        return fs_batch_commit();
+    default:
+        return -1;
+    }
+}
+
+/**
+ * percentile - get a latency percentile
+ * @sorted: the latencies, in increasing order
+ * @p: the percentile, between 0 and 1
+*/
+static double percentile(const vector<double> &sorted, double p)
+{
+    size_t i = (size_t)(p * sorted.size());
+
+    return sorted.empty() ? 0 : sorted[min(i, sorted.size() - 1)];
+}
+
+/**
+ * replay - run a log and print its results
+ * @log: the operations, in time order
+ *
+ * Return: the number of operations that failed
+*/
+static int replay(const wl_opts &o, const vector<struct oplog_rec> &log)
+{
+    typedef chrono::steady_clock clock;
+    vector<double> lat(log.size());
+    struct fs_stats before, after;
+    struct player p;
+    int errors = 0;
+
+    fs_get_stats(&before);
+    clock::time_point start = clock::now();
+    for (size_t i = 0; i < log.size(); i++) {
+        clock::time_point due = clock::now();
+        if (o.openLoop) {
+            clock::time_point at = start + chrono::microseconds((uint64_t)(log[i].usec / o.speed));
+            // on time: the oversleep is ours, not the file system's
+            if (at > due) {
+                this_thread::sleep_until(at);
+                due = clock::now();
+            } else {
+                due = at;
+            }
+        }
+        if (p.run(log[i]) != 0)
+            errors++;
+        lat[i] = chrono::duration<double, micro>(clock::now() - due).count();
+    }
+    double total = chrono::duration<double>(clock::now() - start).count();
+    fs_get_stats(&after);
+
+    size_t bytes = after.bytes_read + after.bytes_written
+                   - before.bytes_read - before.bytes_written;
+    vector<double> sorted(lat);
+    sort(sorted.begin(), sorted.end());
+
+    printf("{\n  \"workload\": \"%s\", ", o.replay ? o.replay : o.profile);
+    if (!o.replay)
+        printf("\"seed\": %llu, ", (unsigned long long)o.seed);
+    printf("\"loop\": \"%s\",\n", o.openLoop ? "open" : "closed");
+    printf("  \"ops\": %zu, \"errors\": %d, \"seconds\": %.3f, \"ops_per_sec\": %.1f, "
+           "\"mb_per_sec\": %.2f,\n", log.size(), errors, total,
+           total > 0 ? log.size() / total : 0.0, total > 0 ? bytes / total / 1e6 : 0.0);
+    printf("  \"p50_us\": %.2f, \"p99_us\": %.2f, \"p999_us\": %.2f, \"max_us\": %.2f,\n",
+           percentile(sorted, 0.5), percentile(sorted, 0.99), percentile(sorted, 0.999),
+           sorted.empty() ? 0.0 : sorted.back());
+    printf("  \"by_op\": [");
+
+    bool first = true;
+    for (int op = 1; op < OPLOG_COUNT; op++) {
+        vector<double> of;
+        for (size_t i = 0; i < log.size(); i++)
+            if (log[i].op == op)
+                of.push_back(lat[i]);
+        if (of.empty())
+            continue;
+        sort(of.begin(), of.end());
+        printf("%s\n    {\"op\": \"%s\", \"count\": %zu, \"p50_us\": %.2f, \"p99_us\": %.2f}",
+               first ? "" : ",", oplog_name(op), of.size(),
+               percentile(of, 0.5), percentile(of, 0.99));
+        first = false;
+    }
+    printf("\n  ]\n}\n");
+
+    return errors;
+}
+
+/**
+ * profile_defaults - fill the options left to the profile
+ *
+ * Return: -1 if the profile is unknown, 0 otherwise
+*/
+static int profile_defaults(wl_opts *o)
+{
+    static const struct {
+        const char *name;
+        size_t minSize, maxSize;
+        int maxDepth;
+    } profiles[] = {
+        {"churn", 128, 16384, 2},
+        {"stream", 1 << 20, 8 << 20, 0},
+        {"tree", 128, 4096, 6},
+        {"mixed", 64 * 1024, 1 << 20, 2},
+    };
+
+    for (const auto &p : profiles) {
+        if (strcmp(o->profile, p.name) != 0)
+            continue;
+        if (!o->minSize)
+            o->minSize = p.minSize;
+        if (!o->maxSize)
+            o->maxSize = max(p.maxSize, o->minSize);
+        if (o->maxDepth < 0)
+            o->maxDepth = p.maxDepth;
+        return 0;
+    }
+
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    wl_opts o = {"workload.img", 65536, 1024, 0, 0, false, "mixed", NULL, NULL,
+                 1, 1000, 0, 0, -1, 1000, 1, false};
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:n:b:c:mkP:s:o:S:M:d:r:p:R:x:L:")) != -1) {
+        switch (opt) {
+        case 'i': // scratch image, overwritten unless -k
+            o.image = optarg;
+            break;
+        case 'n':
+            o.numBlocks = strtoull(optarg, NULL, 0);
+            break;
+        case 'b':
+            o.blockSize = strtoull(optarg, NULL, 0);
+            break;
+        case 'c':
+            o.cacheBlocks = strtoull(optarg, NULL, 0);
+            break;
+        case 'm':
+            o.flags |= FS_MOUNT_MMAP;
+            break;
+        case 'k': // the log runs on the files of the image
+            o.keep = true;
+            break;
+        case 'P': // churn, stream, tree or mixed
+            o.profile = optarg;
+            break;
+        case 's':
+            o.seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'o':
+            o.ops = atoi(optarg);
+            break;
+        case 'S':
+            o.minSize = strtoull(optarg, NULL, 0);
+            break;
+        case 'M':
+            o.maxSize = strtoull(optarg, NULL, 0);
+            break;
+        case 'd':
+            o.maxDepth = atoi(optarg);
+            break;
+        case 'r': // write the generated log
+            o.save = optarg;
+            break;
+        case 'p': // run a log instead of a profile
+            o.replay = optarg;
+            break;
+        case 'R': // operations per second of the generated log
+            o.rate = atof(optarg);
+            break;
+        case 'x': // open loop: speed up the log by this factor
+            o.speed = atof(optarg);
+            break;
+        case 'L':
+            o.openLoop = strcmp(optarg, "open") == 0;
+            break;
+        default:
+            cerr << "Use: " << argv[0] << " [-i image] [-n blocks] [-b block_size] [-c cache_blocks] [-m] [-k]"
+                 << " [-P churn|stream|tree|mixed] [-s seed] [-o ops] [-S min_size] [-M max_size]"
+                 << " [-d max_depth] [-R rate] [-r save_log] [-p replay_log]"
+                 << " [-L open|closed] [-x speed]" << endl;
+            return 1;
+        }
+    }
+
+    vector<struct oplog_rec> log;
+    if (o.replay) {
+        if (oplog_load(o.replay, &log) != 0)
+            return 1;
+    } else {
+        if (profile_defaults(&o) != 0) {
+            cerr << "unknown profile " << o.profile << endl;
+            return 1;
+        }
+        if (o.ops <= 0 || o.rate <= 0 || o.minSize == 0 || o.minSize > o.maxSize) {
+            cerr << "the operations, the rate and the sizes must be positive,"
+                 << " the minimum size at most the maximum" << endl;
+            return 1;
+        }
+        log = generator(o).run();
+        if (o.save && oplog_save(o.save, log) != 0)
+            return 1;
+    }
+    if (o.speed <= 0) {
+        cerr << "the speed must be positive" << endl;
+        return 1;
+    }
+
+    quiet(true);
+    if ((!o.keep && fs_format(o.image, o.numBlocks, o.blockSize) != 0)
+        || fs_mount_cache(o.image, o.flags, o.cacheBlocks) != 0) {
+        quiet(false);
+        cerr << "can't prepare " << o.image << endl;
+        return 1;
+    }
+    // the results are printed with printf(), past the silenced cout
+    fs_set_quiet(true);
+    int errors = replay(o, log);
+    fs_umount(o.image);
+    quiet(false);
+
+    if (!o.keep)
+        unlink(o.image);
+
+    return errors ? 1 : 0;
+}